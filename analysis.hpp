@@ -0,0 +1,289 @@
+#ifndef ANALYSIS_H_
+#define ANALYSIS_H_
+
+// Standard headers
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "mesh.hpp"
+#include "thread_pool.hpp"
+#include "traversal.hpp"
+
+// Quality metrics of a built BVH, for comparing builders and catching
+// regressions offline
+
+// Triangles per chunk when measuring EPO
+constexpr int BVH_EPO_GRAIN = 1024;
+
+struct BVHQuality {
+	float sah_cost = 0.0f;
+	int nodes = 0;
+	int leaves = 0;
+	int max_depth = 0;
+	float mean_depth = 0.0f;		// Over leaves
+	std::vector <int> depths;		// Leaves per depth
+	double overlap_volume = 0.0;		// Summed over sibling pairs
+	double overlap_ratio = 0.0;		// Relative to the root volume
+	double epo = 0.0;
+};
+
+inline double volume(const BBox &box)
+{
+	glm::vec3 size = glm::max(box.max - box.min, 0.0f);
+	return (double) size.x * size.y * size.z;
+}
+
+// Area of the part of a triangle inside a box, clipping the polygon
+// against each slab in turn
+inline float clipped_area(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c, const BBox &box)
+{
+	// Six planes add at most one vertex each
+	glm::vec3 poly[9] = { a, b, c };
+	glm::vec3 next[9];
+	int count = 3;
+
+	for (int axis = 0; axis < 3 && count > 0; axis++) {
+		for (int side = 0; side < 2 && count > 0; side++) {
+			float plane = side ? box.max[axis] : box.min[axis];
+			float sign = side ? -1.0f : 1.0f;
+
+			int n = 0;
+			for (int i = 0; i < count; i++) {
+				const glm::vec3 &p = poly[i];
+				const glm::vec3 &q = poly[(i + 1) % count];
+
+				float dp = sign * (p[axis] - plane);
+				float dq = sign * (q[axis] - plane);
+
+				if (dp >= 0.0f)
+					next[n++] = p;
+
+				if ((dp >= 0.0f) != (dq >= 0.0f))
+					next[n++] = p + (q - p) * (dp / (dp - dq));
+			}
+
+			std::copy(next, next + n, poly);
+			count = n;
+		}
+	}
+
+	glm::vec3 normal {0.0f};
+	for (int i = 1; i + 1 < count; i++)
+		normal += glm::cross(poly[i] - poly[0], poly[i + 1] - poly[0]);
+
+	return 0.5f * glm::length(normal);
+}
+
+inline bool overlaps(const BBox &a, const BBox &b)
+{
+	for (int axis = 0; axis < 3; axis++) {
+		if (a.min[axis] > b.max[axis] || b.min[axis] > a.max[axis])
+			return false;
+	}
+
+	return true;
+}
+
+// Effective parent overlap (Aila et al. 2013): surface of every triangle
+// that lies inside a node without belonging to its subtree, weighted by
+// the node cost and relative to the total surface. Rays hitting that
+// surface have to visit the node for nothing. A triangle may sit in
+// several leaves (spatial splits), it belongs to any subtree holding one
+inline double effective_parent_overlap(const BVH &bvh, const Mesh &mesh, ThreadPool *pool = nullptr)
+{
+	int count = mesh.triangles.size();
+	if (bvh.nodes.empty() || count == 0)
+		return 0.0;
+
+	// Leaves of each triangle, as offsets into one array
+	std::vector <int> offsets(count + 1, 0);
+	for (const BVHNode &node : bvh.nodes) {
+		if (node.left == -1)
+			offsets[node.primitive + 1]++;
+	}
+
+	for (int t = 0; t < count; t++)
+		offsets[t + 1] += offsets[t];
+
+	std::vector <int> leaves(offsets[count]);
+	std::vector <int> fill(offsets.begin(), offsets.end() - 1);
+	for (int n = 0; n < bvh.size(); n++) {
+		if (bvh.nodes[n].left == -1)
+			leaves[fill[bvh.nodes[n].primitive]++] = n;
+	}
+
+	// Subtrees are contiguous in pre-order
+	auto contains = [&](int node, int t) {
+		int end = node + bvh.nodes[node].size;
+		for (int i = offsets[t]; i < offsets[t + 1]; i++) {
+			if (leaves[i] >= node && leaves[i] < end)
+				return true;
+		}
+
+		return false;
+	};
+
+	auto measure = [&](int begin, int end, double &overlap, double &total) {
+		std::vector <int> stack;
+		for (int t = begin; t < end; t++) {
+			const Triangle &tri = mesh.triangles[t];
+			const glm::vec3 &a = mesh.vertices[tri.v1].position;
+			const glm::vec3 &b = mesh.vertices[tri.v2].position;
+			const glm::vec3 &c = mesh.vertices[tri.v3].position;
+
+			total += 0.5f * glm::length(glm::cross(b - a, c - a));
+
+			BBox box = mesh.bbox(tri);
+
+			stack.push_back(0);
+			while (!stack.empty()) {
+				int n = stack.back();
+				stack.pop_back();
+
+				const BVHNode &node = bvh.nodes[n];
+				if (!overlaps(node.bbox, box))
+					continue;
+
+				if (!contains(n, t)) {
+					float cost = node.left == -1 ? BVH_INTERSECTION_COST : BVH_TRAVERSAL_COST;
+					overlap += cost * clipped_area(a, b, c, node.bbox);
+				}
+
+				if (node.left != -1) {
+					stack.push_back(node.left);
+					stack.push_back(node.right);
+				}
+			}
+		}
+	};
+
+	double overlap = 0.0;
+	double total = 0.0;
+
+	if (pool) {
+		int chunks = parallel_chunks(*pool, count, BVH_EPO_GRAIN);
+		std::vector <double> chunk_overlap(chunks, 0.0);
+		std::vector <double> chunk_total(chunks, 0.0);
+
+		parallel_for(*pool, 0, count, BVH_EPO_GRAIN,
+			[&](int c, int begin, int end) {
+				measure(begin, end, chunk_overlap[c], chunk_total[c]);
+			}
+		);
+
+		for (int c = 0; c < chunks; c++) {
+			overlap += chunk_overlap[c];
+			total += chunk_total[c];
+		}
+	} else {
+		measure(0, count, overlap, total);
+	}
+
+	return total > 0.0 ? overlap / total : 0.0;
+}
+
+// Structure of the tree: depths, sibling overlap and, the slow part, EPO
+inline BVHQuality analyze_bvh(const BVH &bvh, const Mesh &mesh, bool epo = true, ThreadPool *pool = nullptr)
+{
+	BVHQuality quality;
+	if (bvh.nodes.empty())
+		return quality;
+
+	quality.sah_cost = bvh.sah_cost();
+	quality.nodes = bvh.size();
+
+	// Parents come before their children in pre-order
+	std::vector <int> depth(bvh.size(), 0);
+
+	double depth_sum = 0.0;
+	for (int n = 0; n < bvh.size(); n++) {
+		const BVHNode &node = bvh.nodes[n];
+		if (node.left == -1) {
+			int d = depth[n];
+			if (d >= (int) quality.depths.size())
+				quality.depths.resize(d + 1, 0);
+
+			quality.depths[d]++;
+			quality.leaves++;
+			quality.max_depth = std::max(quality.max_depth, d);
+			depth_sum += d;
+			continue;
+		}
+
+		depth[node.left] = depth[n] + 1;
+		depth[node.right] = depth[n] + 1;
+
+		BBox overlap {
+			glm::max(bvh.nodes[node.left].bbox.min, bvh.nodes[node.right].bbox.min),
+			glm::min(bvh.nodes[node.left].bbox.max, bvh.nodes[node.right].bbox.max)
+		};
+
+		quality.overlap_volume += volume(overlap);
+	}
+
+	quality.mean_depth = depth_sum / quality.leaves;
+
+	double root_volume = volume(bvh.nodes[0].bbox);
+	if (root_volume > 0.0)
+		quality.overlap_ratio = quality.overlap_volume / root_volume;
+
+	if (epo)
+		quality.epo = effective_parent_overlap(bvh, mesh, pool);
+
+	return quality;
+}
+
+// Work of a batch of rays through a serialized BVH
+struct RayReplay {
+	int rays = 0;
+	int hits = 0;
+	TraversalStats stats;
+};
+
+inline RayReplay replay_rays(const BVHBuffer &bvh, const BVHLayout &layout,
+		const VBuffer &vertices, const IBuffer &triangles,
+		const std::vector <Ray> &rays, CacheModel *cache = nullptr)
+{
+	RayReplay replay;
+	replay.stats.cache = cache;
+	for (const Ray &ray : rays) {
+		Hit hit = trace(bvh, layout, vertices, triangles, ray, replay.stats);
+		replay.hits += (hit.primitive != -1);
+		replay.rays++;
+	}
+
+	return replay;
+}
+
+// Grid of primary rays of a pinhole camera, as Camera::generate_ray makes
+// them for the window
+inline std::vector <Ray> camera_rays(const glm::vec3 &eye, const glm::vec3 &lookat,
+		int width, int height, float fov = 60.0f)
+{
+	glm::vec3 front = glm::normalize(lookat - eye);
+	glm::vec3 right = glm::normalize(glm::cross(glm::vec3 {0.0f, 1.0f, 0.0f}, front));
+	glm::vec3 up = glm::cross(front, right);
+
+	float scale = std::tan(glm::radians(fov) * 0.5f);
+	float aspect = float(width) / float(height);
+
+	std::vector <Ray> rays;
+	rays.reserve(width * height);
+
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			glm::vec2 uv {(x + 0.5f) / width, (y + 0.5f) / height};
+			glm::vec2 cuv = (1.0f - 2.0f * uv) * glm::vec2(scale * aspect, scale);
+			glm::vec3 dir = glm::normalize(right * cuv.x - up * cuv.y + front);
+
+			rays.push_back(Ray {eye, dir});
+		}
+	}
+
+	return rays;
+}
+
+#endif
@@ -0,0 +1,259 @@
+// Standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+
+// App headers
+#include "analysis.hpp"
+#include "blocks.hpp"
+#include "bvh.hpp"
+#include "importer.hpp"
+#include "mesh.hpp"
+#include "traversal.hpp"
+#include "treelet.hpp"
+#include "wide_bvh.hpp"
+
+// BVH quality analyzer: builds the BVH of a mesh and prints its quality
+// metrics and the traversal work of a grid of camera rays as JSON, so that
+// builder or layout changes can be compared and gated on. Exits with 1 if
+// a --max-* threshold is exceeded.
+
+const char *usage =
+	"usage: analyze [--tile | --pillars n | --mesh path.obj|ply] [--seed s]\n"
+	"               [--builder sweep|binned|parallel|lbvh|sbvh]\n"
+	"               [--optimize] [--width 2|4|8] [--quantized] [--ordered]\n"
+	"               [--blocked]\n"
+	"               [--no-epo]\n"
+	"               [--rays w h] [--eye x y z] [--lookat x y z]\n"
+	"               [--max-sah x] [--max-nodes x] [--max-primitives x]\n";
+
+const char *builder_names[] = { "sweep", "binned", "parallel", "lbvh", "sbvh" };
+
+int main(int argc, char *argv[])
+{
+	const char *path = nullptr;
+	int pillars = 0;
+	int seed = 0;
+	int builder = BVHBuilder::eBinnedSAH;
+	bool epo = true;
+	bool optimize = false;
+	bool blocked = false;
+
+	BVHLayout layout;
+
+	int width = 256;
+	int height = 256;
+
+	bool custom_camera = false;
+	glm::vec3 eye {0, 5, -5};
+	glm::vec3 lookat {0, 2, 0};
+
+	float max_sah = 0.0f;
+	float max_nodes = 0.0f;
+	float max_primitives = 0.0f;
+
+	for (int i = 1; i < argc; i++) {
+		auto arg = [&](const char *name, int count) {
+			return !strcmp(argv[i], name) && i + count < argc;
+		};
+
+		if (arg("--tile", 0)) {
+			pillars = 0;
+			path = nullptr;
+		} else if (arg("--pillars", 1)) {
+			pillars = atoi(argv[++i]);
+		} else if (arg("--mesh", 1) || arg("--obj", 1)) {
+			path = argv[++i];
+		} else if (arg("--seed", 1)) {
+			seed = atoi(argv[++i]);
+		} else if (arg("--builder", 1)) {
+			const char *name = argv[++i];
+
+			builder = -1;
+			for (int b = 0; b < 5; b++) {
+				if (!strcmp(name, builder_names[b]))
+					builder = b;
+			}
+
+			if (builder == -1) {
+				fprintf(stderr, "unknown builder %s\n%s", name, usage);
+				return 2;
+			}
+		} else if (arg("--optimize", 0)) {
+			optimize = true;
+		} else if (arg("--width", 1)) {
+			layout.width = atoi(argv[++i]);
+		} else if (arg("--quantized", 0)) {
+			layout.quantized = true;
+		} else if (arg("--ordered", 0)) {
+			layout.ordered = true;
+		} else if (arg("--blocked", 0)) {
+			blocked = true;
+		} else if (arg("--no-epo", 0)) {
+			epo = false;
+		} else if (arg("--rays", 2)) {
+			width = atoi(argv[++i]);
+			height = atoi(argv[++i]);
+		} else if (arg("--eye", 3)) {
+			for (int a = 0; a < 3; a++)
+				eye[a] = atof(argv[++i]);
+			custom_camera = true;
+		} else if (arg("--lookat", 3)) {
+			for (int a = 0; a < 3; a++)
+				lookat[a] = atof(argv[++i]);
+			custom_camera = true;
+		} else if (arg("--max-sah", 1)) {
+			max_sah = atof(argv[++i]);
+		} else if (arg("--max-nodes", 1)) {
+			max_nodes = atof(argv[++i]);
+		} else if (arg("--max-primitives", 1)) {
+			max_primitives = atof(argv[++i]);
+		} else {
+			fprintf(stderr, "%s", usage);
+			return 2;
+		}
+	}
+
+	if (layout.width != 2 && layout.width != 4 && layout.width != 8) {
+		fprintf(stderr, "width must be 2, 4 or 8\n");
+		return 2;
+	}
+
+	srand(seed);
+
+	// Mesh
+	Mesh mesh;
+	const char *source = "tile";
+
+	if (path) {
+		if (!load_mesh(path, mesh, &ThreadPool::global())) {
+			fprintf(stderr, "cannot read %s\n", path);
+			return 2;
+		}
+
+		source = path;
+	} else if (pillars > 0) {
+		mesh = generate_pillars(pillars * PILLAR_TRIANGLES, &ThreadPool::global());
+		source = "pillars";
+	} else {
+		mesh = generate_tile(10, seed);
+	}
+
+	if (mesh.triangles.empty()) {
+		fprintf(stderr, "no triangles\n");
+		return 2;
+	}
+
+	// Anything but the tile is framed from its bounds, from above the -z
+	// side like the window camera
+	if (!custom_camera && (path || pillars > 0)) {
+		BBox box = BBox::empty();
+		for (const Vertex &v : mesh.vertices)
+			box.grow(v.position);
+
+		glm::vec3 size = box.max - box.min;
+		float extent = std::max(std::max(size.x, size.y), size.z);
+
+		lookat = (box.min + box.max) / 2.0f;
+		eye = lookat + glm::vec3 {0.0f, 0.5f * extent, -extent};
+	}
+
+	// Build
+	auto start = std::chrono::high_resolution_clock::now();
+	BVH bvh = mesh.make_bvh((BVHBuilder) builder);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	float build_time = std::chrono::duration <float, std::milli> (end - start).count();
+
+	float optimize_time = 0.0f;
+	if (optimize) {
+		start = std::chrono::high_resolution_clock::now();
+		optimize_treelets(bvh, BVH_TREELET_PASSES, &ThreadPool::global());
+		end = std::chrono::high_resolution_clock::now();
+
+		optimize_time = std::chrono::duration <float, std::milli> (end - start).count();
+	}
+
+	BVHBuffer buffer;
+	if (layout.width == 2 && blocked)
+		serialize_blocked(bvh, buffer);
+	else if (layout.width == 2)
+		bvh.serialize(buffer);
+	else
+		serialize_wide(bvh, layout.width, buffer, layout.quantized);
+
+	// Quality
+	BVHQuality quality = analyze_bvh(bvh, mesh, epo, &ThreadPool::global());
+
+	// Traversal
+	VBuffer vertices;
+	IBuffer triangles;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	std::vector <Ray> rays = camera_rays(eye, lookat, width, height);
+	// L1 sized, over the whole grid
+	CacheModel cache;
+	RayReplay replay = replay_rays(buffer, layout, vertices, triangles, rays, &cache);
+
+	double n = std::max(replay.rays, 1);
+	double nodes_per_ray = replay.stats.nodes / n;
+	double boxes_per_ray = replay.stats.boxes / n;
+	double primitives_per_ray = replay.stats.primitives / n;
+	double bytes_per_ray = replay.stats.bytes / n;
+	double misses_per_ray = cache.misses / n;
+
+	// Report
+	printf("{\n");
+	printf("\t\"mesh\": {\"source\": \"%s\", \"seed\": %d, \"vertices\": %zu, \"triangles\": %zu},\n",
+		source, seed, mesh.vertices.size(), mesh.triangles.size());
+	printf("\t\"bvh\": {\"builder\": \"%s\", \"optimized\": %s, \"width\": %d, \"quantized\": %s,"
+		" \"ordered\": %s, \"blocked\": %s, \"build_ms\": %.3f, \"optimize_ms\": %.3f, \"buffer_bytes\": %zu},\n",
+		builder_names[builder], optimize ? "true" : "false", layout.width,
+		layout.quantized ? "true" : "false", layout.ordered ? "true" : "false",
+		blocked && layout.width == 2 ? "true" : "false",
+		build_time, optimize_time, buffer.size() * sizeof(aligned_vec4));
+
+	printf("\t\"quality\": {\"sah\": %.6f, \"nodes\": %d, \"leaves\": %d,"
+		" \"max_depth\": %d, \"mean_depth\": %.3f,\n",
+		quality.sah_cost, quality.nodes, quality.leaves,
+		quality.max_depth, quality.mean_depth);
+	printf("\t\t\"sibling_overlap_volume\": %.6g, \"sibling_overlap_ratio\": %.6g, \"epo\": %s,\n",
+		quality.overlap_volume, quality.overlap_ratio,
+		epo ? std::to_string(quality.epo).c_str() : "null");
+
+	printf("\t\t\"depth_histogram\": [");
+	for (size_t d = 0; d < quality.depths.size(); d++)
+		printf("%s%d", d ? ", " : "", quality.depths[d]);
+	printf("]},\n");
+
+	printf("\t\"rays\": {\"count\": %d, \"hits\": %d, \"eye\": [%g, %g, %g], \"lookat\": [%g, %g, %g],\n",
+		replay.rays, replay.hits, eye.x, eye.y, eye.z, lookat.x, lookat.y, lookat.z);
+	printf("\t\t\"nodes_per_ray\": %.4f, \"boxes_per_ray\": %.4f,"
+		" \"primitives_per_ray\": %.4f, \"bytes_per_ray\": %.1f, \"l1_misses_per_ray\": %.4f}\n",
+		nodes_per_ray, boxes_per_ray, primitives_per_ray, bytes_per_ray, misses_per_ray);
+	printf("}\n");
+
+	// Regression gates
+	bool failed = false;
+	if (max_sah > 0.0f && quality.sah_cost > max_sah) {
+		fprintf(stderr, "sah %.6f above %.6f\n", quality.sah_cost, max_sah);
+		failed = true;
+	}
+
+	if (max_nodes > 0.0f && nodes_per_ray > max_nodes) {
+		fprintf(stderr, "nodes per ray %.4f above %.4f\n", nodes_per_ray, max_nodes);
+		failed = true;
+	}
+
+	if (max_primitives > 0.0f && primitives_per_ray > max_primitives) {
+		fprintf(stderr, "primitives per ray %.4f above %.4f\n", primitives_per_ray, max_primitives);
+		failed = true;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,1799 @@
+// Standard headers
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+
+// Perlin noise
+#include <PerlinNoise.hpp>
+
+// App headers
+#include "blocks.hpp"
+#include "bvh.hpp"
+#include "dynamic_bvh.hpp"
+#include "importer.hpp"
+#include "instances.hpp"
+#include "leaves.hpp"
+#include "mesh.hpp"
+#include "noise.hpp"
+#include "scene_cache.hpp"
+#include "terrain.hpp"
+#include "traversal.hpp"
+#include "treelet.hpp"
+#include "wide_bvh.hpp"
+
+// Time a function in milliseconds
+inline float time_ms(const std::function <void ()> &f)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	f();
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration <float, std::milli> (end - start).count();
+}
+
+// Build and serialize the BVH with every builder
+void bench_bvh(const Mesh &mesh, bool sweep)
+{
+	const char *names[] = { "sweep", "binned", "parallel", "lbvh", "sbvh" };
+
+	for (int builder = 0; builder < 5; builder++) {
+		if (builder == BVHBuilder::eSweepSAH && !sweep)
+			continue;
+
+		BVH bvh;
+		BVHBuffer buffer;
+
+		float build = time_ms([&]() {
+			bvh = mesh.make_bvh((BVHBuilder) builder);
+		});
+
+		float serialize = time_ms([&]() {
+			bvh.serialize(buffer);
+		});
+
+		printf("bvh %-10s triangles %zu nodes %d build %.2f ms serialize %.2f ms sah %.3f\n",
+			names[builder], mesh.triangles.size(), bvh.size(),
+			build, serialize, bvh.sah_cost());
+	}
+}
+
+// Rays from above the scene towards random points on the ground, roughly
+// what the camera sees
+std::vector <Ray> generate_rays(const Mesh &mesh, int count)
+{
+	BBox box = BBox::empty();
+	for (const Vertex &v : mesh.vertices)
+		box.grow(v.position);
+
+	glm::vec3 size = box.max - box.min;
+
+	std::vector <Ray> rays(count);
+	for (Ray &ray : rays) {
+		glm::vec3 from = box.min + glm::vec3(randf(), 0.0f, randf()) * size;
+		glm::vec3 to = box.min + glm::vec3(randf(), 0.0f, randf()) * size;
+
+		from.y = box.max.y + size.y;
+		ray = Ray {from, glm::normalize(to - from)};
+	}
+
+	return rays;
+}
+
+// Trace a set of rays, counting hits that differ from the reference
+void bench_rays(const char *name, const char *kind, const BVHBuffer &buffer, const BVHLayout &layout,
+		const VBuffer &vertices, const IBuffer &triangles,
+		const std::vector <Ray> &rays, const std::vector <Hit> &reference,
+		const LeafBuffer &leaves = LeafBuffer(), const RBuffer &records = RBuffer())
+{
+	TraversalStats stats;
+	int mismatches = 0;
+
+	float time = time_ms([&]() {
+		for (size_t i = 0; i < rays.size(); i++) {
+			Hit hit = trace(buffer, layout, vertices, triangles, leaves, records, rays[i], stats);
+			if (hit.t != reference[i].t)
+				mismatches++;
+		}
+	});
+
+	double n = rays.size();
+	printf("trace %-6s %-7s rays %zu nodes/ray %.2f boxes/ray %.2f triangles/ray %.2f"
+		" bytes/ray %.0f geometry/ray %.0f buffer %zu KiB %.2f Mrays/s mismatches %d\n",
+		name, kind, rays.size(),
+		stats.nodes / n, stats.boxes / n, stats.primitives / n, stats.bytes / n,
+		stats.geometry / n, (buffer.size() + leaves.size()) * sizeof(aligned_vec4) / 1024,
+		n / (time * 1e3f), mismatches);
+}
+
+// Trace the same primary and shadow rays through every layout; hits are
+// checked against the threaded binary traversal
+void bench_traversal(const Mesh &mesh, int nrays)
+{
+	VBuffer vertices;
+	IBuffer triangles;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	BVH bvh = mesh.make_bvh(BVHBuilder::eParallelBinnedSAH);
+
+	BVHBuffer binary;
+	bvh.serialize(binary);
+
+	// Primary rays, and shadow rays towards the light from their hits
+	std::vector <Ray> primary = generate_rays(mesh, nrays);
+	std::vector <Hit> primary_hits(nrays);
+
+	std::vector <Ray> shadow;
+	std::vector <Hit> shadow_hits;
+
+	glm::vec3 light = glm::normalize(glm::vec3 {1, 1, 1});
+
+	TraversalStats stats;
+	for (int i = 0; i < nrays; i++) {
+		const Ray &ray = primary[i];
+
+		primary_hits[i] = trace_binary(binary, vertices, triangles, ray, stats);
+		if (primary_hits[i].primitive == -1)
+			continue;
+
+		glm::vec3 p = ray.p + ray.d * primary_hits[i].t;
+		shadow.push_back(Ray {p + light * 1e-3f, light});
+		shadow_hits.push_back(trace_binary(binary, vertices, triangles, shadow.back(), stats));
+	}
+
+	struct Layout {
+		const char *name;
+		BVHLayout layout;
+	};
+
+	Layout layouts[] = {
+		{ "bvh2", { 2, false, false } },
+		{ "bvh2o", { 2, false, true } },
+		{ "bvh4", { 4, false, false } },
+		{ "bvh8", { 8, false, false } },
+		{ "bvh4q", { 4, true, false } },
+		{ "bvh8q", { 8, true, false } },
+	};
+
+	for (const Layout &l : layouts) {
+		BVHBuffer buffer;
+		if (l.layout.width == 2)
+			buffer = binary;
+		else
+			serialize_wide(bvh, l.layout.width, buffer, l.layout.quantized);
+
+		bench_rays(l.name, "primary", buffer, l.layout, vertices, triangles, primary, primary_hits);
+		bench_rays(l.name, "shadow", buffer, l.layout, vertices, triangles, shadow, shadow_hits);
+	}
+}
+
+// Spatial splits against the plain binned build on the same rays; the
+// hits must match exactly, only the work differs
+void bench_spatial_splits(const Mesh &mesh, int nrays)
+{
+	VBuffer vertices;
+	IBuffer triangles;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	BVHBuffer binned;
+	BVHBuffer spatial;
+
+	BVH binned_bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+	BVH spatial_bvh = mesh.make_bvh(BVHBuilder::eSpatialSAH);
+
+	binned_bvh.serialize(binned);
+	spatial_bvh.serialize(spatial);
+
+	// Leaves hold one reference each
+	int references = (spatial_bvh.size() + 1) / 2;
+	printf("sbvh triangles %zu references %d (%.1f%%, budget %.0f%%) sah %.3f vs binned %.3f\n",
+		mesh.triangles.size(), references,
+		100.0f * references / mesh.triangles.size() - 100.0f,
+		100.0f * SBVH_MEMORY_BUDGET - 100.0f,
+		spatial_bvh.sah_cost(), binned_bvh.sah_cost());
+
+	std::vector <Ray> primary = generate_rays(mesh, nrays);
+	std::vector <Hit> primary_hits(nrays);
+
+	std::vector <Ray> shadow;
+	std::vector <Hit> shadow_hits;
+
+	glm::vec3 light = glm::normalize(glm::vec3 {1, 1, 1});
+
+	TraversalStats stats;
+	for (int i = 0; i < nrays; i++) {
+		const Ray &ray = primary[i];
+
+		primary_hits[i] = trace_binary(binned, vertices, triangles, ray, stats);
+		if (primary_hits[i].primitive == -1)
+			continue;
+
+		glm::vec3 p = ray.p + ray.d * primary_hits[i].t;
+		shadow.push_back(Ray {p + light * 1e-3f, light});
+		shadow_hits.push_back(trace_binary(binned, vertices, triangles, shadow.back(), stats));
+	}
+
+	BVHLayout layout;
+	bench_rays("binned", "primary", binned, layout, vertices, triangles, primary, primary_hits);
+	bench_rays("sbvh", "primary", spatial, layout, vertices, triangles, primary, primary_hits);
+	bench_rays("binned", "shadow", binned, layout, vertices, triangles, shadow, shadow_hits);
+	bench_rays("sbvh", "shadow", spatial, layout, vertices, triangles, shadow, shadow_hits);
+}
+
+// Treelet restructuring after each builder, on the same rays; the hits
+// must match exactly
+void bench_treelets(const Mesh &mesh, int nrays)
+{
+	VBuffer vertices;
+	IBuffer triangles;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	std::vector <Ray> rays = generate_rays(mesh, nrays);
+
+	const char *names[] = { "binned", "lbvh" };
+	BVHBuilder builders[] = { BVHBuilder::eBinnedSAH, BVHBuilder::eLBVH };
+
+	for (int b = 0; b < 2; b++) {
+		BVH bvh = mesh.make_bvh(builders[b]);
+		float sah = bvh.sah_cost();
+
+		BVHBuffer before;
+		bvh.serialize(before);
+
+		BVH copy = bvh;
+		float serial = time_ms([&]() {
+			optimize_treelets(copy);
+		});
+
+		float parallel = time_ms([&]() {
+			optimize_treelets(bvh, BVH_TREELET_PASSES, &ThreadPool::global());
+		});
+
+		BVHBuffer after;
+		bvh.serialize(after);
+
+		printf("treelets %-6s triangles %zu sah %.3f -> %.3f serial %.2f ms parallel %.2f ms\n",
+			names[b], mesh.triangles.size(), sah, bvh.sah_cost(), serial, parallel);
+
+		TraversalStats stats;
+		std::vector <Hit> hits(rays.size());
+		for (size_t i = 0; i < rays.size(); i++)
+			hits[i] = trace_binary(before, vertices, triangles, rays[i], stats);
+
+		BVHLayout layout;
+		bench_rays(names[b], "primary", before, layout, vertices, triangles, rays, hits);
+		bench_rays("+trbvh", "primary", after, layout, vertices, triangles, rays, hits);
+	}
+}
+
+// Clustered leaves of several sizes against one triangle per leaf: node
+// count, SAH cost, and the node and geometry fetches per ray
+void bench_leaves(const Mesh &mesh, int nrays)
+{
+	VBuffer vertices;
+	IBuffer triangles;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	std::vector <Ray> rays = generate_rays(mesh, nrays);
+
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+
+	BVHBuffer single;
+	bvh.serialize(single);
+
+	TraversalStats stats;
+	std::vector <Hit> hits(rays.size());
+	for (size_t i = 0; i < rays.size(); i++)
+		hits[i] = trace_binary(single, vertices, triangles, rays[i], stats);
+
+	BVHLayout layout;
+	bench_rays("leaf1", "primary", single, layout, vertices, triangles, rays, hits);
+
+	for (int size : { 2, 4, 8 }) {
+		BVHBuffer buffer;
+		LeafBuffer leaves;
+
+		float sah = 0.0f;
+		float time = time_ms([&]() {
+			sah = serialize_leaves(bvh, mesh, size, buffer, leaves);
+		});
+
+		printf("leaves %d nodes %zu -> %zu sah %.3f -> %.3f serialize %.2f ms\n",
+			size, single.size() / 3, buffer.size() / 3, bvh.sah_cost(), sah, time);
+
+		std::string name = "leaf" + std::to_string(size);
+
+		BVHLayout clustered;
+		clustered.leaf_size = size;
+		bench_rays(name.c_str(), "primary", buffer, clustered, vertices, triangles, rays, hits, leaves);
+
+		clustered.ordered = true;
+		bench_rays(name.c_str(), "ordered", buffer, clustered, vertices, triangles, rays, hits, leaves);
+	}
+}
+
+// Triangle records against the index buffer, on the same trees: geometry
+// fetched per ray and speed. Hit times come from other arithmetic, so
+// they are compared with a tolerance, and the primitives hit exactly
+void bench_records(const Mesh &mesh, int nrays)
+{
+	VBuffer vertices;
+	IBuffer triangles;
+	RBuffer records;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	float time = time_ms([&]() {
+		mesh.serialize_records(records);
+	});
+
+	printf("records triangles %zu serialize %.2f ms %zu KiB, indices %zu KiB + vertices %zu KiB\n",
+		mesh.triangles.size(), time,
+		records.size() * sizeof(aligned_vec4) / 1024,
+		triangles.size() * sizeof(aligned_uvec4) / 1024,
+		vertices.size() * sizeof(aligned_vec4) / 1024);
+
+	std::vector <Ray> rays = generate_rays(mesh, nrays);
+
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+
+	const char *names[] = { "binary", "bvh4" };
+	for (int w = 0; w < 2; w++) {
+		BVHLayout layout;
+		layout.width = w ? 4 : 2;
+		layout.ordered = (w == 0);
+
+		BVHBuffer buffer;
+		if (layout.width == 2)
+			bvh.serialize(buffer);
+		else
+			serialize_wide(bvh, layout.width, buffer);
+
+		// Indexed first, as the reference
+		std::vector <Hit> reference;
+		for (int r = 0; r < 2; r++) {
+			layout.records = r;
+
+			TraversalStats stats;
+			std::vector <Hit> hits(rays.size());
+
+			float time = time_ms([&]() {
+				for (size_t i = 0; i < rays.size(); i++)
+					hits[i] = trace(buffer, layout, vertices, triangles, LeafBuffer(), records, rays[i], stats);
+			});
+
+			if (r == 0)
+				reference = hits;
+
+			int mismatches = 0;
+			float error = 0.0f;
+			for (size_t i = 0; i < rays.size(); i++) {
+				if (hits[i].primitive != reference[i].primitive) {
+					mismatches++;
+				} else if (hits[i].primitive != -1) {
+					float e = std::abs(hits[i].t - reference[i].t) / reference[i].t;
+					error = std::max(error, e);
+				}
+			}
+
+			double n = rays.size();
+			printf("trace %-6s %-7s rays %zu triangles/ray %.2f geometry/ray %.0f %.2f Mrays/s"
+				" mismatches %d max t error %.2g\n",
+				names[w], r ? "records" : "indexed", rays.size(),
+				stats.primitives / n, stats.geometry / n,
+				n / (time * 1e3f), mismatches, error);
+		}
+	}
+}
+
+// Cache line blocks against pre-order: cache lines missed per ray in an
+// L1 and an L2 sized cache, over the whole batch of rays. The same nodes
+// must be visited, so hits and node counts match exactly
+void bench_blocks(const Mesh &mesh, int nrays)
+{
+	VBuffer vertices;
+	IBuffer triangles;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	std::vector <Ray> rays = generate_rays(mesh, nrays);
+
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+
+	BVHBuffer preorder;
+	bvh.serialize(preorder);
+
+	BVHBuffer blocked;
+	float time = time_ms([&]() {
+		serialize_blocked(bvh, blocked);
+	});
+
+	printf("blocks nodes %d buffer nodes %zu block %d pairs serialize %.2f ms\n",
+		bvh.size(), blocked.size() / 3, BVH_BLOCK_PAIRS, time);
+
+	const char *layouts[] = { "preorder", "blocked" };
+	const BVHBuffer *buffers[] = { &preorder, &blocked };
+
+	for (int ordered = 0; ordered < 2; ordered++) {
+		BVHLayout layout;
+		layout.ordered = ordered;
+
+		std::vector <Hit> reference;
+		uint64_t reference_nodes = 0;
+
+		for (int b = 0; b < 2; b++) {
+			CacheModel l1(32 * 1024, 8);
+			CacheModel l2(256 * 1024, 8);
+
+			TraversalStats stats;
+			std::vector <Hit> hits(rays.size());
+
+			for (CacheModel *cache : { &l1, &l2 }) {
+				stats = TraversalStats();
+				stats.cache = cache;
+				for (size_t i = 0; i < rays.size(); i++)
+					hits[i] = trace(*buffers[b], layout, vertices, triangles, rays[i], stats);
+			}
+
+			if (b == 0) {
+				reference = hits;
+				reference_nodes = stats.nodes;
+			}
+
+			int mismatches = 0;
+			for (size_t i = 0; i < rays.size(); i++)
+				mismatches += (hits[i].t != reference[i].t);
+
+			double n = rays.size();
+			printf("trace %-8s %-8s rays %zu nodes/ray %.2f lines/ray %.2f"
+				" l1 misses/ray %.2f l2 misses/ray %.2f mismatches %d%s\n",
+				layouts[b], ordered ? "ordered" : "threaded", rays.size(),
+				stats.nodes / n, l1.accesses / n, l1.misses / n, l2.misses / n, mismatches,
+				stats.nodes == reference_nodes ? "" : " (node count differs)");
+		}
+	}
+}
+
+// Instanced pillars and rocks against the same scene baked into one mesh:
+// memory, build times and hits
+void bench_instances(int count, int nrays)
+{
+	InstancedScene scene = generate_instanced_tile(count, std::sqrt((float) count));
+
+	// Flat copy, as generate_tile would bake it
+	Mesh flat;
+	for (const Instance &instance : scene.instances) {
+		if (instance.blas == 0)
+			flat.add(generate_pillar(instance.transform));
+		else
+			flat.add(generate_rock(instance.transform));
+	}
+
+	VBuffer flat_vertices;
+	IBuffer flat_triangles;
+	BVHBuffer flat_bvh;
+
+	flat.serialize_vertices(flat_vertices);
+	flat.serialize_indices(flat_triangles);
+
+	BVH bvh;
+	float flat_build = time_ms([&]() {
+		bvh = flat.make_bvh(BVHBuilder::eParallelBinnedSAH);
+	});
+
+	bvh.serialize(flat_bvh);
+
+	// Two levels
+	VBuffer vertices;
+	IBuffer triangles;
+	BVHBuffer buffer;
+	InstanceBuffer instances;
+
+	scene.serialize_geometry(vertices, triangles);
+
+	BVH tlas;
+	float tlas_build = time_ms([&]() {
+		tlas = scene.make_tlas(BVHBuilder::eParallelBinnedSAH);
+	});
+
+	float tlas_rebuild = time_ms([&]() {
+		tlas = scene.make_tlas(BVHBuilder::eLBVH);
+	});
+
+	scene.serialize(tlas, buffer);
+	scene.serialize_instances(instances);
+
+	size_t flat_bytes = sizeof(aligned_vec4) * (flat_vertices.size() + flat_bvh.size())
+		+ sizeof(aligned_uvec4) * flat_triangles.size();
+
+	size_t bytes = sizeof(aligned_vec4) * (vertices.size() + buffer.size() + instances.size())
+		+ sizeof(aligned_uvec4) * triangles.size();
+
+	printf("instances %d flat %zu KiB build %.2f ms, two level %zu KiB tlas build %.2f ms"
+		" tlas lbvh rebuild %.2f ms\n",
+		count, flat_bytes / 1024, flat_build, bytes / 1024, tlas_build, tlas_rebuild);
+
+	// Same hits up to the rounding of the object space transform
+	std::vector <Ray> rays = generate_rays(flat, nrays);
+
+	TraversalStats flat_stats;
+	TraversalStats stats;
+	int mismatches = 0;
+
+	for (const Ray &ray : rays) {
+		Hit a = trace_binary(flat_bvh, flat_vertices, flat_triangles, ray, flat_stats);
+		Hit b = trace_instanced(buffer, instances, vertices, triangles, ray, stats);
+
+		if ((a.primitive == -1) != (b.primitive == -1) || std::abs(a.t - b.t) > 1e-3f * a.t)
+			mismatches++;
+	}
+
+	printf("instances %d rays %d flat nodes/ray %.2f two level nodes/ray %.2f"
+		" triangles/ray %.2f vs %.2f mismatches %d\n",
+		count, nrays,
+		(double) flat_stats.nodes / nrays, (double) stats.nodes / nrays,
+		(double) flat_stats.primitives / nrays, (double) stats.primitives / nrays,
+		mismatches);
+}
+
+// Insert every triangle into a dynamic BVH, then remove and reinsert a
+// share of them, measuring the cost per operation and what an incremental
+// export writes compared to a full one
+void bench_dynamic(const Mesh &mesh, int nrays)
+{
+	VBuffer vertices;
+	IBuffer triangles;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	int count = mesh.triangles.size();
+
+	std::vector <BBox> bounds;
+	mesh.bounds(bounds);
+
+	DynamicBVH dynamic;
+	std::vector <int> leaves(count);
+
+	float time = time_ms([&]() {
+		for (int i = 0; i < count; i++)
+			leaves[i] = dynamic.insert(bounds[i], i);
+	});
+
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+
+	printf("dynamic triangles %d insert %.2f ms %.3f us/insert sah %.3f binned sah %.3f\n",
+		count, time, 1e3f * time / count, dynamic.sah_cost(), bvh.sah_cost());
+
+	BVHBuffer buffer;
+	DirtyRanges dirty;
+	dynamic.serialize(buffer, dirty);
+
+	// Churn: take a share of the triangles out, then put them back
+	int changes = std::max(count / 100, 1);
+
+	std::vector <int> picked(changes);
+	for (int &p : picked)
+		p = rand() % count;
+
+	std::sort(picked.begin(), picked.end());
+	picked.erase(std::unique(picked.begin(), picked.end()), picked.end());
+
+	int ops = 2 * picked.size();
+
+	time = time_ms([&]() {
+		for (int p : picked)
+			dynamic.remove(leaves[p]);
+		for (int p : picked)
+			leaves[p] = dynamic.insert(bounds[p], p);
+	});
+
+	float export_time = time_ms([&]() {
+		dynamic.serialize(buffer, dirty);
+	});
+
+	printf("dynamic churn %d ops %.3f us/op sah %.3f export %.3f ms %d of %zu vec4s dirty"
+		" in %zu ranges, %.1f vec4s/op\n",
+		ops, 1e3f * time / ops, dynamic.sah_cost(), export_time,
+		dirty.size(), buffer.size(), dirty.ranges.size(), (float) dirty.size() / ops);
+
+	// Moves: every triangle a little, as the animation does; only the ones
+	// that leave their fattened boxes are reinserted
+	for (float step : { 0.02f, 0.002f }) {
+		std::vector <BBox> moved = bounds;
+		for (BBox &box : moved) {
+			glm::vec3 offset {randf(-step, step), randf(-step, step), randf(-step, step)};
+			box.min += offset;
+			box.max += offset;
+		}
+
+		int reinserted = 0;
+		time = time_ms([&]() {
+			for (int i = 0; i < count; i++)
+				reinserted += dynamic.update(leaves[i], moved[i]);
+		});
+
+		export_time = time_ms([&]() {
+			dynamic.serialize(buffer, dirty);
+		});
+
+		printf("dynamic moves step %.3f update %.3f ms %d of %d reinserted sah %.3f export %.3f ms"
+			" %d of %zu vec4s dirty\n", step, time, reinserted, count, dynamic.sah_cost(),
+			export_time, dirty.size(), buffer.size());
+	}
+
+	// Traced against the static tree below, so back to where it was
+	for (int i = 0; i < count; i++)
+		dynamic.update(leaves[i], bounds[i]);
+
+	dynamic.serialize(buffer, dirty);
+
+	// Same hits as the static tree, with the incremental buffer
+	std::vector <Ray> rays = generate_rays(mesh, nrays);
+
+	BVHBuffer reference;
+	bvh.serialize(reference);
+
+	for (int ordered = 0; ordered < 2; ordered++) {
+		BVHLayout layout;
+		layout.ordered = ordered;
+
+		TraversalStats stats;
+		TraversalStats static_stats;
+
+		int mismatches = 0;
+		for (const Ray &ray : rays) {
+			Hit hit = trace(buffer, layout, vertices, triangles, ray, stats);
+			Hit expected = trace(reference, layout, vertices, triangles, ray, static_stats);
+			mismatches += (hit.t != expected.t);
+		}
+
+		double n = rays.size();
+		printf("trace dynamic %-8s rays %zu nodes/ray %.2f (binned %.2f) mismatches %d\n",
+			ordered ? "ordered" : "threaded", rays.size(),
+			stats.nodes / n, static_stats.nodes / n, mismatches);
+	}
+}
+
+// Generate scattered pillars through a temporary mesh per pillar, as
+// before the builder, then with the builder serially and in parallel
+void bench_mesh_builder(int pillars)
+{
+	int triangles = pillars * PILLAR_TRIANGLES;
+	float extent = std::sqrt((float) pillars);
+
+	Mesh added;
+	float add_time = time_ms([&]() {
+		srand(1);
+		for (int i = 0; i < pillars; i++) {
+			glm::mat4 mat = Transform {
+				glm::vec3(randf(-extent, extent), randf(), randf(-extent, extent)),
+				glm::vec3(randf() * 15.0f, randf() * 360.0f, randf() * 15.0f),
+				glm::vec3(randf() * 0.6f + 0.5f, randf() * 2.0f + 0.5f, randf() * 0.6f + 0.5f)
+			}.matrix();
+
+			added.add(generate_pillar(mat));
+		}
+	});
+
+	Mesh serial;
+	float serial_time = time_ms([&]() {
+		srand(1);
+		serial = generate_pillars(triangles);
+	});
+
+	Mesh parallel;
+	float parallel_time = time_ms([&]() {
+		srand(1);
+		parallel = generate_pillars(triangles, &ThreadPool::global());
+	});
+
+	auto same = [&](const Mesh &a, const Mesh &b) {
+		if (a.vertices.size() != b.vertices.size() || a.triangles.size() != b.triangles.size())
+			return false;
+
+		for (size_t i = 0; i < a.vertices.size(); i++) {
+			if (a.vertices[i].position != b.vertices[i].position)
+				return false;
+		}
+
+		for (size_t i = 0; i < a.triangles.size(); i++) {
+			const Triangle &t = a.triangles[i];
+			const Triangle &u = b.triangles[i];
+			if (t.v1 != u.v1 || t.v2 != u.v2 || t.v3 != u.v3 || t.shade != u.shade)
+				return false;
+		}
+
+		return true;
+	};
+
+	printf("mesh pillars %d triangles %zu add %.1f ms builder %.1f ms parallel %.1f ms (%d threads) identical %s\n",
+		pillars, serial.triangles.size(), add_time, serial_time, parallel_time,
+		ThreadPool::global().size(),
+		same(added, serial) && same(serial, parallel) ? "yes" : "no");
+}
+
+// Adaptive terrain meshes of a noise height field against the full grid
+// and against marching it in fixed steps, as the shader does: triangles,
+// error at the samples, and the work and accuracy per ray
+void bench_terrain(int nrays)
+{
+	const siv::PerlinNoise perlin {1u};
+
+	// The window terrain: 128 cells over 20 units, 3 units high
+	float extent = 20.0f;
+	TerrainGrid grid = sample_terrain([&](float x, float z) {
+		return 3.0f * (float) perlin.octave2D_01(x * 0.075, z * 0.075, 8);
+	}, 128, extent);
+
+	TerrainMesher *mesher = nullptr;
+	float error_time = time_ms([&]() {
+		mesher = new TerrainMesher(grid);
+	});
+
+	printf("terrain grid %d x %d errors %.2f ms\n", grid.size, grid.size, error_time);
+
+	// Rays from above, down onto the terrain
+	std::vector <Ray> rays(nrays);
+	for (Ray &ray : rays) {
+		glm::vec3 from {randf(-extent, extent) / 2.0f, 8.0f, randf(-extent, extent) / 2.0f};
+		glm::vec3 to {randf(-extent, extent) / 2.0f, 0.0f, randf(-extent, extent) / 2.0f};
+		ray = Ray {from, glm::normalize(to - from)};
+	}
+
+	// The exact surface is the full grid
+	std::vector <float> exact(rays.size());
+
+	for (float max_error : { 0.0f, 0.005f, 0.02f, 0.05f }) {
+		Mesh mesh;
+		float time = time_ms([&]() {
+			mesh = mesher->build(max_error);
+		});
+
+		VBuffer vertices;
+		IBuffer triangles;
+		BVHBuffer buffer;
+
+		mesh.serialize_vertices(vertices);
+		mesh.serialize_indices(triangles);
+		mesh.make_bvh().serialize(buffer);
+
+		BVHLayout layout;
+
+		// Vertical distance at every sample, interpolated in the
+		// triangles that cover it
+		float cell = extent / (grid.size - 1);
+		float sample_error = 0.0f;
+		for (const Triangle &tri : mesh.triangles) {
+			glm::vec3 a = mesh.vertices[tri.v1].position;
+			glm::vec3 b = mesh.vertices[tri.v2].position;
+			glm::vec3 c = mesh.vertices[tri.v3].position;
+
+			glm::vec3 lo = glm::min(glm::min(a, b), c);
+			glm::vec3 hi = glm::max(glm::max(a, b), c);
+
+			float area = (b.x - a.x) * (c.z - a.z) - (c.x - a.x) * (b.z - a.z);
+
+			for (int z = std::round((lo.z + extent / 2) / cell); z <= std::round((hi.z + extent / 2) / cell); z++) {
+				for (int x = std::round((lo.x + extent / 2) / cell); x <= std::round((hi.x + extent / 2) / cell); x++) {
+					glm::vec3 p = grid.position(x, z);
+
+					float u = ((c.x - p.x) * (a.z - p.z) - (a.x - p.x) * (c.z - p.z)) / area;
+					float v = ((a.x - p.x) * (b.z - p.z) - (b.x - p.x) * (a.z - p.z)) / area;
+					if (u < -1e-4f || v < -1e-4f || u + v > 1.0f + 1e-4f)
+						continue;
+
+					float y = b.y * u + c.y * v + a.y * (1.0f - u - v);
+					sample_error = std::max(sample_error, std::abs(y - p.y));
+				}
+			}
+		}
+
+		TraversalStats stats;
+		float error = 0.0f;
+
+		float trace_time = time_ms([&]() {
+			for (size_t i = 0; i < rays.size(); i++) {
+				Hit hit = trace(buffer, layout, vertices, triangles, rays[i], stats);
+				if (max_error == 0.0f)
+					exact[i] = hit.t;
+				else if (std::isfinite(exact[i]))
+					error += std::abs(hit.t - exact[i]);
+			}
+		});
+
+		double n = rays.size();
+		printf("terrain mesh error %.3f triangles %zu (%.1f%% of grid) build %.2f ms max sample error %.4f"
+			" nodes/ray %.1f triangles/ray %.1f %.2f Mrays/s mean t error %.4f\n",
+			max_error, mesh.triangles.size(),
+			100.0 * mesh.triangles.size() / (2.0 * (grid.size - 1) * (grid.size - 1)),
+			time, sample_error, stats.nodes / n, stats.primitives / n,
+			n / (trace_time * 1e3f), error / n);
+	}
+
+	// The shader default step and finer ones
+	for (float step : { 0.1f, 0.03f, 0.01f }) {
+		int steps = 0;
+		float error = 0.0f;
+		int misses = 0;
+
+		float time = time_ms([&]() {
+			for (size_t i = 0; i < rays.size(); i++) {
+				float t = march_terrain(grid, rays[i], step, steps);
+				if (std::isfinite(t) != std::isfinite(exact[i]))
+					misses++;
+				else if (std::isfinite(t))
+					error += std::abs(t - exact[i]);
+			}
+		});
+
+		double n = rays.size();
+		printf("terrain march step %.2f steps/ray %.1f %.2f Mrays/s mean t error %.4f wrong hits %d\n",
+			step, steps / n, n / (time * 1e3f), error / n, misses);
+	}
+
+	delete mesher;
+}
+
+// Packed vertex and index buffers against the full ones: size, how far
+// quantization moves the vertices, and hits on the decoded geometry with
+// the BVH built over the snapped mesh, as the window does
+void bench_packed(const Mesh &mesh, int nrays)
+{
+	VBuffer vertices;
+	IBuffer triangles;
+
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	size_t full = vertices.size() * sizeof(aligned_vec4) + triangles.size() * sizeof(aligned_uvec4);
+
+	std::vector <Ray> rays = generate_rays(mesh, nrays);
+
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+	BVHBuffer buffer;
+	bvh.serialize(buffer);
+
+	BVHLayout layout;
+
+	std::vector <Hit> reference(rays.size());
+	TraversalStats reference_stats;
+	for (size_t i = 0; i < rays.size(); i++)
+		reference[i] = trace(buffer, layout, vertices, triangles, rays[i], reference_stats);
+
+	const char *index_names[] = { "32", "24", "16" };
+	for (VertexFormat vertex_format : { eVertexFloat, eVertexQuantized }) {
+		PackedFormat format = mesh.packed_format(vertex_format);
+
+		PBuffer packed_vertices;
+		PBuffer packed_indices;
+		float time = time_ms([&]() {
+			mesh.serialize_vertices(packed_vertices, format);
+			mesh.serialize_indices(packed_indices, format);
+		});
+
+		size_t packed = (packed_vertices.size() + packed_indices.size()) * sizeof(uint32_t);
+
+		// Decode into a mesh, checking indices and shades come back
+		Mesh decoded;
+		float error = 0.0f;
+		for (size_t i = 0; i < mesh.vertices.size(); i++) {
+			glm::vec3 p = format.unpack_vertex(packed_vertices, i);
+			glm::vec3 d = glm::abs(p - mesh.vertices[i].position);
+			error = std::max(error, std::max(std::max(d.x, d.y), d.z));
+			decoded.vertices.push_back(Vertex {p});
+		}
+
+		int wrong_indices = 0;
+		for (size_t i = 0; i < mesh.triangles.size(); i++) {
+			glm::uvec4 t = format.unpack_triangle(packed_indices, i);
+			wrong_indices += (t != triangles[i].v);
+			decoded.triangles.emplace_back(t.x, t.y, t.z, (Shades) t.w);
+		}
+
+		VBuffer decoded_vertices;
+		IBuffer decoded_triangles;
+		decoded.serialize_vertices(decoded_vertices);
+		decoded.serialize_indices(decoded_triangles);
+
+		BVHBuffer decoded_buffer;
+		decoded.make_bvh(BVHBuilder::eBinnedSAH).serialize(decoded_buffer);
+
+		int mismatches = 0;
+		TraversalStats stats;
+		for (size_t i = 0; i < rays.size(); i++) {
+			Hit hit = trace(decoded_buffer, layout, decoded_vertices, decoded_triangles, rays[i], stats);
+			mismatches += (hit.primitive != reference[i].primitive);
+		}
+
+		// Geometry fetched per triangle test, at the packed sizes
+		double n = rays.size();
+		double per_test = 4.0 * (format.index_words() + 3 * format.vertex_words());
+		printf("packed %-9s indices %s triangles %zu %zu KiB of %zu KiB (%.0f%%) pack %.2f ms"
+			" max error %.2g wrong indices %d geometry/ray %.0f of %.0f hit mismatches %d\n",
+			vertex_format == eVertexQuantized ? "quantized" : "float", index_names[format.index_format],
+			mesh.triangles.size(), packed / 1024, full / 1024, 100.0 * packed / full, time,
+			error, wrong_indices, stats.primitives * per_test / n, reference_stats.geometry / n, mismatches);
+	}
+}
+
+// Write the mesh as OBJ and binary PLY, then read it back: line by line
+// with streams, as analyze used to, and mapped, serially and on the pool
+void bench_import(const Mesh &mesh)
+{
+	const char *obj = "/tmp/bench_import.obj";
+	const char *ply = "/tmp/bench_import.ply";
+
+	{
+		FILE *file = fopen(obj, "w");
+		for (const Vertex &v : mesh.vertices)
+			fprintf(file, "v %.6f %.6f %.6f\n", v.position.x, v.position.y, v.position.z);
+		for (const Triangle &t : mesh.triangles)
+			fprintf(file, "f %u %u %u\n", t.v1 + 1, t.v2 + 1, t.v3 + 1);
+		fclose(file);
+	}
+
+	{
+		FILE *file = fopen(ply, "wb");
+		fprintf(file, "ply\nformat binary_little_endian 1.0\n"
+			"element vertex %zu\nproperty float x\nproperty float y\nproperty float z\n"
+			"element face %zu\nproperty list uchar int vertex_indices\nend_header\n",
+			mesh.vertices.size(), mesh.triangles.size());
+
+		for (const Vertex &v : mesh.vertices)
+			fwrite(&v.position, sizeof(float), 3, file);
+
+		for (const Triangle &t : mesh.triangles) {
+			uint8_t count = 3;
+			uint32_t indices[3] = { t.v1, t.v2, t.v3 };
+			fwrite(&count, 1, 1, file);
+			fwrite(indices, sizeof(uint32_t), 3, file);
+		}
+
+		fclose(file);
+	}
+
+	Mesh streamed;
+	float stream_time = time_ms([&]() {
+		std::ifstream file(obj);
+
+		std::string line;
+		while (std::getline(file, line)) {
+			std::istringstream in(line);
+
+			std::string tag;
+			in >> tag;
+
+			if (tag == "v") {
+				glm::vec3 p;
+				in >> p.x >> p.y >> p.z;
+				streamed.vertices.push_back(Vertex {p});
+			} else if (tag == "f") {
+				std::vector <uint32_t> face;
+
+				std::string token;
+				while (in >> token)
+					face.push_back(atoi(token.c_str()) - 1);
+
+				for (size_t i = 2; i < face.size(); i++)
+					streamed.triangles.push_back(Triangle {face[0], face[i - 1], face[i], Shades::ePillar});
+			}
+		}
+	});
+
+	// Against the stream parser for OBJ, and exactly for PLY
+	auto same = [&](const Mesh &a, const Mesh &b, float tolerance) {
+		if (a.vertices.size() != b.vertices.size() || a.triangles.size() != b.triangles.size())
+			return false;
+
+		for (size_t i = 0; i < a.vertices.size(); i++) {
+			glm::vec3 d = glm::abs(a.vertices[i].position - b.vertices[i].position);
+			if (std::max(std::max(d.x, d.y), d.z) > tolerance)
+				return false;
+		}
+
+		for (size_t i = 0; i < a.triangles.size(); i++) {
+			const Triangle &t = a.triangles[i];
+			const Triangle &u = b.triangles[i];
+			if (t.v1 != u.v1 || t.v2 != u.v2 || t.v3 != u.v3)
+				return false;
+		}
+
+		return true;
+	};
+
+	printf("import triangles %zu stream obj %.1f ms\n", mesh.triangles.size(), stream_time);
+
+	for (const char *path : { obj, ply }) {
+		for (ThreadPool *pool : { (ThreadPool *) nullptr, &ThreadPool::global() }) {
+			Mesh loaded;
+			bool ok = false;
+			float time = time_ms([&]() {
+				ok = load_mesh(path, loaded, pool);
+			});
+
+			bool match = path == obj ? same(streamed, loaded, 1e-6f) : same(mesh, loaded, 0.0f);
+			printf("import %s %-8s %.1f ms (%d threads) ok %s identical %s\n",
+				path == obj ? "obj" : "ply", pool ? "parallel" : "serial", time,
+				pool ? pool->size() : 1, ok ? "yes" : "no", match ? "yes" : "no");
+		}
+	}
+
+	remove(obj);
+	remove(ply);
+}
+
+// Octave noise over a 1024 x 1024 grid, one sample at a time through the
+// library and in batches on each path the CPU has: samples per second and
+// the largest difference from the library
+void bench_noise()
+{
+	const siv::PerlinNoise perlin {1u};
+	PerlinBatch batch {perlin};
+	NoiseISA best = batch.isa;
+
+	int res = 1024;
+	double f = 8.0 / res;
+	std::vector <float> reference(res * res);
+	std::vector <float> samples(res * res);
+
+	const char *names[] = { "scalar", "sse4", "avx2" };
+	for (int octaves : { 4, 8, 16 }) {
+		float time = time_ms([&]() {
+			for (int y = 0; y < res; y++) {
+				for (int x = 0; x < res; x++)
+					reference[y * res + x] = perlin.octave2D_01(x * f, y * f, octaves);
+			}
+		});
+
+		printf("noise octaves %-2d library %7.2f Msamples/s\n", octaves, res * res / (time * 1e3f));
+
+		for (int isa = eNoiseScalar; isa <= (int) best; isa++) {
+			batch.isa = (NoiseISA) isa;
+
+			float batch_time = time_ms([&]() {
+				batch.octave2D_01(0, 0, f, f, res, res, octaves, samples.data());
+			});
+
+			float error = 0.0f;
+			for (int i = 0; i < res * res; i++)
+				error = std::max(error, std::abs(samples[i] - reference[i]));
+
+			printf("noise octaves %-2d %-7s %7.2f Msamples/s %.1fx max error %.2g\n",
+				octaves, names[isa], res * res / (batch_time * 1e3f), time / batch_time, error);
+		}
+
+		// Row strips on the pool, which must not change a sample
+		std::vector <float> pooled(res * res);
+		float pool_time = time_ms([&]() {
+			batch.octave2D_01(0, 0, f, f, res, res, octaves, pooled.data(), 0.5, &ThreadPool::global());
+		});
+
+		printf("noise octaves %-2d %-7s %7.2f Msamples/s on %d threads identical %s\n",
+			octaves, "pool", res * res / (pool_time * 1e3f), ThreadPool::global().size(),
+			pooled == samples ? "yes" : "no");
+	}
+}
+
+// Checks, run with --check; each prints its result and returns false on
+// a failure
+inline bool report(const char *name, bool ok)
+{
+	printf("check %-24s %s\n", name, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+// A comb of triangle pairs, one per unit along x, as a hand built binary
+// BVH: every node holds the next pair and the rest of the comb. Collapsed
+// into a wide BVH, rays coming down the comb leave several siblings on
+// the stack at each of its many levels, far more than fit
+inline bool check_wide_stack()
+{
+	const int levels = 240;
+
+	Mesh mesh;
+	for (int k = 0; k < 2 * levels; k++) {
+		float x = 0.5f * k;
+		uint32_t base = mesh.vertices.size();
+		mesh.vertices.push_back(Vertex {{x, -1, -1}});
+		mesh.vertices.push_back(Vertex {{x, 1, -1}});
+		mesh.vertices.push_back(Vertex {{x, 0, 1}});
+		mesh.triangles.push_back(Triangle {base, base + 1, base + 2});
+	}
+
+	BVH bvh;
+
+	std::function <int (int)> pair = [&](int k) {
+		BBox box = mesh.bbox(mesh.triangles[2 * k]);
+		box.grow(mesh.bbox(mesh.triangles[2 * k + 1]));
+
+		int node = bvh.push(box);
+		int left = bvh.push(mesh.bbox(mesh.triangles[2 * k]), 2 * k);
+		int right = bvh.push(mesh.bbox(mesh.triangles[2 * k + 1]), 2 * k + 1);
+		bvh.link(node, left, right);
+		return node;
+	};
+
+	std::function <int (int)> comb = [&](int k) {
+		if (k == levels - 1)
+			return pair(k);
+
+		BBox box = BBox::empty();
+		for (int j = 2 * k; j < 2 * levels; j++)
+			box.grow(mesh.bbox(mesh.triangles[j]));
+
+		int node = bvh.push(box);
+		int left = pair(k);
+		int right = comb(k + 1);
+		bvh.link(node, left, right);
+		return node;
+	};
+
+	comb(0);
+
+	VBuffer vertices;
+	IBuffer triangles;
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	BVHBuffer binary;
+	bvh.serialize(binary);
+
+	// Down the comb from its far end, then in random directions
+	std::vector <Ray> rays;
+	for (int i = 0; i < 256; i++) {
+		glm::vec3 p {levels + 1.0f, randf(-0.3f, 0.3f), randf(-0.3f, 0.3f)};
+		glm::vec3 d {-1, randf(-0.01f, 0.01f), randf(-0.01f, 0.01f)};
+		rays.push_back(Ray {p, glm::normalize(d)});
+	}
+
+	for (int i = 0; i < 256; i++) {
+		glm::vec3 p {randf(-10, levels + 10), randf(-3, 3), randf(-3, 3)};
+		glm::vec3 d {randf(-1, 1), randf(-1, 1), randf(-1, 1)};
+		rays.push_back(Ray {p, glm::normalize(d)});
+	}
+
+	bool ok = true;
+	for (int width : {4, 8}) {
+		for (bool quantized : {false, true}) {
+			BVHBuffer wide;
+			serialize_wide(bvh, width, wide, quantized);
+
+			BVHLayout layout;
+			layout.width = width;
+			layout.quantized = quantized;
+
+			for (const Ray &ray : rays) {
+				TraversalStats stats;
+				Hit expected = trace(binary, BVHLayout {}, vertices, triangles, ray, stats);
+				Hit hit = trace(wide, layout, vertices, triangles, ray, stats);
+				ok &= hit.primitive == expected.primitive;
+
+				// The fallback on its own
+				Hit levels_hit;
+				walk_wide_levels(wide, width, quantized, ray, levels_hit, stats, [&](int i) {
+					intersect(ray, vertices, triangles, i, levels_hit, stats);
+				});
+
+				ok &= levels_hit.primitive == expected.primitive;
+			}
+		}
+	}
+
+	return report("wide stack overflow", ok);
+}
+
+// Binary PLY with the given faces, each a vertex index list; counts and
+// data are written as given, so they can disagree
+inline void write_ply(const char *path, int vertex_count, const std::vector <std::vector <uint32_t>> &faces,
+		const std::vector <uint8_t> &counts)
+{
+	FILE *file = fopen(path, "wb");
+	fprintf(file, "ply\nformat binary_little_endian 1.0\n"
+		"element vertex %d\nproperty float x\nproperty float y\nproperty float z\n"
+		"element face %zu\nproperty list uchar int vertex_indices\nend_header\n",
+		vertex_count, faces.size());
+
+	for (int i = 0; i < vertex_count; i++) {
+		float position[3] = { (float) i, 0.0f, 0.0f };
+		fwrite(position, sizeof(float), 3, file);
+	}
+
+	for (size_t i = 0; i < faces.size(); i++) {
+		fwrite(&counts[i], 1, 1, file);
+		fwrite(faces[i].data(), sizeof(uint32_t), faces[i].size(), file);
+	}
+
+	fclose(file);
+}
+
+// Face counts other than 3 in a file whose size fits all triangles, and a
+// count running past the end of the file
+inline bool check_ply_faces()
+{
+	const char *path = "/tmp/check_faces.ply";
+
+	bool ok = true;
+	for (ThreadPool *pool : { (ThreadPool *) nullptr, &ThreadPool::global() }) {
+		// A quad and a two corner face take as many bytes as two
+		// triangles: read as 1 + 2 + 0 triangles
+		write_ply(path, 6, { { 0, 1, 2 }, { 1, 2, 3, 4 }, { 4, 5 } }, { 3, 4, 2 });
+
+		Mesh mesh;
+		ok &= load_mesh(path, mesh, pool);
+		ok &= mesh.triangles.size() == 3;
+		if (mesh.triangles.size() == 3) {
+			const Triangle &t = mesh.triangles[2];
+			ok &= t.v1 == 1 && t.v2 == 3 && t.v3 == 4;
+		}
+
+		// The last count asks for far more indices than there are
+		write_ply(path, 6, { { 0, 1, 2 }, { 3, 4, 5 } }, { 3, 255 });
+
+		Mesh truncated;
+		ok &= !load_mesh(path, truncated, pool);
+
+		// Only triangles, through the fixed size path
+		write_ply(path, 6, { { 0, 1, 2 }, { 3, 4, 5 } }, { 3, 3 });
+
+		Mesh triangles;
+		ok &= load_mesh(path, triangles, pool) && triangles.triangles.size() == 2;
+	}
+
+	remove(path);
+	return report("malformed ply faces", ok);
+}
+
+// OBJ faces with relative indices, v/vt/vn and v//vn corners, polygons
+// and trailing comments, read serially and in chunks of a few bytes on a
+// pool, so chunk boundaries fall inside lines; then an index past the
+// vertices, and one before the first, must fail
+inline bool check_obj_faces()
+{
+	const char *path = "/tmp/check_faces.obj";
+
+	const int blocks = 20;
+	std::vector <Triangle> expected;
+
+	FILE *file = fopen(path, "w");
+	fprintf(file, "# header comment\n");
+	for (int b = 0; b < blocks; b++) {
+		uint32_t v = 6 * b;
+
+		fprintf(file, "v 0 0 %d\nv 1 0 %d\nv 1 1 %d\nv 0 1 %d\nvt 0 0\nvn 0 0 1\n", b, b, b, b);
+		fprintf(file, "f 1/1/1 2/1/1 3/1/1 # first triangle\n");
+		fprintf(file, "f -4 -3 -2 -1\n");
+		fprintf(file, "v 2 0 %d\nv 2 1 %d\n", b, b);
+		fprintf(file, "f -5//1 -2//1 -1//1 -4//1\n");
+		fprintf(file, "o pentagon\nf 1 2 3 4 5\n");
+
+		expected.insert(expected.end(), {
+			Triangle(0, 1, 2),
+			Triangle(v, v + 1, v + 2), Triangle(v, v + 2, v + 3),
+			Triangle(v + 1, v + 4, v + 5), Triangle(v + 1, v + 5, v + 2),
+			Triangle(0, 1, 2), Triangle(0, 2, 3), Triangle(0, 3, 4)
+		});
+	}
+
+	fclose(file);
+
+	ThreadPool pool(8);
+
+	auto read = [&](ThreadPool *on, Mesh &mesh) {
+		MappedFile mapped;
+		MeshSink sink {mesh};
+		return mapped.open(path) && parse_obj(mapped, sink, on, 1);
+	};
+
+	bool ok = true;
+	for (ThreadPool *on : { (ThreadPool *) nullptr, &pool }) {
+		Mesh mesh;
+		ok &= read(on, mesh);
+		ok &= mesh.vertices.size() == 6 * blocks;
+		ok &= mesh.triangles.size() == expected.size();
+
+		for (size_t i = 0; ok && i < expected.size(); i++) {
+			const Triangle &t = mesh.triangles[i];
+			ok &= t.v1 == expected[i].v1 && t.v2 == expected[i].v2 && t.v3 == expected[i].v3;
+		}
+	}
+
+	for (const char *face : { "f 1 2 4\n", "f -4 -2 -1\n" }) {
+		file = fopen(path, "w");
+		fprintf(file, "v 0 0 0\nv 1 0 0\nv 0 1 0\n%s", face);
+		fclose(file);
+
+		for (ThreadPool *on : { (ThreadPool *) nullptr, &pool }) {
+			Mesh mesh;
+			ok &= !read(on, mesh);
+		}
+	}
+
+	remove(path);
+	return report("obj faces", ok);
+}
+
+// Blocked layout against pre-order: the same hits, and refitting after
+// the geometry moves gives the same tree, pad nodes included
+inline bool check_blocked_layout()
+{
+	Mesh mesh = generate_pillars(20000);
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+
+	BVHBuffer preorder;
+	BVHBuffer blocked;
+	bvh.serialize(preorder);
+	serialize_blocked(bvh, blocked);
+
+	bool ok = blocked.size() >= preorder.size();
+
+	// Move every vertex a little and refit both
+	for (Vertex &v : mesh.vertices)
+		v.position += glm::vec3 {randf(-0.1f, 0.1f), randf(-0.1f, 0.1f), randf(-0.1f, 0.1f)};
+
+	std::vector <BBox> bounds(mesh.triangles.size());
+	for (size_t i = 0; i < bounds.size(); i++)
+		bounds[i] = mesh.bbox(mesh.triangles[i]);
+
+	BVHRefit preorder_refit;
+	BVHRefit blocked_refit;
+	preorder_refit.refit(preorder, bounds);
+	blocked_refit.refit(blocked, bounds);
+	ok &= std::abs(preorder_refit.cost - blocked_refit.cost) <= 1e-4f * preorder_refit.cost;
+
+	VBuffer vertices;
+	IBuffer triangles;
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	std::vector <Ray> rays = generate_rays(mesh, 2000);
+	for (bool ordered : { false, true }) {
+		BVHLayout layout;
+		layout.ordered = ordered;
+
+		for (const Ray &ray : rays) {
+			TraversalStats stats;
+			Hit expected = trace(preorder, layout, vertices, triangles, ray, stats);
+			Hit hit = trace(blocked, layout, vertices, triangles, ray, stats);
+			ok &= hit.t == expected.t;
+		}
+	}
+
+	return report("blocked layout", ok);
+}
+
+// Dynamic BVH under moving geometry: small moves stay in the fattened
+// boxes, and the incremental export matches a full one and traces the
+// same hits as a static tree
+inline bool check_dynamic_moves()
+{
+	Mesh mesh = generate_pillars(4000);
+	int count = mesh.triangles.size();
+
+	DynamicBVH dynamic;
+	std::vector <int> leaves(count);
+	for (int i = 0; i < count; i++)
+		leaves[i] = dynamic.insert(mesh.bbox(mesh.triangles[i]), i);
+
+	BVHBuffer buffer;
+	DirtyRanges dirty;
+	dynamic.serialize(buffer, dirty);
+
+	bool ok = true;
+
+	std::vector <Vertex> rest = mesh.vertices;
+	for (float step : { 0.0f, 0.01f, 0.5f, 0.01f }) {
+		for (size_t i = 0; i < mesh.vertices.size(); i++) {
+			glm::vec3 offset {randf(-step, step), randf(-step, step), randf(-step, step)};
+			mesh.vertices[i].position = rest[i].position + offset;
+		}
+
+		int reinserted = 0;
+		for (int i = 0; i < count; i++)
+			reinserted += dynamic.update(leaves[i], mesh.bbox(mesh.triangles[i]));
+
+		// Nothing moved, nothing to do
+		if (step == 0.0f)
+			ok &= (reinserted == 0);
+
+		DynamicBVH copy = dynamic;
+		BVHBuffer full;
+		copy.serialize(full, dirty);
+
+		dynamic.serialize(buffer, dirty);
+		// Headers hold integer bits, compared as such
+		ok &= (buffer.size() == full.size())
+			&& memcmp(buffer.data(), full.data(), buffer.size() * sizeof(aligned_vec4)) == 0;
+		if (!ok)
+			break;
+
+		VBuffer vertices;
+		IBuffer triangles;
+		mesh.serialize_vertices(vertices);
+		mesh.serialize_indices(triangles);
+
+		BVHBuffer reference;
+		mesh.make_bvh(BVHBuilder::eBinnedSAH).serialize(reference);
+
+		BVHLayout layout;
+		for (const Ray &ray : generate_rays(mesh, 500)) {
+			TraversalStats stats;
+			Hit expected = trace(reference, layout, vertices, triangles, ray, stats);
+			Hit hit = trace(buffer, layout, vertices, triangles, ray, stats);
+			ok &= hit.t == expected.t;
+		}
+	}
+
+	return report("dynamic moves", ok);
+}
+
+// Parallel builds against serial ones on a pool of several workers, which
+// must give the same tree bit for bit
+inline bool check_parallel_identical()
+{
+	Mesh mesh = generate_pillars(150000);
+
+	std::vector <BVHPrimitive> prims(mesh.triangles.size());
+	for (size_t i = 0; i < prims.size(); i++)
+		prims[i] = BVHPrimitive(mesh.bbox(mesh.triangles[i]), i);
+
+	ThreadPool pool(4);
+
+	auto identical = [](const BVH &a, const BVH &b) {
+		BVHBuffer x;
+		BVHBuffer y;
+		a.serialize(x);
+		b.serialize(y);
+
+		return x.size() == y.size()
+			&& memcmp(x.data(), y.data(), x.size() * sizeof(aligned_vec4)) == 0;
+	};
+
+	// The binned build sorts the primitives in place, so each gets a copy
+	std::vector <BVHPrimitive> serial = prims;
+	std::vector <BVHPrimitive> parallel = prims;
+	bool ok = identical(partition_binned(serial, nullptr), partition_binned(parallel, &pool));
+
+	// The radix sort and subtree tasks of the LBVH
+	ok &= identical(partition_lbvh(prims, nullptr), partition_lbvh(prims, &pool));
+
+	return report("parallel identical", ok);
+}
+
+// Every batch path the CPU has against the library, over a grid that
+// crosses the origin
+inline bool check_noise_isa()
+{
+	const siv::PerlinNoise perlin {7u};
+	PerlinBatch batch {perlin};
+	NoiseISA best = batch.isa;
+
+	int res = 128;
+	double x0 = -3.3;
+	double y0 = -2.7;
+	double f = 6.0 / res;
+
+	std::vector <float> reference(res * res);
+	std::vector <float> samples(res * res);
+
+	bool ok = true;
+	for (int octaves : { 1, 4, 16 }) {
+		for (int y = 0; y < res; y++) {
+			for (int x = 0; x < res; x++)
+				reference[y * res + x] = perlin.octave2D_01(x0 + x * f, y0 + y * f, octaves);
+		}
+
+		for (int isa = eNoiseScalar; isa <= (int) best; isa++) {
+			batch.isa = (NoiseISA) isa;
+			batch.octave2D_01(x0, y0, f, f, res, res, octaves, samples.data());
+
+			for (int i = 0; i < res * res; i++)
+				ok &= std::abs(samples[i] - reference[i]) <= 1e-6f;
+		}
+	}
+
+	return report("noise isa", ok);
+}
+
+// Noise grids in row strips on a pool of several workers, which must give
+// the same samples as one serial pass
+inline bool check_noise_pool()
+{
+	const siv::PerlinNoise perlin {11u};
+	PerlinBatch batch {perlin};
+
+	int res = 200;
+	double f = 4.0 / res;
+
+	std::vector <float> serial(res * res);
+	std::vector <float> pooled(res * res);
+
+	ThreadPool pool(4);
+
+	bool ok = true;
+	for (int octaves : { 4, 16 }) {
+		batch.octave2D_01(0.5, 1.5, f, f, res, res, octaves, serial.data());
+		batch.octave2D_01(0.5, 1.5, f, f, res, res, octaves, pooled.data(), 0.5, &pool);
+		ok &= memcmp(serial.data(), pooled.data(), serial.size() * sizeof(float)) == 0;
+	}
+
+	return report("noise pool", ok);
+}
+
+// Scene cache round trip in a temporary directory, then a flipped section
+// byte, a truncated file and another version, each of which must miss
+inline bool check_scene_cache()
+{
+	char directory[] = "/tmp/check_cacheXXXXXX";
+	if (!mkdtemp(directory))
+		return report("scene cache", false);
+
+	Mesh mesh = generate_tile(10, 3);
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+
+	VBuffer vertices;
+	IBuffer indices;
+	BVHBuffer buffer;
+	LeafBuffer leaves;
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(indices);
+	serialize_leaves(bvh, mesh, 4, buffer, leaves);
+
+	SceneCacheKey key;
+	key.seed = 3;
+	key.resolution = 10;
+	key.leaf_size = 4;
+
+	SceneCacheStats stats;
+	stats.sah_cost = bvh.sah_cost();
+
+	bool ok = write_scene_cache(key, stats, vertices, indices, buffer, leaves, directory);
+
+	SceneCache cache;
+	ok &= cache.open(key, directory);
+	if (ok) {
+		VBuffer cached_vertices;
+		IBuffer cached_indices;
+		BVHBuffer cached_bvh;
+		LeafBuffer cached_leaves;
+		cache.copy(eCacheVertices, cached_vertices);
+		cache.copy(eCacheIndices, cached_indices);
+		cache.copy(eCacheBVH, cached_bvh);
+		cache.copy(eCacheLeaves, cached_leaves);
+
+		auto same = [](const auto &a, const auto &b) {
+			return a.size() == b.size() && memcmp(a.data(), b.data(), a.size() * sizeof(a[0])) == 0;
+		};
+
+		ok &= same(vertices, cached_vertices) && same(indices, cached_indices)
+			&& same(buffer, cached_bvh) && same(leaves, cached_leaves);
+		ok &= cache.header().stats.sah_cost == stats.sah_cost;
+
+		// A different key is a miss
+		SceneCacheKey other = key;
+		other.seed++;
+		ok &= !cache.open(other, directory);
+	}
+
+	cache.close();
+
+	// Damage a copy of the file, which must then miss
+	std::string path = scene_cache_path(key, directory);
+
+	std::vector <uint8_t> original;
+	if (FILE *file = fopen(path.c_str(), "rb")) {
+		uint8_t chunk[4096];
+		size_t n;
+		while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+			original.insert(original.end(), chunk, chunk + n);
+
+		fclose(file);
+	}
+
+	ok &= original.size() > sizeof(SceneCacheHeader);
+
+	auto misses = [&](const std::function <void (std::vector <uint8_t> &)> &damage) {
+		std::vector <uint8_t> bytes = original;
+		damage(bytes);
+
+		FILE *file = fopen(path.c_str(), "wb");
+		fwrite(bytes.data(), 1, bytes.size(), file);
+		fclose(file);
+
+		SceneCache damaged;
+		return !damaged.open(key, directory);
+	};
+
+	if (ok) {
+		SceneCacheHeader header;
+		memcpy(&header, original.data(), sizeof(header));
+
+		ok &= misses([&](std::vector <uint8_t> &bytes) {
+			bytes[header.offsets[eCacheBVH] + 5] ^= 0x10;
+		});
+
+		ok &= misses([&](std::vector <uint8_t> &bytes) {
+			bytes.resize(bytes.size() - 1);
+		});
+
+		ok &= misses([&](std::vector <uint8_t> &bytes) {
+			uint32_t version = SCENE_CACHE_VERSION + 1;
+			memcpy(bytes.data() + offsetof(SceneCacheHeader, version), &version, sizeof(version));
+		});
+
+		// Written back as it was, it hits again
+		ok &= !misses([](std::vector <uint8_t> &) {});
+	}
+
+	remove(path.c_str());
+	rmdir(directory);
+
+	return report("scene cache", ok);
+}
+
+// Clustered leaves of several sizes, threaded and ordered, against one
+// triangle per leaf: every hit the same
+inline bool check_leaves()
+{
+	Mesh mesh = generate_pillars(3000);
+
+	VBuffer vertices;
+	IBuffer triangles;
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+
+	BVHBuffer single;
+	bvh.serialize(single);
+
+	std::vector <Ray> rays = generate_rays(mesh, 1000);
+
+	std::vector <Hit> expected(rays.size());
+	for (size_t i = 0; i < rays.size(); i++) {
+		TraversalStats stats;
+		expected[i] = trace_binary(single, vertices, triangles, rays[i], stats);
+	}
+
+	bool ok = true;
+	for (int size : { 2, 4, 8 }) {
+		BVHBuffer buffer;
+		LeafBuffer leaves;
+		serialize_leaves(bvh, mesh, size, buffer, leaves);
+
+		for (bool ordered : { false, true }) {
+			BVHLayout layout;
+			layout.leaf_size = size;
+			layout.ordered = ordered;
+
+			for (size_t i = 0; i < rays.size(); i++) {
+				TraversalStats stats;
+				Hit hit = trace(buffer, layout, vertices, triangles, leaves, RBuffer(), rays[i], stats);
+				ok &= hit.t == expected[i].t && hit.primitive == expected[i].primitive;
+			}
+		}
+	}
+
+	return report("clustered leaves", ok);
+}
+
+// Triangle records against the index buffer, binary and BVH4: the same
+// primitives hit, at times equal up to the different arithmetic
+inline bool check_records()
+{
+	Mesh mesh = generate_pillars(3000);
+
+	VBuffer vertices;
+	IBuffer triangles;
+	RBuffer records;
+	mesh.serialize_vertices(vertices);
+	mesh.serialize_indices(triangles);
+	mesh.serialize_records(records);
+
+	BVH bvh = mesh.make_bvh(BVHBuilder::eBinnedSAH);
+	std::vector <Ray> rays = generate_rays(mesh, 1000);
+
+	bool ok = true;
+	for (int width : { 2, 4 }) {
+		BVHLayout layout;
+		layout.width = width;
+
+		BVHBuffer buffer;
+		if (width == 2)
+			bvh.serialize(buffer);
+		else
+			serialize_wide(bvh, width, buffer);
+
+		for (const Ray &ray : rays) {
+			TraversalStats stats;
+
+			layout.records = false;
+			Hit expected = trace(buffer, layout, vertices, triangles, LeafBuffer(), records, ray, stats);
+
+			layout.records = true;
+			Hit hit = trace(buffer, layout, vertices, triangles, LeafBuffer(), records, ray, stats);
+
+			ok &= hit.primitive == expected.primitive;
+			if (hit.primitive != -1 && expected.primitive != -1)
+				ok &= std::abs(hit.t - expected.t) <= 1e-4f * expected.t;
+		}
+	}
+
+	return report("triangle records", ok);
+}
+
+// All checks, false if any failed
+inline bool run_checks()
+{
+	bool ok = true;
+	ok &= check_wide_stack();
+	ok &= check_ply_faces();
+	ok &= check_blocked_layout();
+	ok &= check_dynamic_moves();
+	ok &= check_parallel_identical();
+	ok &= check_noise_isa();
+	ok &= check_noise_pool();
+	ok &= check_scene_cache();
+	ok &= check_obj_faces();
+	ok &= check_leaves();
+	ok &= check_records();
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	// Usage: bench [triangles] [--sweep] [--rays n] [--pillars n] [--check]
+	int triangles = 1000000;
+	int rays = 100000;
+	int pillars = 1000000;
+	bool sweep = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--check"))
+			return run_checks() ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (!strcmp(argv[i], "--sweep"))
+			sweep = true;
+		else if (!strcmp(argv[i], "--rays") && i + 1 < argc)
+			rays = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--pillars") && i + 1 < argc)
+			pillars = atoi(argv[++i]);
+		else
+			triangles = atoi(argv[i]);
+	}
+
+	bench_mesh_builder(pillars);
+	bench_terrain(rays);
+	bench_noise();
+
+	srand(0);
+
+	Mesh mesh = generate_pillars(triangles);
+	bench_bvh(mesh, sweep);
+	bench_traversal(mesh, rays);
+	bench_spatial_splits(mesh, rays);
+	bench_treelets(mesh, rays);
+	bench_leaves(mesh, rays);
+	bench_blocks(mesh, rays);
+	bench_records(mesh, rays);
+	bench_dynamic(mesh, rays);
+	bench_packed(mesh, rays);
+	bench_import(mesh);
+	bench_instances(std::max(triangles / 12, 1), rays);
+}
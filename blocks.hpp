@@ -0,0 +1,180 @@
+#ifndef BLOCKS_H_
+#define BLOCKS_H_
+
+// Standard headers
+#include <algorithm>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "traversal.hpp"
+#include "wide_bvh.hpp"
+
+// Cache friendly node order for the threaded binary BVH. In pre-order a
+// node's right child sits after its whole left subtree, so deep trees
+// spread every path over distant lines. Here the tree is cut into blocks
+// of nodes stored together. Siblings always stay side by side, since the
+// ordered traversal tests both child boxes at once and the threaded one
+// moves from the left child to the right. A block grows from its root by
+// taking the children pair of the frontier node most likely to be
+// visited, a node being hit with probability proportional to its area;
+// the nodes left out root the next blocks, placed depth first. The root
+// of the tree opens the first block. Hit and miss links are only
+// renumbered, so every traversal visits the same nodes as before; parents
+// still come before their children, which refitting relies on.
+
+// Sibling pairs per block; four 48 byte nodes are three cache lines
+constexpr int BVH_BLOCK_PAIRS = 2;
+
+// Slot of the order that holds a pad node: never linked to, primitive,
+// hit and miss -1 and an empty box at the origin
+constexpr int BVH_PAD_NODE = -1;
+
+// Cache lines that size bytes starting at offset touch
+inline int cache_lines(int offset, int size)
+{
+	return (offset + size - 1) / CACHE_LINE_SIZE - offset / CACHE_LINE_SIZE + 1;
+}
+
+// Nodes in storage order, for a buffer whose nodes start first vec4s in.
+// A block that would touch more cache lines than its size needs is moved
+// to the next line boundary by pad nodes in front of it; the root block
+// stays first, where traversal starts
+inline std::vector <int> block_order(const BVH &bvh, int block_pairs = BVH_BLOCK_PAIRS, int first = 0)
+{
+	std::vector <int> order;
+	if (bvh.nodes.empty())
+		return order;
+
+	const int node_bytes = 3 * sizeof(aligned_vec4);
+
+	order.reserve(bvh.size());
+
+	// Pad nodes, then the block
+	std::vector <int> block;
+	auto place = [&]() {
+		int size = block.size() * node_bytes;
+		int needed = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+
+		for (int pad = 0; pad < 4 && !order.empty(); pad++) {
+			int offset = (first + 3 * (int) order.size()) * sizeof(aligned_vec4);
+			if (cache_lines(offset, size) <= needed)
+				break;
+
+			order.push_back(BVH_PAD_NODE);
+		}
+
+		order.insert(order.end(), block.begin(), block.end());
+	};
+
+	// Inner nodes whose children start a block; the root is taken
+	// into the first one
+	std::vector <int> roots;
+	if (bvh.nodes[0].left != -1)
+		roots.push_back(0);
+	else
+		order.push_back(0);
+
+	std::vector <int> frontier;
+	while (!roots.empty()) {
+		int root = roots.back();
+		roots.pop_back();
+
+		block.clear();
+		if (root == 0)
+			block.push_back(0);
+
+		frontier.assign(1, root);
+		for (int taken = 0; taken < block_pairs && !frontier.empty(); taken++) {
+			int best = 0;
+			for (int i = 1; i < (int) frontier.size(); i++) {
+				float area = bvh.nodes[frontier[i]].bbox.surface_area();
+				if (area > bvh.nodes[frontier[best]].bbox.surface_area())
+					best = i;
+			}
+
+			const BVHNode &node = bvh.nodes[frontier[best]];
+			frontier[best] = frontier.back();
+			frontier.pop_back();
+
+			for (int child : { node.left, node.right }) {
+				block.push_back(child);
+				if (bvh.nodes[child].left != -1)
+					frontier.push_back(child);
+			}
+		}
+
+		place();
+
+		// Leftmost on top of the stack, so blocks follow the pre-order
+		// of their roots
+		std::sort(frontier.begin(), frontier.end(), std::greater <int> ());
+		roots.insert(roots.end(), frontier.begin(), frontier.end());
+	}
+
+	return order;
+}
+
+// BVH::serialize with the nodes stored in the given order, pad nodes
+// included; links are the same nodes as in pre-order, so traversals are
+// unchanged
+inline void serialize_ordered(const BVH &bvh, const std::vector <int> &order, BVHBuffer &buffer,
+		int primitive_base = 0)
+{
+	int base = buffer.size();
+	int count = bvh.size();
+
+	std::vector <int> slot(count);
+	for (int i = 0; i < (int) order.size(); i++) {
+		if (order[i] != BVH_PAD_NODE)
+			slot[order[i]] = base + 3 * i;
+	}
+
+	buffer.resize(base + 3 * order.size());
+	for (int i = 0; i < (int) order.size(); i++) {
+		if (order[i] != BVH_PAD_NODE)
+			continue;
+
+		int offset = base + 3 * i;
+		buffer[offset] = glm::vec4 {
+			bits_to_float(-1),
+			bits_to_float(-1),
+			bits_to_float(-1),
+			0.0f
+		};
+
+		buffer[offset + 1] = glm::vec3 {0.0f};
+		buffer[offset + 2] = glm::vec3 {0.0f};
+	}
+
+	for (int n = 0; n < count; n++) {
+		const BVHNode &node = bvh.nodes[n];
+
+		int primitive = node.primitive;
+		if (primitive != -1)
+			primitive += primitive_base;
+
+		int next = n + node.size;
+		int miss = next < count ? slot[next] : -1;
+		int hit = node.left != -1 ? slot[node.left] : miss;
+
+		int offset = slot[n];
+		buffer[offset] = glm::vec4 {
+			bits_to_float(primitive),
+			bits_to_float(hit),
+			bits_to_float(miss),
+			0.0f
+		};
+
+		buffer[offset + 1] = node.bbox.min;
+		buffer[offset + 2] = node.bbox.max;
+	}
+}
+
+// Serialize in cache line blocks
+inline void serialize_blocked(const BVH &bvh, BVHBuffer &buffer, int primitive_base = 0)
+{
+	serialize_ordered(bvh, block_order(bvh, BVH_BLOCK_PAIRS, buffer.size()), buffer, primitive_base);
+}
+
+#endif
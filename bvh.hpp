@@ -2,10 +2,15 @@
 #define BVH_H_
 
 // Standard headers
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
 #include <vector>
 
 // App headers
 #include "core.hpp"
+#include "thread_pool.hpp"
 
 // Acceleration structure
 struct BBox {
@@ -16,84 +21,174 @@ struct BBox {
 		glm::vec3 size = max - min;
 		return 2.0f * (size.x * size.y + size.x * size.z + size.y * size.z);
 	}
+
+	// Empty box, grows into anything
+	static BBox empty() {
+		return BBox {
+			glm::vec3(std::numeric_limits <float> ::max()),
+			glm::vec3(-std::numeric_limits <float> ::max())
+		};
+	}
+
+	void grow(const BBox &other) {
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+	}
+
+	void grow(const glm::vec3 &point) {
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+};
+
+// Available BVH builders
+enum BVHBuilder : uint32_t {
+	eSweepSAH,		// Largest axis, rescans every node per candidate split
+	eBinnedSAH,		// Single pass binning over all three axes
+	eParallelBinnedSAH,	// Binned, with subtrees built as pool tasks
+	eLBVH,			// Morton code sort, for per-frame rebuilds
+	eSpatialSAH		// Binned with spatial splits, triangles only
 };
 
 using BVHBuffer = std::vector <aligned_vec4>;
 
-struct BVH {
+// SAH constants
+constexpr float BVH_TRAVERSAL_COST = 1.0f;
+constexpr float BVH_INTERSECTION_COST = 1.0f;
+
+// Primitive reference used by the builders
+struct BVHPrimitive {
+	BBox bbox;
+	glm::vec3 centroid;
+	int id;
+
+	BVHPrimitive() = default;
+
+	BVHPrimitive(const BBox &bbox_, int id_)
+			: bbox(bbox_), centroid((bbox_.min + bbox_.max) / 2.0f), id(id_) {}
+};
+
+// Node of the flattened tree; subtrees are contiguous in pre-order, so
+// the left child always directly follows its parent
+struct BVHNode {
 	BBox bbox;
 	int primitive = -1;
-	BVH *left = nullptr;
-	BVH *right = nullptr;
+	int left = -1;
+	int right = -1;
+	int size = 1;		// Number of nodes in the subtree
+};
 
-	BVH(const BBox &bbox_, int p) : bbox(bbox_), primitive(p) {}
+struct BVH {
+	std::vector <BVHNode> nodes;
 
-	~BVH() {
-		if (left) delete left;
-		if (right) delete right;
+	int size() const {
+		return nodes.size();
 	}
 
-	int size() const {
-		int size = 1;
-		if (left) size += left->size();
-		if (right) size += right->size();
-		return size;
+	// Append a node, children are linked afterwards
+	int push(const BBox &bbox, int primitive = -1) {
+		BVHNode node;
+		node.bbox = bbox;
+		node.primitive = primitive;
+		nodes.push_back(node);
+		return nodes.size() - 1;
 	}
 
-	void serialize(BVHBuffer &buffer, int miss = -1) {
-		// Compute indices and hit/miss indices
-		int size = buffer.size();
-		int after = size + 3;
+	void link(int node, int left, int right) {
+		nodes[node].left = left;
+		nodes[node].right = right;
+		nodes[node].size = 1 + nodes[left].size + nodes[right].size;
+	}
 
-		int left_index = left ? after : -1;
-		int left_size = left ? 3 * left->size() : 0;
-		int right_index = right ? after + left_size : -1;
+	// Builders that write subtrees in place store child indices relative
+	// to the parent, make them absolute
+	void resolve_children() {
+		for (int i = 0; i < (int) nodes.size(); i++) {
+			if (nodes[i].left != -1) {
+				nodes[i].left += i;
+				nodes[i].right += i;
+			}
+		}
+	}
 
-		int hit = left_index;
-		if (!left && !right) hit = miss;
+	// Linear pass, the miss link of a node is the first node after its
+	// subtree; primitive indices are offset by primitive_base, for trees
+	// over a slice of a shared primitive buffer
+	void serialize(BVHBuffer &buffer, int primitive_base = 0) const {
+		int base = buffer.size();
+		int count = nodes.size();
+
+		buffer.resize(base + 3 * count);
+		for (int i = 0; i < count; i++) {
+			const BVHNode &node = nodes[i];
+
+			int primitive = node.primitive;
+			if (primitive != -1)
+				primitive += primitive_base;
+
+			int next = i + node.size;
+			int miss = next < count ? base + 3 * next : -1;
+			int hit = node.left != -1 ? base + 3 * node.left : miss;
+
+			buffer[base + 3 * i] = glm::vec3 {
+				*reinterpret_cast <float *> (&primitive),
+				*reinterpret_cast <float *> (&hit),
+				*reinterpret_cast <float *> (&miss)
+			};
+
+			buffer[base + 3 * i + 1] = node.bbox.min;
+			buffer[base + 3 * i + 2] = node.bbox.max;
+		}
+	}
 
-		int miss_left = right_index;
-		if (!right) miss_left = miss;
+	// SAH cost of the tree, relative to the root surface area
+	float sah_cost() const {
+		if (nodes.empty())
+			return 0.0f;
 
-		// Serialize
-		aligned_vec4 header = glm::vec3 {
-			*reinterpret_cast <float *> (&primitive),
-			*reinterpret_cast <float *> (&hit),
-			*reinterpret_cast <float *> (&miss)
-		};
+		float root_area = nodes[0].bbox.surface_area();
 
-		buffer.push_back(header);
-		buffer.push_back(bbox.min);
-		buffer.push_back(bbox.max);
+		float cost = 0.0f;
+		for (const BVHNode &node : nodes) {
+			float area = node.bbox.surface_area() / root_area;
+			if (node.left == -1)
+				cost += area * BVH_INTERSECTION_COST;
+			else
+				cost += area * BVH_TRAVERSAL_COST;
+		}
 
-		if (left) left->serialize(buffer, miss_left);
-		if (right) right->serialize(buffer, miss);
+		return cost;
 	}
 
-	void print(int indentation = 0) {
+	void print(int node = 0, int indentation = 0) const {
+		if (node == -1 || node >= (int) nodes.size())
+			return;
+
+		const BVHNode &n = nodes[node];
+
 		std::string ident(indentation, '\t');
-		std::cout << ident << "BVH [" << primitive << "]: "
-			<< glm::to_string(bbox.min)
-			<< " -> " << glm::to_string(bbox.max) << std::endl;
-		if (left) left->print(indentation + 1);
-		if (right) right->print(indentation + 1);
+		std::cout << ident << "BVH [" << n.primitive << "]: "
+			<< glm::to_string(n.bbox.min)
+			<< " -> " << glm::to_string(n.bbox.max) << std::endl;
+		print(n.left, indentation + 1);
+		print(n.right, indentation + 1);
 	}
 };
 
 // Union bounding boxes
-inline BBox union_of(const std::vector <BVH *> &nodes) {
-	glm::vec3 min = nodes[0]->bbox.min;
-	glm::vec3 max = nodes[0]->bbox.max;
+inline BBox union_of(const std::vector <BVHPrimitive> &nodes) {
+	glm::vec3 min = nodes[0].bbox.min;
+	glm::vec3 max = nodes[0].bbox.max;
 
 	for (int i = 1; i < nodes.size(); i++) {
-		min = glm::min(min, nodes[i]->bbox.min);
-		max = glm::max(max, nodes[i]->bbox.max);
+		min = glm::min(min, nodes[i].bbox.min);
+		max = glm::max(max, nodes[i].bbox.max);
 	}
 
 	return BBox{min, max};
 }
 
-inline float cost_split(const std::vector <BVH *> &nodes, float split, int axis) {
+inline float cost_split(const std::vector <BVHPrimitive> &nodes, float split, int axis) {
 	float cost = 0.0f;
 
 	glm::vec3 min_left = glm::vec3(std::numeric_limits <float> ::max());
@@ -102,15 +197,15 @@ inline float cost_split(const std::vector <BVH *> &nodes, float split, int axis)
 	glm::vec3 min_right = glm::vec3(std::numeric_limits <float> ::max());
 	glm::vec3 max_right = glm::vec3(-std::numeric_limits <float> ::max());
 
-	glm::vec3 tmin = nodes[0]->bbox.min;
-	glm::vec3 tmax = nodes[0]->bbox.max;
+	glm::vec3 tmin = nodes[0].bbox.min;
+	glm::vec3 tmax = nodes[0].bbox.max;
 
 	int prims_left = 0;
 	int prims_right = 0;
 
-	for (BVH *node : nodes) {
-		glm::vec3 min = node->bbox.min;
-		glm::vec3 max = node->bbox.max;
+	for (const BVHPrimitive &node : nodes) {
+		glm::vec3 min = node.bbox.min;
+		glm::vec3 max = node.bbox.max;
 
 		tmin = glm::min(tmin, min);
 		tmax = glm::max(tmax, max);
@@ -144,18 +239,21 @@ inline float cost_split(const std::vector <BVH *> &nodes, float split, int axis)
 	return 1 + (prims_left * sa_left + prims_right * sa_right) / sa_total;
 }
 
-inline BVH *partition(std::vector <BVH *> &nodes) {
+// Sweep SAH builder, appends the subtree to the tree in pre-order and
+// returns the index of its root
+inline int partition(std::vector <BVHPrimitive> &nodes, BVH &bvh) {
 	// Base cases
 	if (nodes.size() == 0)
-		return nullptr;
+		return -1;
 
 	if (nodes.size() == 1)
-		return nodes[0];
+		return bvh.push(nodes[0].bbox, nodes[0].id);
 
 	if (nodes.size() == 2) {
-		BVH *node = new BVH(union_of(nodes), -1);
-		node->left = nodes[0];
-		node->right = nodes[1];
+		int node = bvh.push(union_of(nodes));
+		int left = bvh.push(nodes[0].bbox, nodes[0].id);
+		int right = bvh.push(nodes[1].bbox, nodes[1].id);
+		bvh.link(node, left, right);
 		return node;
 	}
 
@@ -168,8 +266,8 @@ inline BVH *partition(std::vector <BVH *> &nodes) {
 
 	for (size_t n = 0; n < nodes.size(); n++) {
 		for (int i = 0; i < 3; i++) {
-			glm::vec3 min = nodes[n]->bbox.min;
-			glm::vec3 max = nodes[n]->bbox.max;
+			glm::vec3 min = nodes[n].bbox.min;
+			glm::vec3 max = nodes[n].bbox.max;
 
 			float extent = std::abs(max[i] - min[i]);
 			if (extent > max_extent) {
@@ -196,8 +294,8 @@ inline BVH *partition(std::vector <BVH *> &nodes) {
 		}
 	}
 
-	std::vector <BVH *> left;
-	std::vector <BVH *> right;
+	std::vector <BVHPrimitive> left;
+	std::vector <BVHPrimitive> right;
 
 	if (min_cost == std::numeric_limits <float> ::max()) {
 		// Partition evenly
@@ -209,9 +307,9 @@ inline BVH *partition(std::vector <BVH *> &nodes) {
 		}
 	} else {
 		// Centroid partition with optimal split
-		for (BVH *node : nodes) {
-			glm::vec3 min = node->bbox.min;
-			glm::vec3 max = node->bbox.max;
+		for (const BVHPrimitive &node : nodes) {
+			glm::vec3 min = node.bbox.min;
+			glm::vec3 max = node.bbox.max;
 
 			float value = (min[axis] + max[axis]) / 2.0f;
 
@@ -223,15 +321,286 @@ inline BVH *partition(std::vector <BVH *> &nodes) {
 	}
 
 	// Create left and right nodes
-	BBox bbox = union_of(nodes);
-	BVH *left_node = partition(left);
-	BVH *right_node = partition(right);
-
-	BVH *node = new BVH(bbox, -1);
-	node->left = left_node;
-	node->right = right_node;
+	int node = bvh.push(union_of(nodes));
+	int left_node = partition(left, bvh);
+	int right_node = partition(right, bvh);
 
+	bvh.link(node, left_node, right_node);
 	return node;
 }
 
+inline BVH partition(std::vector <BVHPrimitive> &prims) {
+	BVH bvh;
+	bvh.nodes.reserve(2 * prims.size());
+	partition(prims, bvh);
+	return bvh;
+}
+
+// Binned SAH builder settings
+constexpr int BVH_BINS = 16;
+
+// Parallel builder settings; subtrees at least this large become tasks,
+// and nodes at least this large bin in chunks of BVH_BINNING_GRAIN
+constexpr int BVH_PARALLEL_TASK_SIZE = 4096;
+constexpr int BVH_PARALLEL_BINNING_SIZE = 1 << 16;
+constexpr int BVH_BINNING_GRAIN = 1 << 14;
+
+// Leaves currently hold a single primitive (see serialize)
+constexpr int BVH_MAX_LEAF_SIZE = 1;
+
+struct BVHBin {
+	BBox bbox = BBox::empty();
+	int count = 0;
+};
+
+// Result of the binned split search
+struct BVHSplit {
+	BBox bbox;		// Bounds of the primitives
+	BBox cbox;		// Bounds of the centroids
+	glm::vec3 scale;	// Bins per unit of centroid extent
+	int axis = -1;
+	int bin = -1;
+	float cost = std::numeric_limits <float> ::max();
+
+	// Bin index of a centroid along an axis
+	int bin_index(const glm::vec3 &centroid, int axis_) const {
+		int b = (int) ((centroid[axis_] - cbox.min[axis_]) * scale[axis_]);
+		return std::min(std::max(b, 0), BVH_BINS - 1);
+	}
+
+	// Whether a centroid goes to the left child
+	bool left(const glm::vec3 &centroid) const {
+		return bin_index(centroid, axis) <= bin;
+	}
+};
+
+using BVHBins = std::array <std::array <BVHBin, BVH_BINS>, 3>;
+
+// Primitive and centroid bounds of a range
+inline void bound_primitives(const BVHPrimitive *prims, int begin, int end, BBox &bbox, BBox &cbox)
+{
+	bbox = BBox::empty();
+	cbox = BBox::empty();
+	for (int i = begin; i < end; i++) {
+		bbox.grow(prims[i].bbox);
+		cbox.grow(prims[i].centroid);
+	}
+}
+
+// Fill bins on all axes in a single pass over a range
+inline void bin_primitives(const BVHPrimitive *prims, int begin, int end, const BVHSplit &split, BVHBins &bins)
+{
+	for (int i = begin; i < end; i++) {
+		for (int axis = 0; axis < 3; axis++) {
+			int b = split.bin_index(prims[i].centroid, axis);
+			bins[axis][b].bbox.grow(prims[i].bbox);
+			bins[axis][b].count++;
+		}
+	}
+}
+
+// Bin every primitive once for all three axes, then sweep the bins to
+// find the cheapest split; large ranges are bounded and binned in chunks
+// on the pool, which gives the same result since min/max and counts
+// merge exactly in any order
+inline BVHSplit find_binned_split(const BVHPrimitive *prims, int count, ThreadPool *pool = nullptr)
+{
+	BVHSplit split;
+
+	// Node and centroid bounds
+	BBox &bbox = split.bbox;
+	BBox &cbox = split.cbox;
+
+	bool parallel = pool && count >= BVH_PARALLEL_BINNING_SIZE;
+	if (parallel) {
+		int chunks = parallel_chunks(*pool, count, BVH_BINNING_GRAIN);
+
+		std::vector <BBox> bboxes(chunks);
+		std::vector <BBox> cboxes(chunks);
+
+		parallel_for(*pool, 0, count, BVH_BINNING_GRAIN,
+			[&](int c, int begin, int end) {
+				bound_primitives(prims, begin, end, bboxes[c], cboxes[c]);
+			}
+		);
+
+		bbox = BBox::empty();
+		cbox = BBox::empty();
+		for (int c = 0; c < chunks; c++) {
+			bbox.grow(bboxes[c]);
+			cbox.grow(cboxes[c]);
+		}
+	} else {
+		bound_primitives(prims, 0, count, bbox, cbox);
+	}
+
+	// Axes with no centroid extent cannot be split
+	glm::vec3 extent = cbox.max - cbox.min;
+
+	bool valid[3];
+	for (int axis = 0; axis < 3; axis++) {
+		valid[axis] = extent[axis] > 0.0f;
+		split.scale[axis] = valid[axis] ? BVH_BINS / extent[axis] : 0.0f;
+	}
+
+	BVHBins bins;
+	if (parallel) {
+		int chunks = parallel_chunks(*pool, count, BVH_BINNING_GRAIN);
+
+		std::vector <BVHBins> chunk_bins(chunks);
+		parallel_for(*pool, 0, count, BVH_BINNING_GRAIN,
+			[&](int c, int begin, int end) {
+				bin_primitives(prims, begin, end, split, chunk_bins[c]);
+			}
+		);
+
+		for (int c = 0; c < chunks; c++) {
+			for (int axis = 0; axis < 3; axis++) {
+				for (int b = 0; b < BVH_BINS; b++) {
+					bins[axis][b].bbox.grow(chunk_bins[c][axis][b].bbox);
+					bins[axis][b].count += chunk_bins[c][axis][b].count;
+				}
+			}
+		}
+	} else {
+		bin_primitives(prims, 0, count, split, bins);
+	}
+
+	// Prefix/suffix sweep over the bin boundaries
+	float sa_total = bbox.surface_area();
+	for (int axis = 0; axis < 3; axis++) {
+		if (!valid[axis])
+			continue;
+
+		// Right side areas and counts, for splits after bin i
+		std::array <float, BVH_BINS> right_area;
+		std::array <int, BVH_BINS> right_count;
+
+		BBox right = BBox::empty();
+		int count_right = 0;
+		for (int i = BVH_BINS - 1; i > 0; i--) {
+			right.grow(bins[axis][i].bbox);
+			count_right += bins[axis][i].count;
+			right_area[i - 1] = right.surface_area();
+			right_count[i - 1] = count_right;
+		}
+
+		BBox left = BBox::empty();
+		int count_left = 0;
+		for (int i = 0; i < BVH_BINS - 1; i++) {
+			left.grow(bins[axis][i].bbox);
+			count_left += bins[axis][i].count;
+
+			if (count_left == 0 || right_count[i] == 0)
+				continue;
+
+			float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST
+				* (count_left * left.surface_area()
+				+ right_count[i] * right_area[i]) / sa_total;
+
+			if (cost < split.cost) {
+				split.axis = axis;
+				split.bin = i;
+				split.cost = cost;
+			}
+		}
+	}
+
+	return split;
+}
+
+// Binned SAH build of a subtree into nodes[0, 2 * count - 1); leaves hold
+// a single primitive, so every subtree size is known up front and tasks
+// can write their subtrees in place, giving the same layout as the
+// serial build
+inline void partition_binned(BVHPrimitive *prims, int count, BVHNode *nodes, ThreadPool *pool = nullptr)
+{
+	BVHNode &node = nodes[0];
+	node.size = 2 * count - 1;
+
+	// Single primitives are always leaves
+	if (count == 1) {
+		node.bbox = prims[0].bbox;
+		node.primitive = prims[0].id;
+		node.left = -1;
+		node.right = -1;
+		return;
+	}
+
+	// Two primitives always split, no need to bin
+	if (count == 2 && BVH_MAX_LEAF_SIZE < 2) {
+		node.bbox = prims[0].bbox;
+		node.bbox.grow(prims[1].bbox);
+		node.primitive = -1;
+		node.left = 1;
+		node.right = 2;
+
+		for (int i = 0; i < 2; i++) {
+			nodes[i + 1].bbox = prims[i].bbox;
+			nodes[i + 1].primitive = prims[i].id;
+			nodes[i + 1].left = -1;
+			nodes[i + 1].right = -1;
+			nodes[i + 1].size = 1;
+		}
+
+		return;
+	}
+
+	BVHSplit split = find_binned_split(prims, count, pool);
+	node.bbox = split.bbox;
+
+	// Leaf cost versus the best split
+	float leaf_cost = BVH_INTERSECTION_COST * count;
+	if (count <= BVH_MAX_LEAF_SIZE && leaf_cost <= split.cost) {
+		node.primitive = prims[0].id;
+		node.left = -1;
+		node.right = -1;
+		return;
+	}
+
+	// Coincident centroids fall back to an even split
+	int mid = count / 2;
+	if (split.axis != -1) {
+		BVHPrimitive *it = std::partition(prims, prims + count,
+			[&](const BVHPrimitive &p) {
+				return split.left(p.centroid);
+			}
+		);
+
+		mid = it - prims;
+	}
+
+	// Indices are relative to this subtree while building
+	node.primitive = -1;
+	node.left = 1;
+	node.right = 2 * mid;
+
+	if (pool && count >= BVH_PARALLEL_TASK_SIZE) {
+		TaskGroup group(*pool);
+		group.spawn([&]() {
+			partition_binned(prims, mid, nodes + 1, pool);
+		});
+
+		partition_binned(prims + mid, count - mid, nodes + 2 * mid, pool);
+		group.wait();
+	} else {
+		partition_binned(prims, mid, nodes + 1);
+		partition_binned(prims + mid, count - mid, nodes + 2 * mid);
+	}
+}
+
+inline BVH partition_binned(std::vector <BVHPrimitive> &prims, ThreadPool *pool = nullptr)
+{
+	BVH bvh;
+	if (prims.empty())
+		return bvh;
+
+	bvh.nodes.resize(2 * prims.size() - 1);
+	partition_binned(prims.data(), prims.size(), bvh.nodes.data(), pool);
+
+	bvh.resolve_children();
+
+	return bvh;
+}
+
 #endif
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -35,24 +36,24 @@
 #include <PerlinNoise.hpp>
 
 // App headers
+#include "blocks.hpp"
 #include "bvh.hpp"
 #include "core.hpp"
+#include "dynamic_bvh.hpp"
+#include "mesh.hpp"
+#include "noise.hpp"
+#include "refit.hpp"
+#include "scene_cache.hpp"
 #include "shades.hpp"
+#include "terrain.hpp"
+#include "traversal.hpp"
+#include "treelet.hpp"
+#include "wide_bvh.hpp"
 
 const int WIDTH = 1000;
 const int HEIGHT = 1000;
 const int PIXEL_SIZE = 4;
 
-inline float randf()
-{
-	return (float) rand() / (float) RAND_MAX;
-}
-
-inline float randf(float min, float max)
-{
-	return randf() * (max - min) + min;
-}
-
 inline std::string read_glsl(const std::string &path)
 {
 	// Open file
@@ -108,20 +109,63 @@ void set_float(unsigned int, const char *, float);
 void set_vec2(unsigned int, const char *, const glm::vec2 &);
 void set_vec3(unsigned int, const char *, const glm::vec3 &);
 
+// Storage buffer from any memory, e.g. a mapped file
 template <class T>
-unsigned int make_ssbo(const std::vector <T> &data, int binding)
+unsigned int make_ssbo(const T *data, size_t count, int binding)
 {
 	unsigned int ssbo;
 
 	// Create storage buffer object
 	glGenBuffers(1, &ssbo);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(T) * data.size(), data.data(), GL_STATIC_DRAW);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(T) * count, data, GL_STATIC_DRAW);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, binding);
 
 	return ssbo;
 }
 
+template <class T>
+unsigned int make_ssbo(const std::vector <T> &data, int binding)
+{
+	return make_ssbo(data.data(), data.size(), binding);
+}
+
+// Replace the contents of a storage buffer
+template <class T>
+void update_ssbo(unsigned int ssbo, const std::vector <T> &data)
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(T) * data.size(), data.data(), GL_DYNAMIC_DRAW);
+}
+
+// Upload only the dirty ranges of a storage buffer
+template <class T>
+void update_ssbo(unsigned int ssbo, const std::vector <T> &data, const DirtyRanges &dirty)
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+	for (const BufferRange &r : dirty.ranges) {
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+			sizeof(T) * r.offset, sizeof(T) * r.count,
+			data.data() + r.offset);
+	}
+}
+
+// Replace the contents of a texture through a pixel unpack buffer; the
+// buffer is orphaned first, so the copy into the texture is left to the
+// driver instead of waiting for the previous one
+inline void stream_texture(unsigned int pbo, unsigned int texture, int width, int height,
+		GLenum format, GLenum type, const void *data, size_t size)
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	glBufferSubData(GL_PIXEL_UNPACK_BUFFER, 0, size, data);
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, nullptr);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
 // TODO: use in initialize graphics
 inline void initialize_imgui(GLFWwindow *window)
 {
@@ -168,6 +212,17 @@ struct Camera {
 		set_vec3(program, "camera.right", right);
 	}
 
+	// Primary ray through uv on the screen, as generate_ray in the shader
+	Ray generate_ray(const glm::vec2 &uv) const {
+		float scale = std::tan(glm::radians(60.0f) * 0.5f);
+		float aspect = float(WIDTH) / float(HEIGHT);
+
+		glm::vec2 cuv = (1.0f - 2.0f * uv) * glm::vec2(scale * aspect, scale);
+		glm::vec3 dir = glm::normalize(right * cuv.x - up * cuv.y + front);
+
+		return Ray {eye, dir};
+	}
+
 	// Move camera
 	void move(float dx, float dy, float dz) {
 		eye += dx * right + dy * up + dz * front;
@@ -191,251 +246,6 @@ extern Camera camera;
 void mouse_callback(GLFWwindow *, double, double);
 GLFWwindow *initialize_graphics();
 
-// TODO: add info about normals
-// TODO: use indices and another vertex structure
-struct Vertex {
-	glm::vec3 position;
-};
-
-struct Triangle {
-	uint32_t v1, v2, v3;
-	Shades shade = Shades::eNone;
-
-	Triangle(uint32_t v1, uint32_t v2, uint32_t v3)
-			: v1(v1), v2(v2), v3(v3) {}
-
-	Triangle(uint32_t v1, uint32_t v2, uint32_t v3, Shades shade)
-			: v1(v1), v2(v2), v3(v3), shade(shade) {}
-};
-
-using VBuffer = std::vector <aligned_vec4>;
-using IBuffer = std::vector <aligned_uvec4>;
-
-struct Mesh {
-	std::vector <Vertex> vertices;
-	std::vector <Triangle> triangles;
-
-	// Add another mesh to this mesh
-	void add(const Mesh &mesh) {
-		int size = vertices.size();
-		vertices.insert(vertices.end(),
-			mesh.vertices.begin(),
-			mesh.vertices.end()
-		);
-
-		// Need to reindex indices
-		for (auto &triangle : mesh.triangles) {
-			triangles.push_back({
-				triangle.v1 + size,
-				triangle.v2 + size,
-				triangle.v3 + size,
-				triangle.shade
-			});
-		}
-	}
-
-	// Serialize mesh vertices and indices to buffers
-	void serialize_vertices(VBuffer &vbuffer) const {
-		vbuffer.reserve(vertices.size());
-		for (const auto &v : vertices)
-			vbuffer.push_back(aligned_vec4(v.position));
-	}
-
-	// TODO: format should be uvec4: v1, v2, v3, type (water, leaves, grass,
-	// etc.)
-	void serialize_indices(IBuffer &ibuffer) const {
-		for (const auto &triangle : triangles) {
-			ibuffer.push_back(glm::uvec4 {
-				triangle.v1,
-				triangle.v2,
-				triangle.v3,
-				(uint32_t) triangle.shade
-			});
-		}
-	}
-
-	// Make BVH
-	BVH *make_bvh() {
-		std::vector <BVH *> nodes;
-		nodes.reserve(triangles.size());
-
-		int id = 0;
-		for (const auto &tri: triangles) {
-			glm::vec3 min = vertices[tri.v1].position;
-			glm::vec3 max = vertices[tri.v1].position;
-
-			min = glm::min(min, vertices[tri.v2].position);
-			max = glm::max(max, vertices[tri.v2].position);
-
-			min = glm::min(min, vertices[tri.v3].position);
-			max = glm::max(max, vertices[tri.v3].position);
-
-
-			nodes.push_back(new BVH(BBox {min, max}, id++));
-		}
-
-		return partition(nodes);
-	}
-};
-
-// Generate transform matrix
-struct Transform {
-	glm::vec3 pos;
-	glm::vec3 rot;
-	glm::vec3 scale;
-
-	Transform(const glm::vec3 &pos_ = glm::vec3(0.0f),
-			const glm::vec3 &rot_ = glm::vec3(0.0f),
-			const glm::vec3 &scale_ = glm::vec3(1.0f))
-			: pos(pos_), rot(rot_), scale(scale_) {}
-
-	glm::mat4 matrix() {
-		// Convert rot to radians
-		glm::vec3 rad_rot = rot * (float) M_PI / 180.0f;
-
-		glm::mat4 mat {1.0f};
-		mat = glm::translate(mat, pos);
-		mat = glm::rotate(mat, rad_rot.x, glm::vec3(1.0f, 0.0f, 0.0f));
-		mat = glm::rotate(mat, rad_rot.y, glm::vec3(0.0f, 1.0f, 0.0f));
-		mat = glm::rotate(mat, rad_rot.z, glm::vec3(0.0f, 0.0f, 1.0f));
-		mat = glm::scale(mat, scale);
-		return mat;
-	}
-};
-
-// Generate pillar mesh
-inline Mesh generate_pillar(const glm::mat4 &transform)
-{
-	Mesh box;
-
-	// Properties
-	glm::vec4 center_ = transform * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-	glm::vec3 dx = transform * glm::vec4(1.0f, 0.0f, 0.0f, 1.0f) - center_;
-	glm::vec3 dy = transform * glm::vec4(0.0f, 1.0f, 0.0f, 1.0f) - center_;
-	glm::vec3 dz = transform * glm::vec4(0.0f, 0.0f, 1.0f, 1.0f) - center_;
-
-	// Vertices
-	glm::vec3 center = glm::vec3(center_);
-	glm::vec3 v1 = center + dx/2.0f + dy/2.0f + dz/2.0f;
-	glm::vec3 v2 = center + dx/2.0f + dy/2.0f - dz/2.0f;
-	glm::vec3 v3 = center + dx/2.0f - dy/2.0f - dz/2.0f;
-	glm::vec3 v4 = center + dx/2.0f - dy/2.0f + dz/2.0f;
-	glm::vec3 v5 = center - dx/2.0f + dy/2.0f + dz/2.0f;
-	glm::vec3 v6 = center - dx/2.0f + dy/2.0f - dz/2.0f;
-	glm::vec3 v7 = center - dx/2.0f - dy/2.0f - dz/2.0f;
-	glm::vec3 v8 = center - dx/2.0f - dy/2.0f + dz/2.0f;
-
-	// Push vertices
-	box.vertices = {
-		Vertex {v1}, Vertex {v2}, Vertex {v3}, Vertex {v4},
-		Vertex {v5}, Vertex {v6}, Vertex {v7}, Vertex {v8}
-	};
-
-	// Indices
-	box.triangles = std::vector <Triangle> {
-		Triangle {0, 1, 2, Shades::ePillar}, Triangle {0, 2, 3, Shades::ePillar},
-		Triangle {4, 5, 6, Shades::ePillar}, Triangle {4, 6, 7, Shades::ePillar},
-		Triangle {0, 1, 5, Shades::ePillar}, Triangle {0, 5, 4, Shades::ePillar},
-		Triangle {1, 2, 6, Shades::ePillar}, Triangle {1, 6, 5, Shades::ePillar},
-		Triangle {2, 3, 7, Shades::ePillar}, Triangle {2, 7, 6, Shades::ePillar},
-		Triangle {3, 0, 4, Shades::ePillar}, Triangle {3, 4, 7, Shades::ePillar}
-	};
-
-	return box;
-}
-
-// Generate terrain tile mesh
-// TODO: try to optimizde the resulting mesh (low deltas could be merged)
-inline Mesh generate_terrain(int resolution)
-{
-	float width = 10.0f;
-	float height = 10.0f;
-
-	// Height map
-	size_t mapres = resolution + 1;
-	std::vector <float> height_map(mapres * mapres);
-
-	srand(clock());
-	for (size_t i = 0; i < mapres * mapres; i++)
-		height_map[i] = randf() * 1.0f;
-
-	float slice = width/resolution;
-
-	float x = -width/2.0f;
-	float z = -height/2.0f;
-
-	Mesh tile;
-	for (int i = 0; i <= resolution; i++) {
-		for (int j = 0; j <= resolution; j++) {
-			Vertex vertex;
-			vertex.position = glm::vec3(x, height_map[i * resolution + j], z);
-			tile.vertices.push_back(vertex);
-			x += slice;
-		}
-
-		x = -width/2.0f;
-		z += slice;
-	}
-
-	// Generate indices
-	for (int i = 0; i < resolution; i++) {
-		for (int j = 0; j < resolution; j++) {
-			// Indices of square
-			uint32_t a = i * (resolution + 1) + j;
-			uint32_t b = (i + 1) * (resolution + 1) + j;
-			uint32_t c = (i + 1) * (resolution + 1) + j + 1;
-			uint32_t d = i * (resolution + 1) + j + 1;
-
-			// Push
-			tile.triangles.push_back(Triangle {a, b, c, Shades::eGrass});
-			tile.triangles.push_back(Triangle {a, c, d, Shades::eGrass});
-		}
-	}
-
-	return tile;
-}
-
-// Generate a scene tile
-inline Mesh generate_tile(int resolution)
-{
-	// Generate terrain tile
-	// TODO: pass height map
-	// Mesh tile = generate_terrain(resolution);
-	Mesh tile;
-
-	// Add random columns
-	int nboxes = rand() % 5 + 10;
-
-	for (int i = 0; i < nboxes; i++) {
-		// Random size
-		float width = randf() * 0.6f + 0.5f;
-		float depth = randf() * 0.6f + 0.5f;
-		float height = randf() * 2.0f + 0.5f;
-
-		// Random position within the tile
-		float x = randf(-4.5, 4.5);
-		float z = randf(-4.5, 4.5);
-		float y = height / 2.0f + randf();
-
-		// Random rotation
-		float rx = randf() * 15.0f;
-		float ry = randf() * 360.0f;
-		float rz = randf() * 15.0f;
-
-		// Generate box
-		glm::mat4 mat = Transform {
-			glm::vec3(x, y, z),
-			glm::vec3(rx, ry, rz),
-			glm::vec3(width, height, depth)
-		}.matrix();
-
-		// Add box
-		tile.add(generate_pillar(mat));
-	}
-
-	return tile;
-}
-
 // Shaders
 struct Shaders {
 	unsigned int pixelizer;
@@ -483,6 +293,18 @@ extern Shaders *shaders;
 
 // State for the application
 struct State {
+	bool animate_pillars = false;
+	bool cloud_atlas = true;
+	bool block_bvh = false;
+	bool dynamic_bvh = false;
+	bool instanced_pillars = false;
+	bool optimize_bvh = false;
+	bool ordered_traversal = false;
+	bool packed_mesh = false;
+	bool quantize_bvh = false;
+	bool quantize_vertices = true;
+	bool refit_bvh = true;
+	bool triangle_records = false;
 	bool paused = false;
 	bool show_clouds = true;
 	bool show_grass = true;
@@ -494,16 +316,66 @@ struct State {
 	bool show_triangles = true;
 	bool show_wind_map = false;
 	bool tab = false;
+	bool terrain_mesh = false;
 	bool viewing_mode = true;
 
 	float ray_marching_step = 0.1f;
 	float ray_shadow_step = 0.001f;
+	float terrain_error = TERRAIN_MESH_ERROR;
+
+	int bvh_builder = BVHBuilder::eBinnedSAH;
+	int bvh_width = 2;
+	int instances = 2000;
+	int leaf_size = 1;
+	uint32_t tile_seed = 0;
+	bool tile_seeded = false;	// Given on the command line, so cached
 
 	const float terrain_size = 20.0f;
+	const float terrain_height = 3.0f;	// scale in constants.glsl
+	const int tile_resolution = 10;
+
+	// Incremental BVH of the flat tile, binary layout only
+	bool dynamic() const {
+		return dynamic_bvh && bvh_width == 2 && !instanced_pillars;
+	}
+
+	// Leaves with several triangles, for the flat binary layout only
+	bool clustered_leaves() const {
+		return leaf_size > 1 && bvh_width == 2 && !instanced_pillars && !dynamic_bvh;
+	}
+
+	// Packed vertices and indices, for the static flat tile only since
+	// quantization is over its bounds
+	bool packed() const {
+		return packed_mesh && !animate_pillars && !instanced_pillars;
+	}
+
+	// Everything the startup tile and its BVH depend on
+	SceneCacheKey scene_cache_key() const {
+		SceneCacheKey key;
+		key.seed = tile_seed;
+		key.resolution = tile_resolution;
+		key.builder = bvh_builder;
+		key.width = bvh_width;
+		key.quantized = quantize_bvh;
+		key.optimize = optimize_bvh;
+		key.leaf_size = bvh_layout().leaf_size;
+		key.blocked = block_bvh;
+		return key;
+	}
+
+	BVHLayout bvh_layout() const {
+		return BVHLayout {
+			bvh_width, quantize_bvh, ordered_traversal,
+			clustered_leaves() ? leaf_size : 1,
+			triangle_records
+		};
+	}
 
 	// TODO: method to apply settings if changed
 	void apply() {
 		set_int(shaders->pixelizer, "clouds", show_clouds);
+		set_int(shaders->pixelizer, "cloud_atlas", cloud_atlas);
 		set_int(shaders->pixelizer, "normals", show_normals);
 		set_int(shaders->pixelizer, "grass", show_grass);
 		set_int(shaders->pixelizer, "grass_blades", show_grass_blades);
@@ -511,6 +383,13 @@ struct State {
 		set_int(shaders->pixelizer, "grass_length", show_grass_length);
 		set_int(shaders->pixelizer, "grass_power", show_grass_power);
 		set_int(shaders->pixelizer, "wind_map", show_wind_map);
+		set_int(shaders->pixelizer, "bvh_width", bvh_width);
+		set_int(shaders->pixelizer, "bvh_quantized", quantize_bvh);
+		set_int(shaders->pixelizer, "bvh_ordered", ordered_traversal);
+		set_int(shaders->pixelizer, "bvh_leaves", clustered_leaves());
+		set_int(shaders->pixelizer, "records", triangle_records);
+		set_int(shaders->pixelizer, "packed_mesh", packed());
+		set_int(shaders->pixelizer, "terrain_mesh", terrain_mesh && !instanced_pillars);
 		set_float(shaders->pixelizer, "ray_marching_step", ray_marching_step);
 		set_float(shaders->pixelizer, "ray_shadow_step", ray_shadow_step);
 	}
@@ -546,11 +425,7 @@ class HeightMap {
 		const siv::PerlinNoise perlin_grass {seed};
 
 		const double f = (frequency/data_res);
-		for (int i = 0; i < data_res * data_res; i++) {
-			int x = i % data_res;
-			int y = i / data_res;
-			data[i] = perlin_grass.octave2D_01(x * f, y * f, octaves);
-		}
+		PerlinBatch(perlin_grass).octave2D_01(0, 0, f, f, data_res, data_res, octaves, data, 0.5, &ThreadPool::global());
 	}
 
 	// Evaluate the heightmap at a given point
@@ -595,31 +470,34 @@ class HeightMap {
 		float d = state.terrain_size/normals_res;
 		float eps = 0.01f;
 
-		for (int x = 0; x < normals_res; x++) {
-			for (int y = 0; y < normals_res; y++) {
-				float x_ = x * d - state.terrain_size/2.0f;
-				float z_ = y * d - state.terrain_size/2.0f;
+		// Strips of rows on the pool, each texel on its own
+		parallel_for(ThreadPool::global(), 0, normals_res, FIELD_ROW_GRAIN, [&](int, int begin, int end) {
+			for (int x = begin; x < end; x++) {
+				for (int y = 0; y < normals_res; y++) {
+					float x_ = x * d - state.terrain_size/2.0f;
+					float z_ = y * d - state.terrain_size/2.0f;
 
-				glm::vec3 grad_x {2 * d, 0, 0};
-				if (x > 0 && x < normals_res - 1) {
-					float y1 = eval(data, data_res, x_ + eps, z_);
-					float y2 = eval(data, data_res, x_ - eps, z_);
+					glm::vec3 grad_x {2 * d, 0, 0};
+					if (x > 0 && x < normals_res - 1) {
+						float y1 = eval(data, data_res, x_ + eps, z_);
+						float y2 = eval(data, data_res, x_ - eps, z_);
 
-					grad_x.y = (y1 - y2) / (2 * eps);
-				}
+						grad_x.y = (y1 - y2) / (2 * eps);
+					}
 
-				glm::vec3 grad_z {0, 0, 2 * d};
-				if (y > 0 && y < normals_res - 1) {
-					float y1 = eval(data, data_res, x_, z_ + eps);
-					float y2 = eval(data, data_res, x_, z_ - eps);
+					glm::vec3 grad_z {0, 0, 2 * d};
+					if (y > 0 && y < normals_res - 1) {
+						float y1 = eval(data, data_res, x_, z_ + eps);
+						float y2 = eval(data, data_res, x_, z_ - eps);
 
-					grad_z.y = (y1 - y2) / (2 * eps);
-				}
+						grad_z.y = (y1 - y2) / (2 * eps);
+					}
 
-				glm::vec3 n = -glm::normalize(glm::cross(grad_x, grad_z));
-				normals[x * normals_res + y] = (n * 0.5f + 0.5f);
+					glm::vec3 n = -glm::normalize(glm::cross(grad_x, grad_z));
+					normals[x * normals_res + y] = (n * 0.5f + 0.5f);
+				}
 			}
-		}
+		});
 	}
 
 	// Water level
@@ -668,24 +546,7 @@ class HeightMap {
 	float frequency2 = 1.0f;
 
 	void generate_wind_map(float xoff = 0, float yoff = 0) {
-		// Random normals
-		float f1 = (frequency1/wind_res);
-		float f2 = (frequency2/wind_res);
-
-		for (int i = 0; i < wind_res * wind_res; i++) {
-			float x = fmod(i, wind_res) + xoff;
-			float y = i/float(wind_res) + yoff;
-
-			float h1 = pn1.octave2D_01(x * f1, y * f1, 4);
-			float h2 = pn2.octave2D_01(x * f2, y * f2, 4);
-
-			float theta = (2 * h1 - 1) * glm::pi <float> ();
-			glm::vec2 dir = glm::normalize(glm::vec2 {cos(theta), sin(theta)});
-
-			// z is strength of wind
-			float z = 0.5f * h2 + 0.5f;
-			wind_map[i] = 0.5f * glm::vec3(dir.x, dir.y, z) + 0.5f;
-		}
+		wind_field(wind_map, xoff, yoff, &ThreadPool::global());
 	}
 
 	// TODO: keep outside, since its duplicate with grassmap
@@ -846,6 +707,82 @@ public:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, wind_res, wind_res, GL_RGB, GL_FLOAT, wind_map);
 	}
 
+	// Wind field at an offset into out, wind_res^2 entries; only reads
+	// the noise, so it can run on any thread, serially without a pool
+	void wind_field(glm::vec3 *out, float xoff, float yoff, ThreadPool *pool) const {
+		// Random normals
+		float f1 = (frequency1/wind_res);
+		float f2 = (frequency2/wind_res);
+
+		PerlinBatch batch1(pn1);
+		PerlinBatch batch2(pn2);
+
+		// Strips of rows of both fields; y runs on along each row as
+		// before
+		auto rows = [&](int, int begin, int end) {
+			std::vector <float> row1(wind_res);
+			std::vector <float> row2(wind_res);
+
+			for (int r = begin; r < end; r++) {
+				float y = r + yoff;
+				batch1.octave2D_01(xoff * f1, y * f1, f1, f1/wind_res, wind_res, 4, row1.data());
+				batch2.octave2D_01(xoff * f2, y * f2, f2, f2/wind_res, wind_res, 4, row2.data());
+
+				for (int x = 0; x < wind_res; x++) {
+					float theta = (2 * row1[x] - 1) * glm::pi <float> ();
+					glm::vec2 dir = glm::normalize(glm::vec2 {cos(theta), sin(theta)});
+
+					// z is strength of wind
+					float z = 0.5f * row2[x] + 0.5f;
+					out[r * wind_res + x] = 0.5f * glm::vec3(dir.x, dir.y, z) + 0.5f;
+				}
+			}
+		};
+
+		if (pool)
+			parallel_for(*pool, 0, wind_res, FIELD_ROW_GRAIN, rows);
+		else
+			rows(0, 0, wind_res);
+	}
+
+	int wind_resolution() const {
+		return wind_res;
+	}
+
+	// Upload a wind field made elsewhere, see wind_field
+	void upload_wind(const std::vector <glm::vec3> &field, unsigned int pbo) {
+		stream_texture(pbo, t_wind, wind_res, wind_res, GL_RGB, GL_FLOAT,
+			field.data(), sizeof(glm::vec3) * field.size());
+	}
+
+	// Height at a world position as the shader samples it: the 8 bit
+	// texture, linear between texel centers and clamped at the edges
+	float height(float x, float z) const {
+		auto texel = [&](int i, int j) {
+			i = glm::clamp(i, 0, data_res - 1);
+			j = glm::clamp(j, 0, data_res - 1);
+			return (uint8_t) (data[j * data_res + i] * std::numeric_limits <uint8_t> ::max())
+				/ (float) std::numeric_limits <uint8_t> ::max();
+		};
+
+		float u = (x / state.terrain_size + 0.5f) * data_res - 0.5f;
+		float v = (z / state.terrain_size + 0.5f) * data_res - 0.5f;
+
+		int i = floor(u);
+		int j = floor(v);
+
+		float h0 = lerp(texel(i, j), texel(i + 1, j), u - i);
+		float h1 = lerp(texel(i, j + 1), texel(i + 1, j + 1), u - i);
+		return state.terrain_height * lerp(h0, h1, v - j);
+	}
+
+	// Samples for a terrain mesh, a cell per texel
+	TerrainGrid terrain_grid() const {
+		return sample_terrain([&](float x, float z) {
+			return height(x, z);
+		}, data_res, state.terrain_size);
+	}
+
 	// Free memory manually
 	void free() {
 		delete[] data;
@@ -879,14 +816,10 @@ class GrassMap {
 		const double f2 = f1/10.0f;
 		const double f3 = f1/100.0f;
 
-		for (int i = 0; i < data_res * data_res; i++) {
-			int x = i % data_res;
-			int y = i / data_res;
-
-			grass[i] = perlin1.octave2D_01(x * f1, y * f1, octaves);
-			grass_length[i] = perlin2.octave2D_01(x * f2, y * f2, 16);
-			grass_power[i] = perlin3.octave2D_01(x * f3, y * f3, 4);
-		}
+		ThreadPool *pool = &ThreadPool::global();
+		PerlinBatch(perlin1).octave2D_01(0, 0, f1, f1, data_res, data_res, octaves, grass, 0.5, pool);
+		PerlinBatch(perlin2).octave2D_01(0, 0, f2, f2, data_res, data_res, 16, grass_length, 0.5, pool);
+		PerlinBatch(perlin3).octave2D_01(0, 0, f3, f3, data_res, data_res, 4, grass_power, 0.5, pool);
 	}
 
 	// Evaluate the heightmap at a given point
@@ -930,31 +863,34 @@ class GrassMap {
 		float d = state.terrain_size/normals_res;
 		float eps = 0.01f;
 
-		for (int x = 0; x < normals_res; x++) {
-			for (int y = 0; y < normals_res; y++) {
-				float x_ = x * d - state.terrain_size/2.0f;
-				float z_ = y * d - state.terrain_size/2.0f;
+		// Strips of rows on the pool, each texel on its own
+		parallel_for(ThreadPool::global(), 0, normals_res, FIELD_ROW_GRAIN, [&](int, int begin, int end) {
+			for (int x = begin; x < end; x++) {
+				for (int y = 0; y < normals_res; y++) {
+					float x_ = x * d - state.terrain_size/2.0f;
+					float z_ = y * d - state.terrain_size/2.0f;
 
-				glm::vec3 grad_x {2 * d, 0, 0};
-				if (x > 0 && x < normals_res - 1) {
-					float y1 = eval(x_ + eps, z_);
-					float y2 = eval(x_ - eps, z_);
+					glm::vec3 grad_x {2 * d, 0, 0};
+					if (x > 0 && x < normals_res - 1) {
+						float y1 = eval(x_ + eps, z_);
+						float y2 = eval(x_ - eps, z_);
 
-					grad_x.y = (y1 - y2) / (2 * eps);
-				}
+						grad_x.y = (y1 - y2) / (2 * eps);
+					}
 
-				glm::vec3 grad_z {0, 0, 2 * d};
-				if (y > 0 && y < normals_res - 1) {
-					float y1 = eval(x_, z_ + eps);
-					float y2 = eval(x_, z_ - eps);
+					glm::vec3 grad_z {0, 0, 2 * d};
+					if (y > 0 && y < normals_res - 1) {
+						float y1 = eval(x_, z_ + eps);
+						float y2 = eval(x_, z_ - eps);
 
-					grad_z.y = (y1 - y2) / (2 * eps);
-				}
+						grad_z.y = (y1 - y2) / (2 * eps);
+					}
 
-				glm::vec3 n = -glm::normalize(glm::cross(grad_x, grad_z));
-				normals[x * normals_res + y] = (n * 0.5f + 0.5f);
+					glm::vec3 n = -glm::normalize(glm::cross(grad_x, grad_z));
+					normals[x * normals_res + y] = (n * 0.5f + 0.5f);
+				}
 			}
-		}
+		});
 	}
 
 	// Creating texture
@@ -2,7 +2,12 @@
 #define CORE_H_
 
 // Standard headers
+#include <stdlib.h>
+
+#include <algorithm>
 #include <iostream>
+#include <random>
+#include <vector>
 
 // GLM headers
 #include <glm/glm.hpp>
@@ -25,6 +30,86 @@ struct alignas(16) aligned_uvec4 {
 	aligned_uvec4(const glm::uvec4 &v) : v(v) {}
 };
 
+// Contiguous range of buffer elements
+struct BufferRange {
+	int offset;
+	int count;
+};
+
+// Changed elements of a buffer, merged into ranges for partial uploads;
+// ranges closer than gap elements are merged to save upload calls
+struct DirtyRanges {
+	std::vector <BufferRange> ranges;
+	int gap = 16;
+
+	// Mark [begin, end), in increasing order
+	void mark(int begin, int end) {
+		if (!ranges.empty()) {
+			BufferRange &last = ranges.back();
+			if (begin <= last.offset + last.count + gap) {
+				last.count = std::max(last.count, end - last.offset);
+				return;
+			}
+		}
+
+		ranges.push_back(BufferRange {begin, end - begin});
+	}
+
+	// Total number of elements covered
+	int size() const {
+		int total = 0;
+		for (const BufferRange &r : ranges)
+			total += r.count;
+		return total;
+	}
+
+	void clear() {
+		ranges.clear();
+	}
+};
+
+// Copy src into dst element by element, marking the ones that changed
+template <class T>
+void copy_dirty(std::vector <T> &dst, const std::vector <T> &src, DirtyRanges &dirty)
+{
+	dirty.clear();
+	if (dst.size() != src.size()) {
+		dst = src;
+		dirty.mark(0, src.size());
+		return;
+	}
+
+	for (size_t i = 0; i < src.size(); i++) {
+		if (dst[i].v != src[i].v) {
+			dst[i] = src[i];
+			dirty.mark(i, i + 1);
+		}
+	}
+}
+
+// Random numbers
+inline float randf()
+{
+	return (float) rand() / (float) RAND_MAX;
+}
+
+inline float randf(float min, float max)
+{
+	return randf() * (max - min) + min;
+}
+
+// From a generator of its own, for results that must not depend on who
+// else draws from rand()
+inline float randf(std::mt19937 &rng)
+{
+	return std::uniform_real_distribution <float> (0.0f, 1.0f)(rng);
+}
+
+inline float randf(std::mt19937 &rng, float min, float max)
+{
+	return std::uniform_real_distribution <float> (min, max)(rng);
+}
+
 inline std::ostream &operator<<(std::ostream &os, const aligned_vec4 &v)
 {
 	return os << glm::to_string(v.v);
@@ -0,0 +1,558 @@
+#ifndef DYNAMIC_BVH_H_
+#define DYNAMIC_BVH_H_
+
+// Standard headers
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "core.hpp"
+#include "wide_bvh.hpp"
+
+// Dynamic BVH for objects that come and go at runtime, in the manner of a
+// dynamic AABB tree: leaves are inserted next to the sibling that adds the
+// least SAH cost, found by branch and bound, removed by splicing out their
+// parent, and every change refits the ancestors and rotates them locally
+// when swapping a child with a grandchild shrinks the tree. Each update is
+// O(log n) on a balanced tree. Moving leaves keep a fattened box and are
+// only reinserted once their primitive leaves it.
+//
+// Nodes live in a pool with a free list, and each has a fixed slot in the
+// serialized buffer, the root always in the first one. Incremental export
+// only visits the nodes listed as changed since the last one, and rewrites
+// what changed: bounds of refit nodes, and the headers around nodes whose
+// children changed, since a node's miss link is the right sibling of its
+// lowest ancestor on the left. Free slots are written as unreachable empty
+// nodes. Export on demand gives a compact pre-order BVH instead, for any
+// of the other layouts.
+
+// Padding of a moved leaf's box on every side, relative to its longest
+// side, so small moves do not reinsert it
+constexpr float DYNAMIC_BVH_FAT = 0.1f;
+
+struct DynamicNode {
+	BBox bbox;
+	int parent = -1;
+	int left = -1;
+	int right = -1;
+	int primitive = -1;		// -1 for inner nodes, -2 for free ones
+};
+
+class DynamicBVH {
+	std::vector <DynamicNode> nodes;
+	std::vector <int> free_nodes;
+
+	// Buffer slot of each node, and the node in each slot
+	std::vector <int> slots;
+	std::vector <int> owners;
+
+	// Changes since the last incremental export, and the nodes with any
+	std::vector <bool> moved;	// Bounds or slot changed
+	std::vector <bool> relinked;	// Children, parent or slot changed
+	std::vector <int> dirty_nodes;
+
+	// Slots written by the export in progress
+	std::vector <bool> written;
+	std::vector <int> written_slots;
+
+	int root_node = -1;
+	int leaf_count = 0;
+
+	// Branch and bound queue of the insertion search, kept around
+	struct Candidate {
+		float lower_bound;
+		float inherited;
+		int node;
+
+		bool operator<(const Candidate &other) const {
+			return lower_bound > other.lower_bound;
+		}
+	};
+
+	std::vector <Candidate> heap;
+
+	bool leaf(int n) const {
+		return nodes[n].left == -1;
+	}
+
+	int allocate() {
+		int n;
+		if (!free_nodes.empty()) {
+			n = free_nodes.back();
+			free_nodes.pop_back();
+		} else {
+			n = nodes.size();
+			nodes.emplace_back();
+			slots.push_back(n);
+			owners.push_back(n);
+			moved.push_back(false);
+			relinked.push_back(false);
+		}
+
+		nodes[n] = DynamicNode();
+		mark_moved(n);
+		mark_relinked(n);
+		return n;
+	}
+
+	void release(int n) {
+		nodes[n] = DynamicNode();
+		nodes[n].primitive = -2;
+		free_nodes.push_back(n);
+		mark_moved(n);
+		mark_relinked(n);
+	}
+
+	// Queue a node for the next export the first time it changes
+	void mark_moved(int n) {
+		if (!moved[n] && !relinked[n])
+			dirty_nodes.push_back(n);
+
+		moved[n] = true;
+	}
+
+	void mark_relinked(int n) {
+		if (!moved[n] && !relinked[n])
+			dirty_nodes.push_back(n);
+
+		relinked[n] = true;
+	}
+
+	void touch(int n) {
+		mark_moved(n);
+		if (nodes[n].parent != -1)
+			mark_relinked(nodes[n].parent);
+	}
+
+	// Put a new root in the first slot, swapping with its holder
+	void set_root(int n) {
+		root_node = n;
+		if (n == -1)
+			return;
+
+		nodes[n].parent = -1;
+
+		int other = owners[0];
+		if (other != n) {
+			std::swap(slots[n], slots[other]);
+			owners[slots[n]] = n;
+			owners[slots[other]] = other;
+
+			mark_relinked(n);
+			mark_relinked(other);
+			touch(n);
+			touch(other);
+		}
+	}
+
+	void replace_child(int parent, int old_child, int new_child) {
+		if (nodes[parent].left == old_child)
+			nodes[parent].left = new_child;
+		else
+			nodes[parent].right = new_child;
+
+		nodes[new_child].parent = parent;
+		mark_relinked(parent);
+	}
+
+	void set_children(int n, int left, int right) {
+		nodes[n].left = left;
+		nodes[n].right = right;
+		nodes[left].parent = n;
+		nodes[right].parent = n;
+		mark_relinked(n);
+	}
+
+	void refit(int n) {
+		BBox box = nodes[nodes[n].left].bbox;
+		box.grow(nodes[nodes[n].right].bbox);
+
+		DynamicNode &node = nodes[n];
+		if (box.min != node.bbox.min || box.max != node.bbox.max) {
+			node.bbox = box;
+			mark_moved(n);
+		}
+	}
+
+	// Sibling for a new leaf with the lowest total cost: the area of the
+	// new parent plus the growth of every ancestor. The growth inherited
+	// from ancestors bounds the cost of anything deeper
+	int best_sibling(const BBox &box) {
+		float area = box.surface_area();
+
+		auto merged_area = [&](int n) {
+			BBox merged = nodes[n].bbox;
+			merged.grow(box);
+			return merged.surface_area();
+		};
+
+		int best = root_node;
+		float best_cost = merged_area(root_node);
+
+		heap.clear();
+		heap.push_back(Candidate {area, 0.0f, root_node});
+
+		while (!heap.empty()) {
+			std::pop_heap(heap.begin(), heap.end());
+			Candidate c = heap.back();
+			heap.pop_back();
+
+			if (c.lower_bound >= best_cost)
+				break;
+
+			float direct = merged_area(c.node);
+			float cost = direct + c.inherited;
+			if (cost < best_cost) {
+				best = c.node;
+				best_cost = cost;
+			}
+
+			if (leaf(c.node))
+				continue;
+
+			float inherited = c.inherited + direct - nodes[c.node].bbox.surface_area();
+			float lower_bound = area + inherited;
+			if (lower_bound >= best_cost)
+				continue;
+
+			for (int child : { nodes[c.node].left, nodes[c.node].right }) {
+				heap.push_back(Candidate {lower_bound, inherited, child});
+				std::push_heap(heap.begin(), heap.end());
+			}
+		}
+
+		return best;
+	}
+
+	// Swap a child of n with a grandchild on the other side if that
+	// shrinks the child that would take it in
+	void rotate(int n) {
+		int b = nodes[n].left;
+		int c = nodes[n].right;
+
+		struct Swap {
+			int child;		// Child of n to move down
+			int node;		// Its sibling, which takes it in
+			int grandchild;		// Child of node to move up
+			int kept;		// Other child of node
+		};
+
+		Swap swaps[4];
+		int count = 0;
+
+		if (!leaf(c)) {
+			swaps[count++] = Swap {b, c, nodes[c].left, nodes[c].right};
+			swaps[count++] = Swap {b, c, nodes[c].right, nodes[c].left};
+		}
+
+		if (!leaf(b)) {
+			swaps[count++] = Swap {c, b, nodes[b].left, nodes[b].right};
+			swaps[count++] = Swap {c, b, nodes[b].right, nodes[b].left};
+		}
+
+		int best = -1;
+		float best_gain = 0.0f;
+
+		for (int i = 0; i < count; i++) {
+			const Swap &s = swaps[i];
+
+			BBox box = nodes[s.child].bbox;
+			box.grow(nodes[s.kept].bbox);
+
+			float gain = nodes[s.node].bbox.surface_area() - box.surface_area();
+			if (gain > best_gain) {
+				best = i;
+				best_gain = gain;
+			}
+		}
+
+		if (best == -1)
+			return;
+
+		const Swap &s = swaps[best];
+
+		// The grandchild takes the place of the child under n, which
+		// joins the kept grandchild; sides are kept
+		replace_child(n, s.child, s.grandchild);
+		replace_child(s.node, s.grandchild, s.child);
+
+		touch(s.child);
+		touch(s.grandchild);
+		refit(s.node);
+	}
+
+	// Refit and rotate every ancestor from n up
+	void repair(int n) {
+		while (n != -1) {
+			refit(n);
+			rotate(n);
+			n = nodes[n].parent;
+		}
+	}
+
+	void attach(int leaf_node) {
+		if (root_node == -1) {
+			set_root(leaf_node);
+			return;
+		}
+
+		int sibling = best_sibling(nodes[leaf_node].bbox);
+		int old_parent = nodes[sibling].parent;
+
+		int parent = allocate();
+		if (old_parent != -1)
+			replace_child(old_parent, sibling, parent);
+
+		set_children(parent, sibling, leaf_node);
+		touch(sibling);
+		refit(parent);
+
+		if (old_parent == -1)
+			set_root(parent);
+
+		repair(nodes[parent].parent);
+	}
+
+	void detach(int leaf_node) {
+		if (leaf_node == root_node) {
+			set_root(-1);
+			return;
+		}
+
+		int parent = nodes[leaf_node].parent;
+		int grandparent = nodes[parent].parent;
+		int sibling = nodes[parent].left == leaf_node ? nodes[parent].right : nodes[parent].left;
+
+		release(parent);
+
+		if (grandparent == -1) {
+			set_root(sibling);
+		} else {
+			replace_child(grandparent, parent, sibling);
+			touch(sibling);
+			repair(grandparent);
+		}
+
+		nodes[leaf_node].parent = -1;
+	}
+
+	// Serialized header of a node, given where its subtree exits
+	glm::vec4 header(int n, int miss) const {
+		const DynamicNode &node = nodes[n];
+		int hit = leaf(n) ? miss : 3 * slots[node.left];
+		return glm::vec4 {
+			bits_to_float(node.primitive),
+			bits_to_float(hit),
+			bits_to_float(miss),
+			0.0f
+		};
+	}
+
+	// Miss link of a node: the right sibling of its lowest ancestor, itself
+	// included, that is a left child
+	int miss_link(int n) const {
+		while (nodes[n].parent != -1) {
+			int parent = nodes[n].parent;
+			if (nodes[parent].left == n)
+				return 3 * slots[nodes[parent].right];
+
+			n = parent;
+		}
+
+		return -1;
+	}
+
+	static bool contains(const BBox &outer, const BBox &inner) {
+		for (int i = 0; i < 3; i++) {
+			if (inner.min[i] < outer.min[i] || inner.max[i] > outer.max[i])
+				return false;
+		}
+
+		return true;
+	}
+public:
+	int size() const {
+		return leaf_count;
+	}
+
+	int root() const {
+		return root_node;
+	}
+
+	const DynamicNode &node(int n) const {
+		return nodes[n];
+	}
+
+	// Add a primitive; returns its leaf, a handle that stays valid until
+	// the primitive is removed
+	int insert(const BBox &bbox, int primitive) {
+		int n = allocate();
+		nodes[n].bbox = bbox;
+		nodes[n].primitive = primitive;
+
+		attach(n);
+		leaf_count++;
+		return n;
+	}
+
+	void remove(int leaf_node) {
+		detach(leaf_node);
+		release(leaf_node);
+		leaf_count--;
+	}
+
+	// Move a primitive; once it leaves the box of its leaf, the leaf gets
+	// a fattened box and is reinserted where it now fits best. Returns
+	// whether it was
+	bool update(int leaf_node, const BBox &bbox) {
+		if (contains(nodes[leaf_node].bbox, bbox))
+			return false;
+
+		glm::vec3 size = bbox.max - bbox.min;
+		float pad = DYNAMIC_BVH_FAT * std::max(size.x, std::max(size.y, size.z));
+
+		detach(leaf_node);
+		nodes[leaf_node].bbox = BBox {bbox.min - pad, bbox.max + pad};
+		touch(leaf_node);
+		attach(leaf_node);
+		return true;
+	}
+
+	// SAH cost relative to the root area, as BVH::sah_cost
+	float sah_cost() const {
+		if (root_node == -1)
+			return 0.0f;
+
+		float root_area = nodes[root_node].bbox.surface_area();
+
+		float cost = 0.0f;
+		for (int n = 0; n < (int) nodes.size(); n++) {
+			if (nodes[n].primitive == -2)
+				continue;
+
+			float area = nodes[n].bbox.surface_area() / root_area;
+			cost += area * (leaf(n) ? BVH_INTERSECTION_COST : BVH_TRAVERSAL_COST);
+		}
+
+		return cost;
+	}
+
+	// Compact pre-order copy, for any serialization
+	BVH to_bvh() const {
+		BVH bvh;
+		if (root_node == -1)
+			return bvh;
+
+		bvh.nodes.reserve(2 * leaf_count - 1);
+
+		auto emit = [&](auto &&self, int n) -> int {
+			const DynamicNode &node = nodes[n];
+			if (leaf(n))
+				return bvh.push(node.bbox, node.primitive);
+
+			int index = bvh.push(node.bbox);
+			int left = self(self, node.left);
+			int right = self(self, node.right);
+
+			bvh.link(index, left, right);
+			return index;
+		};
+
+		emit(emit, root_node);
+		return bvh;
+	}
+
+	// Bring a threaded buffer, as BVH::serialize writes it, up to date
+	// with the slot layout, marking the vec4s written. Returns true when
+	// the buffer grew, and has to be uploaded whole
+	bool serialize(BVHBuffer &buffer, DirtyRanges &dirty) {
+		int count = nodes.size();
+		bool grew = (int) buffer.size() < 3 * count;
+
+		if (grew) {
+			int first = buffer.size() / 3;
+			buffer.resize(3 * count);
+			for (int n = 0; n < count; n++) {
+				if (slots[n] >= first) {
+					mark_moved(n);
+					mark_relinked(n);
+				}
+			}
+		}
+
+		written.resize(count, false);
+
+		auto write_slot = [&](int slot) {
+			if (!written[slot]) {
+				written[slot] = true;
+				written_slots.push_back(slot);
+			}
+		};
+
+		auto write_header = [&](int n, int miss) {
+			buffer[3 * slots[n]] = header(n, miss);
+			write_slot(slots[n]);
+		};
+
+		// Headers along the right edge of a subtree share its miss link
+		auto write_edge = [&](int n, int miss) {
+			while (true) {
+				write_header(n, miss);
+				if (leaf(n))
+					break;
+
+				n = nodes[n].right;
+			}
+		};
+
+		for (int n : dirty_nodes) {
+			if (nodes[n].primitive == -2) {
+				int slot = 3 * slots[n];
+				buffer[slot] = glm::vec4 {bits_to_float(-1), bits_to_float(-1), bits_to_float(-1), 0.0f};
+				buffer[slot + 1] = glm::vec3(0.0f);
+				buffer[slot + 2] = glm::vec3(0.0f);
+				write_slot(slots[n]);
+				continue;
+			}
+
+			if (moved[n]) {
+				buffer[3 * slots[n] + 1] = nodes[n].bbox.min;
+				buffer[3 * slots[n] + 2] = nodes[n].bbox.max;
+				write_slot(slots[n]);
+			}
+
+			if (relinked[n]) {
+				int miss = miss_link(n);
+				write_header(n, miss);
+
+				if (!leaf(n)) {
+					write_edge(nodes[n].left, 3 * slots[nodes[n].right]);
+					write_edge(nodes[n].right, miss);
+				}
+			}
+		}
+
+		for (int n : dirty_nodes) {
+			moved[n] = false;
+			relinked[n] = false;
+		}
+
+		dirty_nodes.clear();
+
+		std::sort(written_slots.begin(), written_slots.end());
+
+		dirty.clear();
+		for (int s : written_slots) {
+			dirty.mark(3 * s, 3 * s + 3);
+			written[s] = false;
+		}
+
+		written_slots.clear();
+
+		return grew;
+	}
+};
+
+#endif
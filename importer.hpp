@@ -0,0 +1,767 @@
+#ifndef IMPORTER_H_
+#define IMPORTER_H_
+
+// Standard headers
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// App headers
+#include "core.hpp"
+#include "mesh.hpp"
+#include "thread_pool.hpp"
+
+// Mesh importer for Wavefront OBJ and binary PLY files. The file is mapped
+// and parsed in place, in chunks on the pool, straight into the Mesh or
+// the VBuffer/IBuffer layouts:
+//
+//	OBJ:	chunks end at line ends; a first pass counts the vertices and
+//		triangles of each chunk, so the second one knows where its
+//		output goes and what relative indices refer to
+//	PLY:	fixed size vertex records are split evenly; face records are
+//		too when they are all triangles, otherwise a serial walk over
+//		the list counts finds their offsets first
+//
+// Only positions and faces are read, polygons become fans. Numbers are
+// parsed without allocating or copying lines. Returns false for anything
+// unreadable: a missing file, ASCII PLY, or an index out of range.
+
+// Bytes per OBJ chunk, and PLY records per chunk
+constexpr int IMPORT_OBJ_GRAIN = 1 << 20;
+constexpr int IMPORT_PLY_GRAIN = 1 << 16;
+
+// Read-only mapping of a whole file
+struct MappedFile {
+	const char *data = nullptr;
+	size_t size = 0;
+
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile() {
+		close();
+	}
+
+	bool open(const char *path) {
+		close();
+
+		int fd = ::open(path, O_RDONLY);
+		if (fd == -1)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+
+		void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+
+		if (mapped == MAP_FAILED)
+			return false;
+
+		// Parsed front to back
+		madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+
+		data = (const char *) mapped;
+		size = st.st_size;
+		return true;
+	}
+
+	void close() {
+		if (data)
+			munmap((void *) data, size);
+
+		data = nullptr;
+		size = 0;
+	}
+};
+
+// Where parsed geometry goes: sized once, then written at any index from
+// any thread
+struct MeshSink {
+	Mesh &mesh;
+
+	void resize(size_t vertices, size_t triangles) {
+		mesh.vertices.resize(vertices);
+		mesh.triangles.resize(triangles);
+	}
+
+	void vertex(size_t i, const glm::vec3 &p) {
+		mesh.vertices[i] = Vertex {p};
+	}
+
+	void triangle(size_t i, uint32_t a, uint32_t b, uint32_t c) {
+		mesh.triangles[i] = Triangle {a, b, c, Shades::ePillar};
+	}
+};
+
+struct BufferSink {
+	VBuffer &vertices;
+	IBuffer &triangles;
+
+	void resize(size_t vertex_count, size_t triangle_count) {
+		vertices.resize(vertex_count);
+		triangles.resize(triangle_count);
+	}
+
+	void vertex(size_t i, const glm::vec3 &p) {
+		vertices[i] = aligned_vec4(p);
+	}
+
+	void triangle(size_t i, uint32_t a, uint32_t b, uint32_t c) {
+		triangles[i] = glm::uvec4 {a, b, c, (uint32_t) Shades::ePillar};
+	}
+};
+
+// Run f(chunk, begin, end) over [0, count), on the pool if there is one
+template <class F>
+void import_for(ThreadPool *pool, int count, int grain, F &&f)
+{
+	if (pool)
+		parallel_for(*pool, 0, count, grain, f);
+	else
+		f(0, 0, count);
+}
+
+inline bool import_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char *skip_spaces(const char *p, const char *end)
+{
+	while (p < end && import_space(*p))
+		p++;
+
+	return p;
+}
+
+inline const char *skip_line(const char *p, const char *end)
+{
+	const char *eol = (const char *) memchr(p, '\n', end - p);
+	return eol ? eol + 1 : end;
+}
+
+// Decimal number with an optional fraction and exponent; returns where
+// it ends, or nullptr if there is none
+inline const char *parse_float(const char *p, const char *end, float &value)
+{
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+	};
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+
+	const char *start = p;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		if (digits < 18) {
+			mantissa = 10 * mantissa + (*p - '0');
+			digits += (mantissa > 0);
+		} else {
+			exponent++;
+		}
+	}
+
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			if (digits < 18) {
+				mantissa = 10 * mantissa + (*p - '0');
+				digits += (mantissa > 0);
+				exponent--;
+			}
+		}
+	}
+
+	if (p == start || (p == start + 1 && *start == '.'))
+		return nullptr;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool negative_exponent = false;
+		if (q < end && (*q == '-' || *q == '+'))
+			negative_exponent = (*q++ == '-');
+
+		if (q < end && *q >= '0' && *q <= '9') {
+			int e = 0;
+			for (; q < end && *q >= '0' && *q <= '9'; q++)
+				e = std::min(10 * e + (*q - '0'), 1000);
+
+			exponent += negative_exponent ? -e : e;
+			p = q;
+		}
+	}
+
+	double v = mantissa;
+	if (exponent < 0)
+		v = (-exponent <= 18) ? v / powers[-exponent] : v * std::pow(10.0, exponent);
+	else if (exponent > 0)
+		v = (exponent <= 18) ? v * powers[exponent] : v * std::pow(10.0, exponent);
+
+	value = negative ? -v : v;
+	return p;
+}
+
+inline const char *parse_int(const char *p, const char *end, long &value)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+
+	const char *start = p;
+
+	long v = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		v = 10 * v + (*p - '0');
+
+	if (p == start)
+		return nullptr;
+
+	value = negative ? -v : v;
+	return p;
+}
+
+// Kind of an OBJ line, past its leading spaces: 'v' for a vertex, 'f' for
+// a face, 0 for anything else; p is moved past the tag
+inline char obj_tag(const char *&p, const char *end)
+{
+	p = skip_spaces(p, end);
+	if (p + 1 < end && (*p == 'v' || *p == 'f') && import_space(p[1])) {
+		char tag = *p;
+		p += 2;
+		return tag;
+	}
+
+	return 0;
+}
+
+// The grain is in bytes
+template <class Sink>
+bool parse_obj(const MappedFile &file, Sink &sink, ThreadPool *pool, int grain = IMPORT_OBJ_GRAIN)
+{
+	const char *data = file.data;
+	const char *end = data + file.size;
+
+	// Chunk boundaries, moved up to the next line start
+	int chunks = pool ? parallel_chunks(*pool, std::min(file.size, (size_t) INT32_MAX), grain) : 1;
+
+	std::vector <const char *> bounds(chunks + 1);
+	for (int c = 0; c <= chunks; c++) {
+		size_t offset = file.size * c / chunks;
+		const char *p = data + offset;
+		if (c > 0 && c < chunks && p[-1] != '\n')
+			p = skip_line(p, end);
+
+		bounds[c] = (c == chunks) ? end : p;
+	}
+
+	// Vertices and triangles of each chunk
+	std::vector <size_t> vertex_offsets(chunks + 1, 0);
+	std::vector <size_t> triangle_offsets(chunks + 1, 0);
+
+	import_for(pool, chunks, 1, [&](int, int begin, int last) {
+		for (int c = begin; c < last; c++) {
+			size_t vertices = 0;
+			size_t triangles = 0;
+
+			for (const char *p = bounds[c]; p < bounds[c + 1]; p = skip_line(p, end)) {
+				char tag = obj_tag(p, end);
+				if (tag == 'v') {
+					vertices++;
+				} else if (tag == 'f') {
+					int corners = 0;
+					while (true) {
+						p = skip_spaces(p, end);
+						if (p >= end || *p == '\n' || *p == '#')
+							break;
+
+						corners++;
+						while (p < end && !import_space(*p) && *p != '\n')
+							p++;
+					}
+
+					triangles += std::max(corners - 2, 0);
+				}
+			}
+
+			vertex_offsets[c + 1] = vertices;
+			triangle_offsets[c + 1] = triangles;
+		}
+	});
+
+	for (int c = 0; c < chunks; c++) {
+		vertex_offsets[c + 1] += vertex_offsets[c];
+		triangle_offsets[c + 1] += triangle_offsets[c];
+	}
+
+	size_t vertex_count = vertex_offsets[chunks];
+	sink.resize(vertex_count, triangle_offsets[chunks]);
+
+	std::atomic <bool> ok {true};
+
+	import_for(pool, chunks, 1, [&](int, int begin, int last) {
+		std::vector <uint32_t> face;
+
+		for (int c = begin; c < last; c++) {
+			size_t vertex = vertex_offsets[c];
+			size_t triangle = triangle_offsets[c];
+
+			for (const char *p = bounds[c]; p < bounds[c + 1]; p = skip_line(p, end)) {
+				char tag = obj_tag(p, end);
+				if (tag == 'v') {
+					glm::vec3 position {0.0f};
+					for (int axis = 0; axis < 3 && p; axis++)
+						p = parse_float(skip_spaces(p, end), end, position[axis]);
+
+					if (!p) {
+						ok = false;
+						return;
+					}
+
+					sink.vertex(vertex++, position);
+					continue;
+				}
+
+				if (tag != 'f')
+					continue;
+
+				// Only the position index of v/vt/vn matters, negative
+				// indices count back from the vertices so far
+				face.clear();
+				while (true) {
+					p = skip_spaces(p, end);
+					if (p >= end || *p == '\n' || *p == '#')
+						break;
+
+					long index;
+					const char *next = parse_int(p, end, index);
+					if (!next) {
+						ok = false;
+						return;
+					}
+
+					if (index < 0)
+						index += vertex + 1;
+
+					if (index < 1 || (size_t) index > vertex_count) {
+						ok = false;
+						return;
+					}
+
+					face.push_back(index - 1);
+
+					p = next;
+					while (p < end && !import_space(*p) && *p != '\n')
+						p++;
+				}
+
+				for (size_t i = 2; i < face.size(); i++)
+					sink.triangle(triangle++, face[0], face[i - 1], face[i]);
+			}
+		}
+	});
+
+	return ok;
+}
+
+// PLY scalar types, by size
+enum PLYType : uint32_t {
+	ePLYNone,
+	ePLYInt8,
+	ePLYUint8,
+	ePLYInt16,
+	ePLYUint16,
+	ePLYInt32,
+	ePLYUint32,
+	ePLYFloat32,
+	ePLYFloat64
+};
+
+inline PLYType ply_type(const std::string &name)
+{
+	if (name == "char" || name == "int8")
+		return ePLYInt8;
+	if (name == "uchar" || name == "uint8")
+		return ePLYUint8;
+	if (name == "short" || name == "int16")
+		return ePLYInt16;
+	if (name == "ushort" || name == "uint16")
+		return ePLYUint16;
+	if (name == "int" || name == "int32")
+		return ePLYInt32;
+	if (name == "uint" || name == "uint32")
+		return ePLYUint32;
+	if (name == "float" || name == "float32")
+		return ePLYFloat32;
+	if (name == "double" || name == "float64")
+		return ePLYFloat64;
+
+	return ePLYNone;
+}
+
+inline int ply_size(PLYType type)
+{
+	static const int sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+	return sizes[type];
+}
+
+// Scalar at p, byte swapped for big endian files
+inline double ply_read(const uint8_t *p, PLYType type, bool swap)
+{
+	uint8_t bytes[8];
+	int size = ply_size(type);
+	for (int i = 0; i < size; i++)
+		bytes[i] = swap ? p[size - 1 - i] : p[i];
+
+	if (type == ePLYInt8) { int8_t v; memcpy(&v, bytes, 1); return v; }
+	if (type == ePLYUint8) { uint8_t v; memcpy(&v, bytes, 1); return v; }
+	if (type == ePLYInt16) { int16_t v; memcpy(&v, bytes, 2); return v; }
+	if (type == ePLYUint16) { uint16_t v; memcpy(&v, bytes, 2); return v; }
+	if (type == ePLYInt32) { int32_t v; memcpy(&v, bytes, 4); return v; }
+	if (type == ePLYUint32) { uint32_t v; memcpy(&v, bytes, 4); return v; }
+	if (type == ePLYFloat32) { float v; memcpy(&v, bytes, 4); return v; }
+	if (type == ePLYFloat64) { double v; memcpy(&v, bytes, 8); return v; }
+
+	return 0.0;
+}
+
+struct PLYProperty {
+	std::string name;
+	PLYType type = ePLYNone;
+	PLYType count_type = ePLYNone;	// For lists only
+};
+
+struct PLYElement {
+	std::string name;
+	size_t count = 0;
+	std::vector <PLYProperty> properties;
+
+	// Bytes per record, 0 if it holds a list
+	int stride() const {
+		int size = 0;
+		for (const PLYProperty &property : properties) {
+			if (property.count_type != ePLYNone)
+				return 0;
+
+			size += ply_size(property.type);
+		}
+
+		return size;
+	}
+
+	// Past one record at p, nullptr if it runs past end
+	const uint8_t *skip(const uint8_t *p, const uint8_t *end, bool swap) const {
+		for (const PLYProperty &property : properties) {
+			if (property.count_type != ePLYNone) {
+				if (p + ply_size(property.count_type) > end)
+					return nullptr;
+
+				size_t count = ply_read(p, property.count_type, swap);
+				p += ply_size(property.count_type) + count * ply_size(property.type);
+			} else {
+				p += ply_size(property.type);
+			}
+
+			if (p > end)
+				return nullptr;
+		}
+
+		return p;
+	}
+};
+
+template <class Sink>
+bool parse_ply(const MappedFile &file, Sink &sink, ThreadPool *pool)
+{
+	const char *data = file.data;
+	const char *end = data + file.size;
+
+	// Header, in text up to end_header
+	const char *header_end = nullptr;
+	for (const char *p = data; p < end; p = skip_line(p, end)) {
+		if (end - p >= 10 && !memcmp(p, "end_header", 10)) {
+			header_end = skip_line(p, end);
+			break;
+		}
+	}
+
+	if (!header_end || file.size < 4 || memcmp(data, "ply", 3))
+		return false;
+
+	std::istringstream header(std::string(data, header_end));
+	std::vector <PLYElement> elements;
+	bool swap = false;
+
+	std::string line;
+	while (std::getline(header, line)) {
+		std::istringstream in(line);
+		std::string keyword;
+		in >> keyword;
+
+		if (keyword == "format") {
+			std::string format;
+			in >> format;
+			if (format == "binary_big_endian")
+				swap = true;
+			else if (format != "binary_little_endian")
+				return false;
+		} else if (keyword == "element") {
+			PLYElement element;
+			in >> element.name >> element.count;
+			elements.push_back(element);
+		} else if (keyword == "property" && !elements.empty()) {
+			PLYProperty property;
+			std::string type;
+			in >> type;
+
+			if (type == "list") {
+				std::string count_type;
+				in >> count_type >> type;
+				property.count_type = ply_type(count_type);
+				if (property.count_type == ePLYNone)
+					return false;
+			}
+
+			property.type = ply_type(type);
+			in >> property.name;
+			if (property.type == ePLYNone)
+				return false;
+
+			elements.back().properties.push_back(property);
+		}
+	}
+
+	const uint8_t *p = (const uint8_t *) header_end;
+	const uint8_t *bytes_end = (const uint8_t *) end;
+
+	const uint8_t *vertex_data = nullptr;
+	const uint8_t *face_data = nullptr;
+	const PLYElement *vertex_element = nullptr;
+	const PLYElement *face_element = nullptr;
+
+	for (const PLYElement &element : elements) {
+		if (element.name == "vertex") {
+			vertex_element = &element;
+			vertex_data = p;
+		} else if (element.name == "face") {
+			face_element = &element;
+			face_data = p;
+			break;
+		}
+
+		// Skip past the element, record by record if it has lists
+		int stride = element.stride();
+		if (stride > 0) {
+			if ((size_t) (bytes_end - p) / stride < element.count)
+				return false;
+
+			p += element.count * stride;
+		} else {
+			for (size_t i = 0; i < element.count && p; i++)
+				p = element.skip(p, bytes_end, swap);
+
+			if (!p)
+				return false;
+		}
+	}
+
+	if (!vertex_element || !face_element)
+		return false;
+
+	// Positions
+	int vertex_stride = vertex_element->stride();
+	if (vertex_stride == 0)
+		return false;
+
+	int offsets[3] = { -1, -1, -1 };
+	PLYType types[3];
+
+	int offset = 0;
+	for (const PLYProperty &property : vertex_element->properties) {
+		for (int axis = 0; axis < 3; axis++) {
+			if (property.name == std::string(1, "xyz"[axis])) {
+				offsets[axis] = offset;
+				types[axis] = property.type;
+			}
+		}
+
+		offset += ply_size(property.type);
+	}
+
+	if (offsets[0] == -1 || offsets[1] == -1 || offsets[2] == -1)
+		return false;
+
+	// Index list of the faces, and what comes before it in a record
+	int list = -1;
+	int before = 0;
+	for (size_t i = 0; i < face_element->properties.size(); i++) {
+		const PLYProperty &property = face_element->properties[i];
+		if (property.count_type != ePLYNone && (property.name == "vertex_indices" || property.name == "vertex_index")) {
+			list = i;
+			break;
+		}
+
+		if (property.count_type != ePLYNone)
+			return false;
+
+		before += ply_size(property.type);
+	}
+
+	if (list == -1)
+		return false;
+
+	const PLYProperty &indices = face_element->properties[list];
+	int count_size = ply_size(indices.count_type);
+	int index_size = ply_size(indices.type);
+
+	size_t vertex_count = vertex_element->count;
+	size_t face_count = face_element->count;
+
+	// Faces are fixed size when every one is a triangle and nothing but
+	// scalars follows the list: checked on the size of the rest of the
+	// file, then on the count of every record
+	int after = 0;
+	bool scalars_after = true;
+	for (size_t i = list + 1; i < face_element->properties.size(); i++) {
+		scalars_after &= (face_element->properties[i].count_type == ePLYNone);
+		after += ply_size(face_element->properties[i].type);
+	}
+
+	size_t triangle_stride = before + count_size + 3 * index_size + after;
+
+	std::vector <size_t> face_offsets;
+	std::vector <size_t> triangle_offsets;
+
+	bool fixed = scalars_after && &elements.back() == face_element
+		&& (size_t) (bytes_end - face_data) == face_count * triangle_stride;
+
+	if (fixed) {
+		std::atomic <bool> triangles_only {true};
+
+		import_for(pool, face_count, IMPORT_PLY_GRAIN, [&](int, int begin, int last) {
+			for (int i = begin; i < last && triangles_only; i++) {
+				const uint8_t *record = face_data + (size_t) i * triangle_stride + before;
+				if (ply_read(record, indices.count_type, swap) != 3)
+					triangles_only = false;
+			}
+		});
+
+		// Other counts can add up to the same size, those files take
+		// the serial walk
+		fixed = triangles_only;
+	}
+
+	if (!fixed) {
+		// Serial walk over the records, to find where each starts
+		face_offsets.resize(face_count + 1);
+		triangle_offsets.resize(face_count + 1);
+
+		const uint8_t *q = face_data;
+		size_t triangles = 0;
+		for (size_t i = 0; i < face_count; i++) {
+			face_offsets[i] = q - face_data;
+			triangle_offsets[i] = triangles;
+
+			if (q + before + count_size > bytes_end)
+				return false;
+
+			size_t corners = ply_read(q + before, indices.count_type, swap);
+			triangles += corners >= 3 ? corners - 2 : 0;
+
+			q = face_element->skip(q, bytes_end, swap);
+			if (!q)
+				return false;
+		}
+
+		triangle_offsets[face_count] = triangles;
+	}
+
+	sink.resize(vertex_count, fixed ? face_count : triangle_offsets[face_count]);
+
+	import_for(pool, vertex_count, IMPORT_PLY_GRAIN, [&](int, int begin, int last) {
+		for (int i = begin; i < last; i++) {
+			const uint8_t *record = vertex_data + (size_t) i * vertex_stride;
+
+			glm::vec3 position;
+			for (int axis = 0; axis < 3; axis++)
+				position[axis] = ply_read(record + offsets[axis], types[axis], swap);
+
+			sink.vertex(i, position);
+		}
+	});
+
+	std::atomic <bool> ok {true};
+
+	import_for(pool, face_count, IMPORT_PLY_GRAIN, [&](int, int begin, int last) {
+		for (int i = begin; i < last; i++) {
+			const uint8_t *record = face_data + (fixed ? (size_t) i * triangle_stride : face_offsets[i]) + before;
+			size_t triangle = fixed ? i : triangle_offsets[i];
+
+			size_t corners = ply_read(record, indices.count_type, swap);
+			record += count_size;
+
+			auto index = [&](size_t k) {
+				return (uint32_t) ply_read(record + k * index_size, indices.type, swap);
+			};
+
+			for (size_t k = 0; k < corners; k++) {
+				if (index(k) >= vertex_count) {
+					ok = false;
+					return;
+				}
+			}
+
+			for (size_t k = 2; k < corners; k++)
+				sink.triangle(triangle++, index(0), index(k - 1), index(k));
+		}
+	});
+
+	return ok;
+}
+
+// Dispatch on the extension, .ply or anything else as OBJ
+template <class Sink>
+bool import_mesh(const char *path, Sink &sink, ThreadPool *pool)
+{
+	MappedFile file;
+	if (!file.open(path))
+		return false;
+
+	size_t length = strlen(path);
+	if (length >= 4 && !strcasecmp(path + length - 4, ".ply"))
+		return parse_ply(file, sink, pool);
+
+	return parse_obj(file, sink, pool);
+}
+
+inline bool load_mesh(const char *path, Mesh &mesh, ThreadPool *pool = nullptr)
+{
+	MeshSink sink {mesh};
+	return import_mesh(path, sink, pool);
+}
+
+inline bool load_mesh(const char *path, VBuffer &vertices, IBuffer &triangles, ThreadPool *pool = nullptr)
+{
+	BufferSink sink {vertices, triangles};
+	return import_mesh(path, sink, pool);
+}
+
+#endif
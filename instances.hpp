@@ -0,0 +1,187 @@
+#ifndef INSTANCES_H_
+#define INSTANCES_H_
+
+// Standard headers
+#include <algorithm>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+
+// App headers
+#include "bvh.hpp"
+#include "core.hpp"
+#include "mesh.hpp"
+#include "wide_bvh.hpp"
+
+// Two level acceleration structure: every distinct mesh gets its own
+// bottom level BVH (BLAS) in object space, built once, and a top level BVH
+// (TLAS) over the world bounds of the instances is rebuilt whenever they
+// move. Rays are transformed into object space per instance, so memory
+// scales with the number of distinct meshes instead of instances.
+//
+// The BVH buffer holds the TLAS first, then every BLAS; all of them are
+// threaded binary trees as BVH::serialize writes them. TLAS leaves refer
+// to instances, BLAS leaves to triangles of the shared index buffer. Each
+// instance is four vec4s in its own buffer:
+//
+//	inverse transform row 0, row 1, row 2 (xyz rotation-scale, w translation)
+//	blas root, -, -, -
+
+using InstanceBuffer = std::vector <aligned_vec4>;
+
+// Size of an instance record, in vec4s
+constexpr int INSTANCE_SIZE = 4;
+
+struct Instance {
+	glm::mat4 transform;
+	int blas;
+};
+
+struct InstancedScene {
+	std::vector <Mesh> meshes;		// Object space, one per BLAS
+	std::vector <BVH> blas;
+	std::vector <Instance> instances;
+	std::vector <int> roots;		// BLAS offsets in the BVH buffer
+
+	// Add a mesh and build its BLAS; returns its index
+	int add_mesh(const Mesh &mesh) {
+		meshes.push_back(mesh);
+		blas.push_back(mesh.make_bvh(BVHBuilder::eBinnedSAH));
+		return meshes.size() - 1;
+	}
+
+	void add_instance(const glm::mat4 &transform, int mesh) {
+		instances.push_back(Instance {transform, mesh});
+	}
+
+	// World bounds of an instance, from the corners of its BLAS root
+	BBox bbox(const Instance &instance) const {
+		const BBox &local = blas[instance.blas].nodes[0].bbox;
+
+		BBox box = BBox::empty();
+		for (int i = 0; i < 8; i++) {
+			glm::vec3 corner {
+				(i & 1) ? local.max.x : local.min.x,
+				(i & 2) ? local.max.y : local.min.y,
+				(i & 4) ? local.max.z : local.min.z
+			};
+
+			box.grow(glm::vec3(instance.transform * glm::vec4(corner, 1.0f)));
+		}
+
+		return box;
+	}
+
+	BVH make_tlas(BVHBuilder builder = BVHBuilder::eBinnedSAH) const {
+		std::vector <BVHPrimitive> prims(instances.size());
+		for (size_t i = 0; i < instances.size(); i++)
+			prims[i] = BVHPrimitive(bbox(instances[i]), i);
+
+		return build_bvh(prims, builder);
+	}
+
+	// Number of vec4s the TLAS takes at the start of the BVH buffer
+	int tlas_size() const {
+		return instances.empty() ? 0 : 3 * (2 * instances.size() - 1);
+	}
+
+	// Triangles of all meshes, in BLAS order
+	int triangle_count() const {
+		int count = 0;
+		for (const Mesh &mesh : meshes)
+			count += mesh.triangles.size();
+
+		return count;
+	}
+
+	// Shared vertex and index buffers of all meshes
+	void serialize_geometry(VBuffer &vbuffer, IBuffer &ibuffer) const {
+		Mesh all;
+		for (const Mesh &mesh : meshes)
+			all.add(mesh);
+
+		all.serialize_vertices(vbuffer);
+		all.serialize_indices(ibuffer);
+	}
+
+	// Triangle records of every mesh, in the same order
+	void serialize_records(RBuffer &rbuffer) const {
+		for (const Mesh &mesh : meshes)
+			mesh.serialize_records(rbuffer);
+	}
+
+	// TLAS followed by every BLAS, recording where each BLAS starts
+	void serialize(const BVH &tlas, BVHBuffer &buffer) {
+		tlas.serialize(buffer);
+
+		roots.clear();
+
+		int triangles = 0;
+		for (size_t i = 0; i < blas.size(); i++) {
+			roots.push_back(buffer.size());
+			blas[i].serialize(buffer, triangles);
+			triangles += meshes[i].triangles.size();
+		}
+	}
+
+	// Overwrite the TLAS at the start of a serialized buffer after
+	// instances moved; it has the same size, and the BLAS part stays
+	void update_tlas(const BVH &tlas, BVHBuffer &buffer) const {
+		BVHBuffer top;
+		tlas.serialize(top);
+		std::copy(top.begin(), top.end(), buffer.begin());
+	}
+
+	// Instance records, needs the BLAS roots from serialize
+	void serialize_instances(InstanceBuffer &ibuffer) const {
+		ibuffer.clear();
+		ibuffer.reserve(INSTANCE_SIZE * instances.size());
+
+		for (const Instance &instance : instances) {
+			glm::mat4 inverse = glm::inverse(instance.transform);
+
+			// Rows of the affine part, glm matrices are column major
+			for (int r = 0; r < 3; r++)
+				ibuffer.push_back(glm::vec4 {inverse[0][r], inverse[1][r], inverse[2][r], inverse[3][r]});
+
+			int root = roots[instance.blas];
+			ibuffer.push_back(glm::vec4 {bits_to_float(root), 0.0f, 0.0f, 0.0f});
+		}
+	}
+};
+
+// Scatter pillars and rocks over a square of the given extent, with the
+// same random shapes generate_tile bakes into a flat mesh
+inline InstancedScene generate_instanced_tile(int count, float extent)
+{
+	InstancedScene scene;
+
+	int pillar = scene.add_mesh(generate_pillar(glm::mat4 {1.0f}));
+	int rock = scene.add_mesh(generate_rock(glm::mat4 {1.0f}));
+
+	for (int i = 0; i < count; i++) {
+		// One in four is a rock
+		bool is_rock = (rand() % 4 == 0);
+
+		float width = randf() * 0.6f + 0.5f;
+		float depth = randf() * 0.6f + 0.5f;
+		float height = is_rock ? randf() * 0.5f + 0.3f : randf() * 2.0f + 0.5f;
+
+		float x = randf(-extent, extent);
+		float z = randf(-extent, extent);
+		float y = height / 2.0f + (is_rock ? 0.0f : randf());
+
+		glm::mat4 mat = Transform {
+			glm::vec3(x, y, z),
+			glm::vec3(randf() * 15.0f, randf() * 360.0f, randf() * 15.0f),
+			glm::vec3(width, height, depth)
+		}.matrix();
+
+		scene.add_instance(mat, is_rock ? rock : pillar);
+	}
+
+	return scene;
+}
+
+#endif
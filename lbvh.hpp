@@ -0,0 +1,270 @@
+#ifndef LBVH_H_
+#define LBVH_H_
+
+// Standard headers
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "thread_pool.hpp"
+
+// Linear BVH builder: primitives are sorted along a Morton curve over their
+// centroids and the hierarchy falls out of the highest differing bit of
+// neighbouring codes; much cheaper than SAH binning, meant for rebuilding
+// dynamic geometry every frame
+
+// Up to this many primitives use 30-bit codes, 63-bit codes above
+constexpr int LBVH_SHORT_CODES = 1 << 20;
+
+// Elements per chunk for the parallel passes
+constexpr int LBVH_GRAIN = 1 << 14;
+
+// Spread the lower 10 bits of x two bits apart
+inline uint32_t expand_bits(uint32_t x)
+{
+	x &= 0x3ffu;
+	x = (x | x << 16) & 0x030000ffu;
+	x = (x | x << 8) & 0x0300f00fu;
+	x = (x | x << 4) & 0x030c30c3u;
+	x = (x | x << 2) & 0x09249249u;
+	return x;
+}
+
+// Spread the lower 21 bits of x two bits apart
+inline uint64_t expand_bits(uint64_t x)
+{
+	x &= 0x1fffffull;
+	x = (x | x << 32) & 0x001f00000000ffffull;
+	x = (x | x << 16) & 0x001f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+inline int leading_zeros(uint32_t x)
+{
+	return x ? __builtin_clz(x) : 32;
+}
+
+inline int leading_zeros(uint64_t x)
+{
+	return x ? __builtin_clzll(x) : 64;
+}
+
+// Morton code of a point normalized to [0, 1]
+template <class Code>
+Code morton_code(const glm::vec3 &p)
+{
+	constexpr int bits = (8 * sizeof(Code) - 1) / 3;
+	constexpr float scale = (float) (1u << bits);
+
+	Code code[3];
+	for (int i = 0; i < 3; i++)
+		code[i] = (Code) std::min(std::max(p[i] * scale, 0.0f), scale - 1.0f);
+
+	return (expand_bits(code[0]) << 2)
+		| (expand_bits(code[1]) << 1)
+		| expand_bits(code[2]);
+}
+
+// Run f over [0, count) in chunks, on the pool if there is one
+template <class F>
+int chunked_for(ThreadPool *pool, int count, F &&f)
+{
+	if (pool)
+		return parallel_for(*pool, 0, count, LBVH_GRAIN, f);
+
+	f(0, 0, count);
+	return 1;
+}
+
+// Stable LSD radix sort of keys and their values, 8 bits per pass; chunks
+// scatter in order, so the result is the same as a serial sort
+template <class Key>
+void radix_sort(std::vector <Key> &keys, std::vector <int> &values, ThreadPool *pool = nullptr)
+{
+	int count = keys.size();
+	int chunks = pool ? parallel_chunks(*pool, count, LBVH_GRAIN) : 1;
+
+	std::vector <Key> keys_tmp(count);
+	std::vector <int> values_tmp(count);
+
+	std::vector <std::array <int, 256>> offsets(chunks);
+	for (int shift = 0; shift < 8 * (int) sizeof(Key); shift += 8) {
+		// Per chunk histograms
+		chunked_for(pool, count, [&](int c, int begin, int end) {
+			std::array <int, 256> &histogram = offsets[c];
+			histogram.fill(0);
+
+			for (int i = begin; i < end; i++)
+				histogram[(keys[i] >> shift) & 0xff]++;
+		});
+
+		// Skip the pass if every key has the same digit
+		bool uniform = false;
+		for (int d = 0; d < 256 && !uniform; d++) {
+			int total = 0;
+			for (int c = 0; c < chunks; c++)
+				total += offsets[c][d];
+
+			uniform = (total == count);
+		}
+
+		if (uniform)
+			continue;
+
+		// Exclusive prefix sum, ordered by digit then chunk
+		int sum = 0;
+		for (int d = 0; d < 256; d++) {
+			for (int c = 0; c < chunks; c++) {
+				int k = offsets[c][d];
+				offsets[c][d] = sum;
+				sum += k;
+			}
+		}
+
+		chunked_for(pool, count, [&](int c, int begin, int end) {
+			std::array <int, 256> &offset = offsets[c];
+			for (int i = begin; i < end; i++) {
+				int j = offset[(keys[i] >> shift) & 0xff]++;
+				keys_tmp[j] = keys[i];
+				values_tmp[j] = values[i];
+			}
+		});
+
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
+
+// Split [first, last] of the sorted codes at the highest differing bit;
+// the left child gets [first, split]
+template <class Code>
+int find_split(const Code *codes, int first, int last)
+{
+	Code a = codes[first];
+	Code b = codes[last];
+
+	// Identical codes split in the middle
+	if (a == b)
+		return (first + last) / 2;
+
+	int prefix = leading_zeros((Code) (a ^ b));
+
+	// Binary search for the last code sharing more than the prefix
+	int split = first;
+	int step = last - first;
+
+	do {
+		step = (step + 1) >> 1;
+
+		int next = split + step;
+		if (next < last && leading_zeros((Code) (a ^ codes[next])) > prefix)
+			split = next;
+	} while (step > 1);
+
+	return split;
+}
+
+// Emit the subtree over the sorted range into nodes[0, 2 * count - 1),
+// child indices relative to the parent
+template <class Code>
+void emit_lbvh(const Code *codes, const int *order, const BVHPrimitive *prims,
+		int first, int count, BVHNode *nodes, ThreadPool *pool)
+{
+	BVHNode &node = nodes[0];
+	node.size = 2 * count - 1;
+
+	if (count == 1) {
+		const BVHPrimitive &prim = prims[order[first]];
+		node.bbox = prim.bbox;
+		node.primitive = prim.id;
+		node.left = -1;
+		node.right = -1;
+		return;
+	}
+
+	int mid = find_split(codes, first, first + count - 1) - first + 1;
+
+	if (pool && count >= BVH_PARALLEL_TASK_SIZE) {
+		TaskGroup group(*pool);
+		group.spawn([&]() {
+			emit_lbvh(codes, order, prims, first, mid, nodes + 1, pool);
+		});
+
+		emit_lbvh(codes, order, prims, first + mid, count - mid, nodes + 2 * mid, pool);
+		group.wait();
+	} else {
+		emit_lbvh(codes, order, prims, first, mid, nodes + 1, pool);
+		emit_lbvh(codes, order, prims, first + mid, count - mid, nodes + 2 * mid, pool);
+	}
+
+	// Bounds come from the children
+	node.bbox = nodes[1].bbox;
+	node.bbox.grow(nodes[2 * mid].bbox);
+	node.primitive = -1;
+	node.left = 1;
+	node.right = 2 * mid;
+}
+
+template <class Code>
+BVH partition_lbvh(const std::vector <BVHPrimitive> &prims, ThreadPool *pool)
+{
+	BVH bvh;
+
+	int count = prims.size();
+	if (count == 0)
+		return bvh;
+
+	// Centroid bounds
+	int chunks = pool ? parallel_chunks(*pool, count, LBVH_GRAIN) : 1;
+
+	std::vector <BBox> cboxes(chunks, BBox::empty());
+	chunked_for(pool, count, [&](int c, int begin, int end) {
+		for (int i = begin; i < end; i++)
+			cboxes[c].grow(prims[i].centroid);
+	});
+
+	BBox cbox = BBox::empty();
+	for (const BBox &box : cboxes)
+		cbox.grow(box);
+
+	// Same scale on every axis, so flat scenes keep square cells
+	glm::vec3 size = cbox.max - cbox.min;
+
+	float extent = std::max(std::max(size.x, size.y), size.z);
+	extent = extent > 0.0f ? extent : 1.0f;
+
+	// Morton codes, sorted along with the primitive indices
+	std::vector <Code> codes(count);
+	std::vector <int> order(count);
+
+	chunked_for(pool, count, [&](int /*chunk*/, int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			codes[i] = morton_code <Code> ((prims[i].centroid - cbox.min) / extent);
+			order[i] = i;
+		}
+	});
+
+	radix_sort(codes, order, pool);
+
+	// Hierarchy
+	bvh.nodes.resize(2 * count - 1);
+	emit_lbvh(codes.data(), order.data(), prims.data(), 0, count, bvh.nodes.data(), pool);
+	bvh.resolve_children();
+
+	return bvh;
+}
+
+inline BVH partition_lbvh(const std::vector <BVHPrimitive> &prims, ThreadPool *pool = nullptr)
+{
+	if (prims.size() <= LBVH_SHORT_CODES)
+		return partition_lbvh <uint32_t> (prims, pool);
+
+	return partition_lbvh <uint64_t> (prims, pool);
+}
+
+#endif
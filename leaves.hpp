@@ -0,0 +1,155 @@
+#ifndef LEAVES_H_
+#define LEAVES_H_
+
+// Standard headers
+#include <algorithm>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "core.hpp"
+#include "mesh.hpp"
+#include "wide_bvh.hpp"
+
+// Clustered leaves: a leaf holds up to max_leaf triangles instead of one,
+// with their vertices copied in leaf order into a buffer of their own, so
+// reaching them skips the index buffer and the vertex gathers, and the
+// tree has fewer nodes. The binary tree keeps its threaded layout; only
+// leaf headers change, to the first triangle and the count:
+//
+//	header:		first, hit, miss, count (bit-cast ints)
+//	triangle:	v1.xyz, index
+//			v2.xyz, -
+//			v3.xyz, -
+//
+// Subtrees are collapsed into leaves by SAH cost, bottom-up, after any
+// builder; the built BVH itself is left alone.
+
+// Triangles per leaf at most
+constexpr int BVH_LEAF_SIZE = 4;
+
+// vec4s per inlined triangle
+constexpr int LEAF_TRIANGLE_SIZE = 3;
+
+using LeafBuffer = std::vector <aligned_vec4>;
+
+// Mark the roots of subtrees to collapse: a subtree of at most max_leaf
+// primitives becomes a leaf when testing all of them is no more expensive
+// than its best split. Returns the SAH cost of the collapsed tree,
+// relative to the root area as BVH::sah_cost
+inline float collapse_leaves(const BVH &bvh, int max_leaf, std::vector <bool> &leaf)
+{
+	int count = bvh.size();
+
+	leaf.assign(count, false);
+	if (count == 0)
+		return 0.0f;
+
+	std::vector <float> cost(count);
+	std::vector <int> primitives(count);
+
+	// Children come after their parents in pre-order
+	for (int n = count - 1; n >= 0; n--) {
+		const BVHNode &node = bvh.nodes[n];
+		float area = node.bbox.surface_area();
+
+		if (node.left == -1) {
+			cost[n] = BVH_INTERSECTION_COST * area;
+			primitives[n] = 1;
+			leaf[n] = true;
+			continue;
+		}
+
+		primitives[n] = primitives[node.left] + primitives[node.right];
+
+		float split = BVH_TRAVERSAL_COST * area + cost[node.left] + cost[node.right];
+		float collapsed = BVH_INTERSECTION_COST * primitives[n] * area;
+
+		leaf[n] = primitives[n] <= max_leaf && collapsed <= split;
+		cost[n] = leaf[n] ? collapsed : split;
+	}
+
+	return cost[0] / bvh.nodes[0].bbox.surface_area();
+}
+
+// Serialize with clustered leaves; returns the SAH cost of the result
+inline float serialize_leaves(const BVH &bvh, const Mesh &mesh, int max_leaf,
+		BVHBuffer &buffer, LeafBuffer &leaves)
+{
+	buffer.clear();
+	leaves.clear();
+
+	int count = bvh.size();
+	if (count == 0)
+		return 0.0f;
+
+	std::vector <bool> leaf;
+	float cost = collapse_leaves(bvh, max_leaf, leaf);
+
+	// Pre-order of the collapsed tree: the inside of a collapsed subtree
+	// is skipped in one step, being contiguous
+	std::vector <int> slot(count, -1);
+
+	int emitted = 0;
+	for (int n = 0; n < count; n += leaf[n] ? bvh.nodes[n].size : 1)
+		slot[n] = emitted++;
+
+	buffer.resize(3 * emitted);
+
+	std::vector <int> primitives;
+	for (int n = 0; n < count; n++) {
+		if (slot[n] == -1)
+			continue;
+
+		const BVHNode &node = bvh.nodes[n];
+
+		// The node after a subtree is never inside a collapsed one, its
+		// ancestors are all ancestors of this emitted node
+		int next = n + node.size;
+		int miss = next < count ? 3 * slot[next] : -1;
+
+		int offset = 3 * slot[n];
+		buffer[offset + 1] = node.bbox.min;
+		buffer[offset + 2] = node.bbox.max;
+
+		if (!leaf[n]) {
+			int hit = 3 * slot[n + 1];
+			buffer[offset] = glm::vec4 {
+				bits_to_float(-1),
+				bits_to_float(hit),
+				bits_to_float(miss),
+				bits_to_float(0)
+			};
+
+			continue;
+		}
+
+		// Triangles of the subtree, once each; spatial splits can
+		// reference one from several leaves
+		primitives.clear();
+		for (int i = n; i < next; i++) {
+			int p = bvh.nodes[i].primitive;
+			if (bvh.nodes[i].left == -1 && std::find(primitives.begin(), primitives.end(), p) == primitives.end())
+				primitives.push_back(p);
+		}
+
+		int first = leaves.size() / LEAF_TRIANGLE_SIZE;
+		for (int p : primitives) {
+			const Triangle &tri = mesh.triangles[p];
+			leaves.push_back(glm::vec4(mesh.vertices[tri.v1].position, bits_to_float(p)));
+			leaves.push_back(glm::vec4(mesh.vertices[tri.v2].position, 0.0f));
+			leaves.push_back(glm::vec4(mesh.vertices[tri.v3].position, 0.0f));
+		}
+
+		buffer[offset] = glm::vec4 {
+			bits_to_float(first),
+			bits_to_float(miss),
+			bits_to_float(miss),
+			bits_to_float(primitives.size())
+		};
+	}
+
+	return cost;
+}
+
+#endif
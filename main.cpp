@@ -2,6 +2,7 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include "common.hpp"
+#include "simulation.hpp"
 
 // Global variables
 Camera camera;
@@ -43,8 +44,149 @@ unsigned int make_texture_quad()
 	return vao;
 }
 
-int main()
+// BVH build statistics, for comparing builders on the same mesh
+struct BVHStats {
+	float build_time = 0.0f;
+	float optimize_time = 0.0f;
+	float sah_cost = 0.0f;
+};
+
+// Build and serialize the BVH; width 2 is the threaded binary tree, 4 and
+// 8 collapse it into a wide BVH, optionally with quantized child bounds.
+// Optimizing restructures treelets after the build, for static scenes. A
+// binary tree with a leaf size above 1 gets clustered leaves, with their
+// triangles inlined into the leaf buffer; otherwise it can be stored in
+// cache line blocks
+BVHStats make_bvh_buffer(const Mesh &mesh, BVHBuilder builder, int width, bool quantized,
+		bool optimize, bool blocked, int leaf_size, BVHBuffer &buffer, LeafBuffer &leaves)
 {
+	BVHStats stats;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	BVH bvh = mesh.make_bvh(builder);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	stats.build_time = std::chrono::duration <float, std::milli> (end - start).count();
+
+	if (optimize) {
+		start = std::chrono::high_resolution_clock::now();
+		optimize_treelets(bvh, BVH_TREELET_PASSES, &ThreadPool::global());
+		end = std::chrono::high_resolution_clock::now();
+
+		stats.optimize_time = std::chrono::duration <float, std::milli> (end - start).count();
+	}
+
+	stats.sah_cost = bvh.sah_cost();
+
+	buffer.clear();
+	leaves.clear();
+	if (width == 2 && leaf_size > 1)
+		stats.sah_cost = serialize_leaves(bvh, mesh, leaf_size, buffer, leaves);
+	else if (width == 2 && blocked)
+		serialize_blocked(bvh, buffer);
+	else if (width == 2)
+		bvh.serialize(buffer);
+	else
+		serialize_wide(bvh, width, buffer, quantized);
+
+	return stats;
+}
+
+// Rays per side of the grid for measuring traversal
+const int TRAVERSAL_SAMPLES = 64;
+
+// Traversal work on primary rays and on shadow rays from their hits, with
+// the threaded binary traversal as the baseline
+struct TraversalReport {
+	TraversalStats primary;
+	TraversalStats shadow;
+	TraversalStats primary_threaded;
+	TraversalStats shadow_threaded;
+	int primary_rays = 0;
+	int shadow_rays = 0;
+};
+
+// Trace a coarse grid of camera rays through the CPU reference of the
+// current BVH layout
+TraversalReport measure_traversal(const BVHBuffer &bvh, const VBuffer &vertices, const IBuffer &triangles,
+		const LeafBuffer &leaves, const RBuffer &records, const glm::vec3 &light_dir)
+{
+	const int n = TRAVERSAL_SAMPLES;
+
+	BVHLayout layout = state.bvh_layout();
+
+	// Baseline only applies to the binary layout, with the same leaves
+	// and triangles
+	BVHLayout threaded;
+	threaded.leaf_size = layout.leaf_size;
+	threaded.records = layout.records;
+	bool binary = (layout.width == 2);
+
+	TraversalReport report;
+	for (int y = 0; y < n; y++) {
+		for (int x = 0; x < n; x++) {
+			glm::vec2 uv {(x + 0.5f) / n, (y + 0.5f) / n};
+
+			Ray ray = camera.generate_ray(uv);
+			Hit hit = trace(bvh, layout, vertices, triangles, leaves, records, ray, report.primary);
+			if (binary)
+				trace(bvh, threaded, vertices, triangles, leaves, records, ray, report.primary_threaded);
+
+			report.primary_rays++;
+			if (hit.primitive == -1)
+				continue;
+
+			glm::vec3 p = ray.p + ray.d * hit.t;
+			Ray shadow {p + light_dir * state.ray_shadow_step, light_dir};
+
+			trace(bvh, layout, vertices, triangles, leaves, records, shadow, report.shadow);
+			if (binary)
+				trace(bvh, threaded, vertices, triangles, leaves, records, shadow, report.shadow_threaded);
+
+			report.shadow_rays++;
+		}
+	}
+
+	return report;
+}
+
+// Bob the pillars of a tile up and down; each pillar is 8 vertices
+void animate_pillars(Mesh &tile, const std::vector <Vertex> &rest, float t)
+{
+	for (size_t i = 0; i < rest.size(); i++) {
+		float phase = (i / 8) * 1.7f;
+		glm::vec3 offset {0.0f, 0.25f * std::sin(t + phase), 0.0f};
+		tile.vertices[i].position = rest[i].position + offset;
+	}
+}
+
+// Bob instances up and down, as animate_pillars does for the flat tile
+void animate_instances(InstancedScene &scene, const std::vector <glm::mat4> &rest, float t)
+{
+	for (size_t i = 0; i < rest.size(); i++) {
+		float phase = i * 1.7f;
+		scene.instances[i].transform = rest[i];
+		scene.instances[i].transform[3].y += 0.25f * std::sin(t + phase);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	// A seed given here makes the same tile every run, mapped from the
+	// scene cache after the first; without one every run draws a new tile
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+			state.tile_seed = strtoul(argv[++i], nullptr, 10);
+			state.tile_seeded = true;
+		} else {
+			fprintf(stderr, "usage: %s [--seed s]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (!state.tile_seeded)
+		state.tile_seed = std::random_device {}();
+
 	GLFWwindow *window = initialize_graphics();
 	if (!window)
 		return -1;
@@ -71,12 +213,19 @@ int main()
 	glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
 	// Create heightmap
+	auto fields_start = std::chrono::high_resolution_clock::now();
+
 	size_t seed;
 	HeightMap heightmap(128, 1.5f, 8);
 
 	// Create grass map
 	GrassMap grassmap(1024, 256.0f, 8);
 
+	auto fields_end = std::chrono::high_resolution_clock::now();
+	std::cout << "Height and grass maps generated in "
+		<< std::chrono::duration <float, std::milli> (fields_end - fields_start).count()
+		<< " ms on " << ThreadPool::global().size() << " threads" << std::endl;
+
 	// Cloud density
 	srand(clock());
 
@@ -88,14 +237,16 @@ int main()
 
 	glm::vec2 cloud_offset {0.0f, 0.0f};
 
+	// Densities a whole grid at a time
+	const PerlinBatch cloud_batch {perlin_cloud};
+	std::vector <float> cloud_density_data(cloud_resolution * cloud_resolution);
+
 	float f = (1.0f/cloud_resolution);
-	for (int i = 0; i < cloud_resolution * cloud_resolution; i++) {
-		int x = i % cloud_resolution;
-		int y = i / cloud_resolution;
+	cloud_batch.octave2D_01(cloud_offset.x, cloud_offset.y, f, f,
+		cloud_resolution, cloud_resolution, 4, cloud_density_data.data());
 
-		float density = perlin_cloud.octave2D_01(x * f + cloud_offset.x, y * f + cloud_offset.y, 4);
-		cloud_density_image[i] = (unsigned char) (density * 250.0f + 1);
-	}
+	for (int i = 0; i < cloud_resolution * cloud_resolution; i++)
+		cloud_density_image[i] = (unsigned char) (cloud_density_data[i] * 250.0f + 1);
 
 	// Create and bind texture (binding 3)
 	unsigned int cloud_density;
@@ -115,6 +266,45 @@ int main()
 	// Bind texture as sampler
 	glBindImageTexture(3, cloud_density, 0, GL_FALSE, 0, GL_READ_ONLY, GL_R8);
 
+	// Tileable cloud atlas, computed once with the lattice wrapping every
+	// cloud_period units and scrolled on the GPU instead
+	const int cloud_period = 32;
+	const int cloud_atlas_resolution = 512;
+	const float cloud_frequency = 8.0f;
+
+	auto atlas_start = std::chrono::high_resolution_clock::now();
+
+	PerlinBatch cloud_atlas_batch {perlin_cloud};
+	cloud_atlas_batch.period = cloud_period;
+
+	std::vector <float> cloud_atlas_data(cloud_atlas_resolution * cloud_atlas_resolution);
+	std::vector <unsigned char> cloud_atlas_image(cloud_atlas_data.size());
+
+	const double fa = (double) cloud_period/cloud_atlas_resolution;
+	cloud_atlas_batch.octave2D_01(0.0, 0.0, fa, fa,
+		cloud_atlas_resolution, cloud_atlas_resolution, 16,
+		cloud_atlas_data.data(), 0.5, &ThreadPool::global());
+
+	for (size_t i = 0; i < cloud_atlas_data.size(); i++)
+		cloud_atlas_image[i] = (unsigned char) (cloud_atlas_data[i] * 250.0f + 1);
+
+	unsigned int cloud_atlas;
+
+	glGenTextures(1, &cloud_atlas);
+	glBindTexture(GL_TEXTURE_2D, cloud_atlas);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, cloud_atlas_resolution, cloud_atlas_resolution, 0, GL_RED, GL_UNSIGNED_BYTE, cloud_atlas_image.data());
+
+	auto atlas_end = std::chrono::high_resolution_clock::now();
+	std::cout << "Cloud atlas generated in "
+		<< std::chrono::duration <float, std::milli> (atlas_end - atlas_start).count()
+		<< " ms" << std::endl;
+
 	// Create shaders
 	shaders = new Shaders();
 
@@ -128,6 +318,8 @@ int main()
 	set_float(shaders->pixelizer, "terrain_size", state.terrain_size);
 	set_vec2(shaders->pixelizer, "wind_offset", {0, 0});
 	set_vec2(shaders->pixelizer, "water_offset", {0, 0});
+	set_float(shaders->pixelizer, "cloud_atlas_scale", cloud_frequency/cloud_period);
+	set_vec2(shaders->pixelizer, "cloud_scroll", {0, 0});
 	state.apply();
 
 	camera = Camera {origin, lookat, up};
@@ -136,51 +328,420 @@ int main()
 	// Create texture quad
 	unsigned int vao = make_texture_quad();
 
-	// Vertices of tile
-	Mesh tile = generate_tile(10);
+	// Tile, its buffers and BVH; mapped from the cache and uploaded as they
+	// are when the same seed and parameters were used before
+	SceneCacheKey cache_key = state.scene_cache_key();
+	SceneCache cache;
 
-	BVH *bvh = tile.make_bvh();
-	BVHBuffer bvh_buffer;
-	bvh->serialize(bvh_buffer);
-	delete bvh;
+	Mesh tile;
+	BVHStats bvh_stats;
 
 	VBuffer vertices;
 	IBuffer indices;
+	BVHBuffer bvh_buffer;
+	LeafBuffer leaf_buffer;
+
+	unsigned int ssbo_vertices;
+	unsigned int ssbo_indices;
+	unsigned int ssbo_bvh;
+	unsigned int ssbo_leaves;
+
+	auto startup = std::chrono::high_resolution_clock::now();
+
+	bool cached = state.tile_seeded && cache.open(cache_key);
+	if (cached) {
+		size_t count;
+
+		const aligned_vec4 *cached_vertices = cache.section <aligned_vec4> (eCacheVertices, count);
+		ssbo_vertices = make_ssbo(cached_vertices, count, 1);
+
+		const aligned_uvec4 *cached_indices = cache.section <aligned_uvec4> (eCacheIndices, count);
+		ssbo_indices = make_ssbo(cached_indices, count, 2);
+
+		const aligned_vec4 *cached_bvh = cache.section <aligned_vec4> (eCacheBVH, count);
+		ssbo_bvh = make_ssbo(cached_bvh, count, 3);
+
+		const aligned_vec4 *cached_leaves = cache.section <aligned_vec4> (eCacheLeaves, count);
+		ssbo_leaves = make_ssbo(cached_leaves, count, 5);
 
-	tile.serialize_vertices(vertices);
-	tile.serialize_indices(indices);
+		// Statistics of the build that made the buffers
+		const SceneCacheStats &stats = cache.header().stats;
+		bvh_stats.build_time = stats.build_time;
+		bvh_stats.optimize_time = stats.optimize_time;
+		bvh_stats.sah_cost = stats.sah_cost;
+
+		// The CPU side keeps its own copies, for animation and rebuilds
+		cache.copy(eCacheVertices, vertices);
+		cache.copy(eCacheIndices, indices);
+		cache.copy(eCacheBVH, bvh_buffer);
+		cache.copy(eCacheLeaves, leaf_buffer);
+		cache.close();
+
+		tile.deserialize(vertices, indices);
+	} else {
+		tile = generate_tile(cache_key.resolution, cache_key.seed);
+
+		bvh_stats = make_bvh_buffer(tile, (BVHBuilder) state.bvh_builder,
+			state.bvh_width, state.quantize_bvh, state.optimize_bvh, state.block_bvh,
+			state.bvh_layout().leaf_size, bvh_buffer, leaf_buffer);
+
+		tile.serialize_vertices(vertices);
+		tile.serialize_indices(indices);
+
+		SceneCacheStats stats;
+		stats.build_time = bvh_stats.build_time;
+		stats.optimize_time = bvh_stats.optimize_time;
+		stats.sah_cost = bvh_stats.sah_cost;
+
+		if (state.tile_seeded && !write_scene_cache(cache_key, stats, vertices, indices, bvh_buffer, leaf_buffer))
+			std::cerr << "Could not write " << scene_cache_path(cache_key) << std::endl;
+
+		// Store buffers for vertices, indices and BVH
+		ssbo_vertices = make_ssbo(vertices, 1);
+		ssbo_indices = make_ssbo(indices, 2);
+		ssbo_bvh = make_ssbo(bvh_buffer, 3);
+		ssbo_leaves = make_ssbo(leaf_buffer, 5);
+	}
+
+	auto loaded = std::chrono::high_resolution_clock::now();
+	float startup_time = std::chrono::duration <float, std::milli> (loaded - startup).count();
+
+	std::vector <Vertex> rest = tile.vertices;
+
+	RBuffer records;
+	tile.serialize_records(records);
 
 	/* std::cout << "Triangles: " << indices.size() << std::endl;
 	for (const auto &i : indices)
 		std::cout << "\t" << i << std::endl; */
 
-	// Store buffers for vertices, indices and BVH
-	unsigned int ssbo_vertices = make_ssbo(vertices, 1);
-	unsigned int ssbo_indices = make_ssbo(indices, 2);
-	unsigned int ssbo_bvh = make_ssbo(bvh_buffer, 3);
+	unsigned int ssbo_records = make_ssbo(records, 6);
+
+	// Packed copies of the tile geometry, see mesh.hpp
+	PackedFormat packed_format;
+	PBuffer packed_vertices;
+	PBuffer packed_indices;
+
+	// The tile as the packed buffers decode it, when quantized; the BVH
+	// is built over it then, so it bounds the triangles the shader sees.
+	// The tile itself keeps its exact positions
+	Mesh packed_tile;
+	bool packed_bvh = false;
+
+	auto bvh_mesh = [&]() -> const Mesh & {
+		return packed_bvh ? packed_tile : tile;
+	};
+	unsigned int ssbo_packed_vertices = make_ssbo(packed_vertices, 7);
+	unsigned int ssbo_packed_indices = make_ssbo(packed_indices, 8);
 
 	set_int(shaders->pixelizer, "primitives", tile.triangles.size());
 	// set_int(shaders->pixelizer, "primitives", 0);
 
+	// Refitting state for animated geometry
+	BVHRefit refit;
+	if (!state.clustered_leaves())
+		refit.reset(bvh_buffer);
+
+	std::vector <BBox> bounds;
+	VBuffer next_vertices;
+	DirtyRanges dirty_vertices;
+	float refit_time = 0.0f;
+	int rebuilds = 0;
+
+	// Dynamic BVH over the tile triangles, for pillars spawned and
+	// despawned at runtime; leaf handles are kept by triangle
+	DynamicBVH dynamic;
+	std::vector <int> dynamic_leaves;
+	DirtyRanges dirty_dynamic;
+	float dynamic_time = 0.0f;
+
+	// Vertex and triangle counts of the tile before each spawned pillar
+	std::vector <std::pair <size_t, size_t>> spawned;
+
+	// Terrain as triangles after every pillar of the tile, instead of
+	// marching the height map; errors are computed once per height map
+	TerrainGrid terrain_grid = heightmap.terrain_grid();
+	TerrainMesher terrain_mesher(terrain_grid);
+	std::pair <size_t, size_t> terrain_start;
+	size_t terrain_triangles = 0;
+	float terrain_time = 0.0f;
+
+	// Traversal work of the current layout, measured on demand
+	TraversalReport traversal;
+
+	// Instanced pillars and rocks, with a two level BVH
+	InstancedScene scene;
+	std::vector <glm::mat4> scene_rest;
+	InstanceBuffer instance_buffer;
+	unsigned int ssbo_instances = make_ssbo(instance_buffer, 4);
+	float tlas_time = 0.0f;
+
+	set_int(shaders->pixelizer, "instance_count", 0);
+
+	// Write what changed in the dynamic BVH since the last upload, and
+	// upload just that unless the buffer grew
+	auto upload_dynamic = [&]() {
+		auto start = std::chrono::high_resolution_clock::now();
+		bool grew = dynamic.serialize(bvh_buffer, dirty_dynamic);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		dynamic_time = std::chrono::duration <float, std::milli> (end - start).count();
+		bvh_stats.sah_cost = dynamic.sah_cost();
+
+		if (grew)
+			update_ssbo(ssbo_bvh, bvh_buffer);
+		else
+			update_ssbo(ssbo_bvh, bvh_buffer, dirty_dynamic);
+	};
+
+	// Insert every triangle of the tile into a new dynamic BVH
+	auto reset_dynamic = [&]() {
+		auto start = std::chrono::high_resolution_clock::now();
+		dynamic = DynamicBVH();
+		dynamic_leaves.clear();
+		const Mesh &mesh = bvh_mesh();
+		for (size_t i = 0; i < mesh.triangles.size(); i++)
+			dynamic_leaves.push_back(dynamic.insert(mesh.bbox(mesh.triangles[i]), i));
+		auto end = std::chrono::high_resolution_clock::now();
+
+		bvh_stats = BVHStats();
+		bvh_stats.build_time = std::chrono::duration <float, std::milli> (end - start).count();
+
+		bvh_buffer.clear();
+		leaf_buffer.clear();
+		upload_dynamic();
+		update_ssbo(ssbo_leaves, leaf_buffer);
+
+		refit = BVHRefit();
+	};
+
+	// Rebuild and upload the whole BVH
+	auto rebuild_bvh = [&](BVHBuilder builder) {
+		// The instanced scene keeps its own two level BVH
+		if (state.instanced_pillars)
+			return;
+
+		if (state.dynamic()) {
+			reset_dynamic();
+			return;
+		}
+
+		// Per-frame rebuilds of animated pillars skip the optimization
+		bool optimize = state.optimize_bvh && !state.animate_pillars;
+		bvh_stats = make_bvh_buffer(bvh_mesh(), builder, state.bvh_width, state.quantize_bvh, optimize,
+			state.block_bvh, state.bvh_layout().leaf_size, bvh_buffer, leaf_buffer);
+		update_ssbo(ssbo_bvh, bvh_buffer);
+		update_ssbo(ssbo_leaves, leaf_buffer);
+
+		// Refit statistics only apply to the binary layout with one
+		// triangle per leaf
+		refit = BVHRefit();
+		if (state.bvh_width == 2 && !state.clustered_leaves())
+			refit.reset(bvh_buffer);
+	};
+
+	// Pack the tile geometry again, if it is used packed; returns whether
+	// the BVH has to be rebuilt, being over the quantized copy now or
+	// having been before
+	auto upload_packed = [&]() {
+		bool was_packed = packed_bvh;
+		packed_bvh = false;
+		if (!state.packed())
+			return was_packed;
+
+		packed_format = tile.packed_format(state.quantize_vertices ? eVertexQuantized : eVertexFloat);
+		if (packed_format.vertex_format == eVertexQuantized) {
+			packed_tile = tile.quantized(packed_format);
+			packed_bvh = true;
+		}
+
+		packed_vertices.clear();
+		packed_indices.clear();
+		tile.serialize_vertices(packed_vertices, packed_format);
+		tile.serialize_indices(packed_indices, packed_format);
+
+		update_ssbo(ssbo_packed_vertices, packed_vertices);
+		update_ssbo(ssbo_packed_indices, packed_indices);
+
+		const int index_bits[] = { 32, 24, 16 };
+		set_int(shaders->pixelizer, "vertex_quantized", packed_format.vertex_format == eVertexQuantized);
+		set_int(shaders->pixelizer, "index_bits", index_bits[packed_format.index_format]);
+		set_vec3(shaders->pixelizer, "vertex_origin", packed_format.origin);
+		set_vec3(shaders->pixelizer, "vertex_scale", packed_format.scale);
+		return packed_bvh || was_packed;
+	};
+
+	// Switch between the flat tile and the instanced scene, uploading
+	// every buffer
+	auto load_scene = [&]() {
+		vertices.clear();
+		indices.clear();
+		records.clear();
+		instance_buffer.clear();
+
+		if (state.instanced_pillars) {
+			scene = generate_instanced_tile(state.instances, 0.45f * state.terrain_size);
+
+			scene_rest.clear();
+			for (const Instance &instance : scene.instances)
+				scene_rest.push_back(instance.transform);
+
+			scene.serialize_geometry(vertices, indices);
+			scene.serialize_records(records);
+
+			auto start = std::chrono::high_resolution_clock::now();
+			BVH tlas = scene.make_tlas();
+			auto end = std::chrono::high_resolution_clock::now();
+
+			bvh_stats.build_time = std::chrono::duration <float, std::milli> (end - start).count();
+			bvh_stats.sah_cost = tlas.sah_cost();
+
+			bvh_buffer.clear();
+			scene.serialize(tlas, bvh_buffer);
+			scene.serialize_instances(instance_buffer);
+
+			refit = BVHRefit();
+			update_ssbo(ssbo_bvh, bvh_buffer);
+		} else {
+			upload_packed();
+			tile.serialize_vertices(vertices);
+			tile.serialize_indices(indices);
+			tile.serialize_records(records);
+			rebuild_bvh((BVHBuilder) state.bvh_builder);
+		}
+
+		update_ssbo(ssbo_vertices, vertices);
+		update_ssbo(ssbo_indices, indices);
+		update_ssbo(ssbo_records, records);
+		update_ssbo(ssbo_instances, instance_buffer);
+
+		int count = state.instanced_pillars ? scene.instances.size() : 0;
+		set_int(shaders->pixelizer, "instance_count", count);
+	};
+
+	// Upload the geometry of the flat tile after pillars come or go
+	auto upload_tile = [&]() {
+		bool rebuild = upload_packed();
+
+		vertices.clear();
+		indices.clear();
+		records.clear();
+
+		tile.serialize_vertices(vertices);
+		tile.serialize_indices(indices);
+		tile.serialize_records(records);
+
+		update_ssbo(ssbo_vertices, vertices);
+		update_ssbo(ssbo_indices, indices);
+		update_ssbo(ssbo_records, records);
+
+		if (rebuild)
+			rebuild_bvh((BVHBuilder) state.bvh_builder);
+	};
+
+	// Add a pillar at the end of the tile, inserting its triangles into
+	// the dynamic BVH
+	auto spawn_pillar = [&]() {
+		glm::mat4 mat = Transform {
+			glm::vec3(randf(-4.5, 4.5), randf() + 1.0f, randf(-4.5, 4.5)),
+			glm::vec3(randf() * 15.0f, randf() * 360.0f, randf() * 15.0f),
+			glm::vec3(randf() * 0.6f + 0.5f, randf() * 2.0f + 0.5f, randf() * 0.6f + 0.5f)
+		}.matrix();
+
+		Mesh pillar = generate_pillar(mat);
+		spawned.push_back({tile.vertices.size(), tile.triangles.size()});
+
+		size_t first = tile.triangles.size();
+		tile.add(pillar);
+		rest.insert(rest.end(), pillar.vertices.begin(), pillar.vertices.end());
+
+		for (size_t i = first; i < tile.triangles.size(); i++)
+			dynamic_leaves.push_back(dynamic.insert(tile.bbox(tile.triangles[i]), i));
+
+		upload_tile();
+		upload_dynamic();
+	};
+
+	// Put the terrain mesh at the end of the tile, or take it away, with
+	// the BVH rebuilt
+	auto update_terrain = [&]() {
+		if (terrain_triangles > 0) {
+			tile.triangles.erase(tile.triangles.begin() + terrain_start.second, tile.triangles.end());
+			tile.vertices.erase(tile.vertices.begin() + terrain_start.first, tile.vertices.end());
+			terrain_triangles = 0;
+		}
+
+		if (state.terrain_mesh) {
+			terrain_start = {tile.vertices.size(), tile.triangles.size()};
+
+			auto start = std::chrono::high_resolution_clock::now();
+			Mesh terrain = terrain_mesher.build(state.terrain_error);
+			auto end = std::chrono::high_resolution_clock::now();
+
+			terrain_time = std::chrono::duration <float, std::milli> (end - start).count();
+			terrain_triangles = terrain.triangles.size();
+			tile.add(std::move(terrain));
+		}
+
+		set_int(shaders->pixelizer, "terrain_first", terrain_start.second);
+
+		// The instanced scene picks the tile up when switched back
+		if (state.instanced_pillars)
+			return;
+
+		upload_tile();
+		rebuild_bvh((BVHBuilder) state.bvh_builder);
+	};
+
+	// Take away the last spawned pillar, removing its leaves
+	auto despawn_pillar = [&]() {
+		auto [vertex_count, triangle_count] = spawned.back();
+		spawned.pop_back();
+
+		for (size_t i = triangle_count; i < tile.triangles.size(); i++) {
+			dynamic.remove(dynamic_leaves.back());
+			dynamic_leaves.pop_back();
+		}
+
+		tile.triangles.erase(tile.triangles.begin() + triangle_count, tile.triangles.end());
+		tile.vertices.erase(tile.vertices.begin() + vertex_count, tile.vertices.end());
+		rest.erase(rest.begin() + vertex_count, rest.end());
+
+		upload_tile();
+		upload_dynamic();
+	};
+
 	std::cout << "Buffer size = " << bvh_buffer.size() << std::endl;
 	std::cout << "Triangles = " << tile.triangles.size() << std::endl;
+	std::cout << "Tile seed = " << state.tile_seed << std::endl;
+	if (state.tile_seeded) {
+		std::cout << "Scene " << (cached ? "mapped from " : "built and cached in ")
+			<< scene_cache_path(cache_key) << " in " << startup_time << " ms" << std::endl;
+	} else {
+		std::cout << "Scene built in " << startup_time << " ms, pass --seed "
+			<< state.tile_seed << " to cache it" << std::endl;
+	}
+	std::cout << "BVH build time = " << bvh_stats.build_time << " ms" << std::endl;
+	std::cout << "BVH SAH cost = " << bvh_stats.sah_cost << std::endl;
 
-	set_vec3(shaders->pixelizer, "light_dir", glm::normalize( glm::vec3 {1, 1, 1} ));
+	glm::vec3 light_dir = glm::normalize(glm::vec3 {1, 1, 1});
+	set_vec3(shaders->pixelizer, "light_dir", light_dir);
 
-	// Loop until the user closes the window
-	float cloud_time = 0;
-	float sun_time = 0;
-	float last_time = 0;
+	// Clouds, wind and sun are stepped off the render thread and streamed
+	// through unpack buffers
+	Simulation simulation(heightmap, perlin_cloud, cloud_resolution, cloud_frequency, cloud_period);
 
+	unsigned int pbo_clouds;
+	unsigned int pbo_wind;
+	glGenBuffers(1, &pbo_clouds);
+	glGenBuffers(1, &pbo_wind);
+
+	// Loop until the user closes the window
 	const int BATCH_SIZE = 1000;
 
 	int offx = 0;
 	int offy = 0;
 
-	glm::vec2 wind_velocity {0, 0};
-	glm::vec2 wind_acceleration {0, 0};
-	float theta_a = 0;
-
 	/* auto smootherstep = [](float x) {
 		if (x <= 0.0f) return 0.0f;
 		if (x >= 1.0f) return 1.0f;
@@ -192,8 +753,6 @@ int main()
 		return 6.0f * x5 - 15.0f * x4 + 10.0f * x3;
 	}; */
 
-	glm::vec2 water_offset {0, 0};
-
 	while (!glfwWindowShouldClose(window)) {
 		// TODO: frame.cpp
 		// Close if escape or q
@@ -203,8 +762,6 @@ int main()
 		}
 
 		float t = glfwGetTime();
-		float dt = t - last_time;
-		last_time = t;
 
 		// Move camera
 		float speed = 0.1f;
@@ -238,62 +795,90 @@ int main()
 			state.tab = false;
 		}
 
-		// Update cloud density every so often
-		cloud_time += dt;
-
-		if (cloud_time > 0.01f && !state.paused) {
-			cloud_time = 0;
-
-			cloud_offset += 0.005f;
+		// Pick up the latest finished simulation step, if any
+		simulation.paused = state.paused;
+		simulation.cloud_atlas = state.cloud_atlas;
 
-			float frequency = 8.0f;
-			const double f = (frequency/cloud_resolution);
-			for (int i = 0; i < cloud_resolution * cloud_resolution; i++) {
-				int x = i % cloud_resolution;
-				int y = i / cloud_resolution;
-
-				float density = perlin_cloud.octave2D_01(x * f + cloud_offset.x, y * f + cloud_offset.y, 16);
-				cloud_density_image[i] = (unsigned char) (density * 250.0f + 1);
+		if (const SimulationFrame *frame = simulation.latest()) {
+			if (!frame->clouds.empty()) {
+				stream_texture(pbo_clouds, cloud_density, cloud_resolution, cloud_resolution,
+					GL_RED, GL_UNSIGNED_BYTE, frame->clouds.data(), frame->clouds.size());
 			}
 
-			// Update texture
-			glBindTexture(GL_TEXTURE_2D, cloud_density);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, cloud_resolution, cloud_resolution, 0, GL_RED, GL_UNSIGNED_BYTE, cloud_density_image);
-
-			/* Random wind offset
-			float angle = randf(-glm::pi <float> (), glm::pi <float> ());
-			float strength = 0.1f;
+			set_vec2(shaders->pixelizer, "cloud_scroll", frame->cloud_scroll);
 
-			glm::vec2 next = strength * glm::vec2 {glm::cos(angle), glm::sin(angle)};
-			wind_velocity = lerp(wind_velocity, next, 0.1f);
-			wind_velocity = glm::clamp(wind_velocity, -0.5f, 0.5f); */
+			heightmap.upload_wind(frame->wind, pbo_wind);
+			set_vec2(shaders->pixelizer, "wind_offset", frame->wind_offset);
+			set_vec2(shaders->pixelizer, "water_offset", frame->water_offset);
 
-			// Update wind offset
-			set_vec2(shaders->pixelizer, "wind_offset", wind_velocity);
+			light_dir = frame->light_dir;
+			set_vec3(shaders->pixelizer, "light_dir", light_dir);
+		}
 
-			// Update water offset
-			water_offset += 0.5f * glm::normalize(glm::vec2 {randf(), randf()}) * dt;
+		// Animate instances, rebuilding only the TLAS at the head of the
+		// BVH buffer; the BLAS part never changes
+		if (state.animate_pillars && !state.paused && state.instanced_pillars) {
+			animate_instances(scene, scene_rest, t);
 
-			set_vec2(shaders->pixelizer, "water_offset", water_offset);
+			auto start = std::chrono::high_resolution_clock::now();
+			BVH tlas = scene.make_tlas(BVHBuilder::eLBVH);
+			scene.update_tlas(tlas, bvh_buffer);
+			auto end = std::chrono::high_resolution_clock::now();
 
-			// Update wind map
-			float theta = randf(-1, 1) * glm::pi <float> ();
-			theta_a = lerp(theta_a, theta, 0.2f);
+			tlas_time = std::chrono::duration <float, std::milli> (end - start).count();
 
-			wind_acceleration += 0.5f * glm::vec2 {glm::cos(theta_a), glm::sin(theta_a)};
-			wind_acceleration = glm::clamp(wind_acceleration, -0.5f, 0.5f);
+			DirtyRanges head;
+			head.mark(0, scene.tlas_size());
+			update_ssbo(ssbo_bvh, bvh_buffer, head);
 
-			wind_velocity += wind_acceleration * dt * 25.0f;
-			// wind_velocity = glm::clamp(wind_velocity, -1.0f, 1.0f);
-			heightmap.update_wind(wind_velocity);
+			scene.serialize_instances(instance_buffer);
+			update_ssbo(ssbo_instances, instance_buffer);
+		}
 
-			// Update sun direction, should lie on the x = z plane
-			float st = sun_time;
-			float y = glm::sin(st);
-			float x = glm::cos(st);
+		// Animate pillars, refitting or rebuilding the BVH every frame
+		if (state.animate_pillars && !state.paused && !state.instanced_pillars) {
+			animate_pillars(tile, rest, t);
+
+			// Upload only the vertices that moved
+			next_vertices.clear();
+			tile.serialize_vertices(next_vertices);
+			copy_dirty(vertices, next_vertices, dirty_vertices);
+			update_ssbo(ssbo_vertices, vertices, dirty_vertices);
+
+			// Records follow the vertices; every pillar moves, so all
+			// of them are redone
+			records.clear();
+			tile.serialize_records(records);
+			update_ssbo(ssbo_records, records);
+
+			// Only the binary layout can be refit in place; clustered
+			// leaves hold copies of the vertices, so they are rebuilt
+			bool refit_bvh = state.refit_bvh && state.bvh_width == 2
+				&& !state.clustered_leaves() && !state.dynamic();
+
+			// The dynamic BVH reinserts the leaves whose triangles left
+			// their fattened boxes, where they now fit best
+			if (state.dynamic()) {
+				for (size_t i = 0; i < tile.triangles.size(); i++)
+					dynamic.update(dynamic_leaves[i], tile.bbox(tile.triangles[i]));
+
+				upload_dynamic();
+			} else if (refit_bvh) {
+				auto start = std::chrono::high_resolution_clock::now();
+				tile.bounds(bounds);
+				refit.refit(bvh_buffer, bounds);
+				auto end = std::chrono::high_resolution_clock::now();
+
+				refit_time = std::chrono::duration <float, std::milli> (end - start).count();
+			}
 
-			set_vec3(shaders->pixelizer, "light_dir", glm::normalize(glm::vec3 {x, y, x}));
-			sun_time = std::fmod(sun_time + dt/25.0f, 2 * glm::pi <float> ());
+			// Rebuild once refitting has degraded the tree too much
+			if (!state.dynamic() && (!refit_bvh || refit.needs_rebuild())) {
+				rebuild_bvh(BVHBuilder::eLBVH);
+				rebuilds++;
+			} else if (refit_bvh) {
+				update_ssbo(ssbo_bvh, bvh_buffer, refit.dirty);
+			}
 		}
 
 		// Ray tracing
@@ -311,7 +896,7 @@ int main()
 			glBindTexture(GL_TEXTURE_2D, heightmap.t_normal);
 
 			glActiveTexture(GL_TEXTURE2);
-			glBindTexture(GL_TEXTURE_2D, cloud_density);
+			glBindTexture(GL_TEXTURE_2D, state.cloud_atlas ? cloud_atlas : cloud_density);
 
 			glActiveTexture(GL_TEXTURE4);
 			glBindTexture(GL_TEXTURE_2D, grassmap.t_grass);
@@ -336,6 +921,11 @@ int main()
 			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ssbo_vertices);
 			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ssbo_indices);
 			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssbo_bvh);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, ssbo_instances);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, ssbo_leaves);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, ssbo_records);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, ssbo_packed_vertices);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, ssbo_packed_indices);
 
                         int size = BATCH_SIZE/(16 * PIXEL_SIZE);
 			glDispatchCompute(size, size, 1);
@@ -379,6 +969,7 @@ int main()
 
 				ImGui::Checkbox("Show triangles", &state.show_triangles);
 				ImGui::Checkbox("Show clouds", &state.show_clouds);
+				ImGui::Checkbox("Cloud atlas", &state.cloud_atlas);
 				ImGui::Checkbox("Show grass", &state.show_grass);
 				ImGui::Checkbox("Show grass blades", &state.show_grass_blades);
 
@@ -409,6 +1000,88 @@ int main()
 				ImGui::Checkbox("Show normals", &state.show_normals);
 				ImGui::SliderFloat("Ray marching step", &state.ray_marching_step, 1e-3f, 1.0f, "%.3g", 1 << 5);
 				ImGui::SliderFloat("Ray shadow step", &state.ray_shadow_step, 1e-3f, 1.0f, "%.3g", 1 << 5);
+
+				// Terrain through the BVH as an adaptive mesh, within
+				// the error of the height map samples
+				if (ImGui::Checkbox("Terrain mesh", &state.terrain_mesh))
+					update_terrain();
+
+				if (ImGui::SliderFloat("Terrain mesh error", &state.terrain_error, 1e-3f, 0.5f, "%.3g", 1 << 5) && state.terrain_mesh)
+					update_terrain();
+
+				// Rebuild the same tile with another builder
+				const char *builders[] = { "Sweep SAH", "Binned SAH", "Parallel binned SAH", "LBVH", "SBVH" };
+				if (ImGui::Combo("BVH builder", &state.bvh_builder, builders, 5))
+					rebuild_bvh((BVHBuilder) state.bvh_builder);
+
+				// Collapse into a wide BVH
+				const char *widths[] = { "Binary", "BVH4", "BVH8" };
+				int width = state.bvh_width / 4;
+				if (ImGui::Combo("BVH width", &width, widths, 3)) {
+					state.bvh_width = width ? 4 * width : 2;
+					rebuild_bvh((BVHBuilder) state.bvh_builder);
+				}
+
+				// Quantized child bounds, wide layouts only
+				if (ImGui::Checkbox("Quantize BVH", &state.quantize_bvh))
+					rebuild_bvh((BVHBuilder) state.bvh_builder);
+
+				// Treelet restructuring after the build
+				if (ImGui::Checkbox("Optimize BVH", &state.optimize_bvh))
+					rebuild_bvh((BVHBuilder) state.bvh_builder);
+
+				// Cache line blocks, binary layout only
+				if (ImGui::Checkbox("Block BVH nodes", &state.block_bvh))
+					rebuild_bvh((BVHBuilder) state.bvh_builder);
+
+				// Ordered traversal, binary layout only
+				ImGui::Checkbox("Ordered traversal", &state.ordered_traversal);
+
+				// Triangles per leaf, binary layout only
+				if (ImGui::SliderInt("BVH leaf size", &state.leaf_size, 1, 8))
+					rebuild_bvh((BVHBuilder) state.bvh_builder);
+
+				// Precomputed triangle records instead of the index
+				// buffer, for single triangle leaves
+				ImGui::Checkbox("Triangle records", &state.triangle_records);
+
+				// 16-bit positions and small indices for the static tile,
+				// through the index buffer
+				if (ImGui::Checkbox("Packed mesh", &state.packed_mesh))
+					upload_tile();
+
+				if (state.packed_mesh && ImGui::Checkbox("Quantize vertices", &state.quantize_vertices))
+					upload_tile();
+
+				// CPU reference only covers the flat layouts
+				if (!state.instanced_pillars && ImGui::Button("Measure traversal"))
+					traversal = measure_traversal(bvh_buffer, vertices, indices, leaf_buffer, records, light_dir);
+
+				// Packed geometry is redone once the pillars stop, and
+				// the BVH goes back to the tile while they move
+				if (ImGui::Checkbox("Animate pillars", &state.animate_pillars) && (state.packed() || packed_bvh))
+					upload_tile();
+				ImGui::Checkbox("Refit BVH", &state.refit_bvh);
+
+				// Incremental BVH, pillars can then come and go
+				if (ImGui::Checkbox("Dynamic BVH", &state.dynamic_bvh))
+					rebuild_bvh((BVHBuilder) state.bvh_builder);
+
+				// Pillars go before the terrain mesh, so not while it
+				// is there
+				if (state.dynamic() && terrain_triangles == 0 && ImGui::Button("Spawn pillar"))
+					spawn_pillar();
+
+				if (state.dynamic() && terrain_triangles == 0 && !spawned.empty() && ImGui::Button("Despawn pillar"))
+					despawn_pillar();
+
+				// Two level BVH over instanced pillars and rocks
+				if (ImGui::Checkbox("Instanced pillars", &state.instanced_pillars))
+					load_scene();
+
+				if (ImGui::SliderInt("Instances", &state.instances, 100, 100000) && state.instanced_pillars)
+					load_scene();
+
 				ImGui::End();
 			}
 
@@ -418,6 +1091,63 @@ int main()
 				ImGui::Text("frametime: %.1f ms", 1000.0f/ImGui::GetIO().Framerate);
                                 ImGui::Text("framerate: %.1f fps", ImGui::GetIO().Framerate);
 				ImGui::Text("primitives: %lu", tile.triangles.size());
+				if (state.instanced_pillars) {
+					ImGui::Text("instances: %zu of %zu meshes, %d triangles",
+						scene.instances.size(), scene.meshes.size(), scene.triangle_count());
+					ImGui::Text("tlas rebuild: %.3f ms, %d vec4s uploaded", tlas_time, scene.tlas_size());
+				}
+
+				ImGui::Text("tile seed: %u", state.tile_seed);
+				ImGui::Text("startup scene: %s in %.1f ms", cached ? "mapped from cache" : "built", startup_time);
+				ImGui::Text("bvh build: %.3f ms", bvh_stats.build_time);
+				ImGui::Text("bvh optimize: %.3f ms", bvh_stats.optimize_time);
+				ImGui::Text("bvh sah cost: %.3f", bvh_stats.sah_cost);
+				ImGui::Text("bvh refit: %.3f ms", refit_time);
+				ImGui::Text("bvh refit degradation: %.3f", refit.degradation());
+				ImGui::Text("bvh rebuilds: %d", rebuilds);
+				ImGui::Text("dirty bvh: %d vec4s in %zu ranges",
+					refit.dirty.size(), refit.dirty.ranges.size());
+				if (terrain_triangles > 0) {
+					ImGui::Text("terrain mesh: %zu triangles, %.1f%% of the grid, %.3f ms", terrain_triangles,
+						100.0f * terrain_triangles / (2.0f * (terrain_grid.size - 1) * (terrain_grid.size - 1)),
+						terrain_time);
+				}
+
+				if (state.dynamic()) {
+					ImGui::Text("dynamic bvh: %d leaves, %zu spawned pillars", dynamic.size(), spawned.size());
+					ImGui::Text("dynamic bvh update: %.3f ms, %d vec4s in %zu ranges", dynamic_time,
+						dirty_dynamic.size(), dirty_dynamic.ranges.size());
+				}
+
+				ImGui::Text("dirty vertices: %d in %zu ranges",
+					dirty_vertices.size(), dirty_vertices.ranges.size());
+				ImGui::Text("bvh buffer: %zu KiB", bvh_buffer.size() * sizeof(aligned_vec4) / 1024);
+				ImGui::Text("leaf buffer: %zu KiB", leaf_buffer.size() * sizeof(aligned_vec4) / 1024);
+				ImGui::Text("triangle records: %zu KiB", records.size() * sizeof(aligned_vec4) / 1024);
+				ImGui::Text("mesh buffers: %zu KiB", (vertices.size() * sizeof(aligned_vec4)
+					+ indices.size() * sizeof(aligned_uvec4)) / 1024);
+				if (state.packed()) {
+					ImGui::Text("packed mesh buffers: %zu KiB",
+						(packed_vertices.size() + packed_indices.size()) * sizeof(uint32_t) / 1024);
+				}
+
+				// Per ray averages, and node visits saved over the
+				// threaded traversal
+				auto show_traversal = [](const char *kind, const TraversalStats &stats,
+						const TraversalStats &threaded, int rays) {
+					float n = std::max(rays, 1);
+					ImGui::Text("%s: %.1f nodes/ray, %.1f boxes/ray, %.1f triangles/ray, %.0f bytes/ray",
+						kind, stats.nodes / n, stats.boxes / n, stats.primitives / n, stats.bytes / n);
+					ImGui::Text("%s: %.0f geometry bytes/ray", kind, stats.geometry / n);
+
+					if (threaded.nodes > 0) {
+						float saved = 1.0f - (float) stats.nodes / threaded.nodes;
+						ImGui::Text("%s: %.1f%% node visits saved", kind, 100.0f * saved);
+					}
+				};
+
+				show_traversal("primary", traversal.primary, traversal.primary_threaded, traversal.primary_rays);
+				show_traversal("shadow", traversal.shadow, traversal.shadow_threaded, traversal.shadow_rays);
 				ImGui::End();
 			}
 
@@ -426,7 +1156,8 @@ int main()
 		}
 
 		// Apply settings
-		int primitives = state.show_triangles * tile.triangles.size();
+		int triangles = state.instanced_pillars ? scene.triangle_count() : tile.triangles.size();
+		int primitives = state.show_triangles * triangles;
 		set_int(shaders->pixelizer, "primitives", primitives);
 		state.apply();
 
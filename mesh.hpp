@@ -0,0 +1,731 @@
+#ifndef MESH_H_
+#define MESH_H_
+
+// Standard headers
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// App headers
+#include "bvh.hpp"
+#include "core.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include "shades.hpp"
+
+// Pool the builder runs on, if it is parallel
+inline ThreadPool *bvh_builder_pool(BVHBuilder builder)
+{
+	if (builder == BVHBuilder::eParallelBinnedSAH || builder == BVHBuilder::eLBVH)
+		return &ThreadPool::global();
+
+	return nullptr;
+}
+
+// Build a BVH over any primitives with the given builder; spatial splits
+// need the triangles, so other primitives get the plain binned build
+inline BVH build_bvh(std::vector <BVHPrimitive> &prims, BVHBuilder builder)
+{
+	ThreadPool *pool = bvh_builder_pool(builder);
+
+	if (builder == BVHBuilder::eSweepSAH)
+		return partition(prims);
+
+	if (builder == BVHBuilder::eLBVH)
+		return partition_lbvh(prims, pool);
+
+	return partition_binned(prims, pool);
+}
+
+// TODO: add info about normals
+// TODO: use indices and another vertex structure
+struct Vertex {
+	glm::vec3 position;
+};
+
+struct Triangle {
+	uint32_t v1, v2, v3;
+	Shades shade = Shades::eNone;
+
+	Triangle() = default;
+
+	Triangle(uint32_t v1, uint32_t v2, uint32_t v3)
+			: v1(v1), v2(v2), v3(v3) {}
+
+	Triangle(uint32_t v1, uint32_t v2, uint32_t v3, Shades shade)
+			: v1(v1), v2(v2), v3(v3), shade(shade) {}
+};
+
+using VBuffer = std::vector <aligned_vec4>;
+using IBuffer = std::vector <aligned_uvec4>;
+
+// Precomputed triangle records, TRIANGLE_RECORD_SIZE vec4s each
+using RBuffer = std::vector <aligned_vec4>;
+
+// vec4s per triangle record
+constexpr int TRIANGLE_RECORD_SIZE = 3;
+
+// Packed vertex and index buffers, as 32-bit words with no padding lanes:
+//
+//	eVertexFloat:		x, y, z as floats, 3 words
+//	eVertexQuantized:	x | y << 16, z, 16 bits an axis over the mesh
+//				bounds, 2 words
+//	eIndex32:		v1, v2, v3, shade, 4 words as in IBuffer
+//	eIndex24:		v1 | shade << 24, v2, v3, 3 words
+//	eIndex16:		v1 | v2 << 16, v3 | shade << 16, 2 words
+enum VertexFormat : uint32_t {
+	eVertexFloat,
+	eVertexQuantized
+};
+
+enum IndexFormat : uint32_t {
+	eIndex32,
+	eIndex24,
+	eIndex16
+};
+
+using PBuffer = std::vector <uint32_t>;
+
+struct PackedFormat {
+	VertexFormat vertex_format = eVertexFloat;
+	IndexFormat index_format = eIndex32;
+
+	// Quantized positions are origin + scale * q
+	glm::vec3 origin {0.0f};
+	glm::vec3 scale {1.0f};
+
+	int vertex_words() const {
+		return vertex_format == eVertexQuantized ? 2 : 3;
+	}
+
+	int index_words() const {
+		static const int words[] = { 4, 3, 2 };
+		return words[index_format];
+	}
+
+	void pack_vertex(const glm::vec3 &p, PBuffer &buffer) const {
+		if (vertex_format == eVertexFloat) {
+			for (int axis = 0; axis < 3; axis++) {
+				uint32_t word;
+				memcpy(&word, &p[axis], sizeof(word));
+				buffer.push_back(word);
+			}
+
+			return;
+		}
+
+		glm::vec3 q = glm::clamp((p - origin) / scale + 0.5f, 0.0f, 65535.0f);
+		buffer.push_back((uint32_t) q.x | (uint32_t) q.y << 16);
+		buffer.push_back((uint32_t) q.z);
+	}
+
+	glm::vec3 unpack_vertex(const PBuffer &buffer, uint32_t i) const {
+		const uint32_t *words = &buffer[i * vertex_words()];
+
+		if (vertex_format == eVertexFloat) {
+			glm::vec3 p;
+			memcpy(&p[0], words, 3 * sizeof(float));
+			return p;
+		}
+
+		glm::vec3 q {
+			(float) (words[0] & 0xffff),
+			(float) (words[0] >> 16),
+			(float) (words[1] & 0xffff)
+		};
+
+		return origin + scale * q;
+	}
+
+	void pack_triangle(const glm::uvec4 &t, PBuffer &buffer) const {
+		if (index_format == eIndex16) {
+			buffer.push_back(t.x | t.y << 16);
+			buffer.push_back(t.z | t.w << 16);
+		} else if (index_format == eIndex24) {
+			buffer.push_back(t.x | t.w << 24);
+			buffer.push_back(t.y);
+			buffer.push_back(t.z);
+		} else {
+			for (int k = 0; k < 4; k++)
+				buffer.push_back(t[k]);
+		}
+	}
+
+	// Indices in xyz and shade in w, as in IBuffer
+	glm::uvec4 unpack_triangle(const PBuffer &buffer, uint32_t i) const {
+		const uint32_t *words = &buffer[i * index_words()];
+
+		if (index_format == eIndex16)
+			return glm::uvec4 {words[0] & 0xffff, words[0] >> 16, words[1] & 0xffff, words[1] >> 16};
+
+		if (index_format == eIndex24)
+			return glm::uvec4 {words[0] & 0xffffff, words[1], words[2], words[0] >> 24};
+
+		return glm::uvec4 {words[0], words[1], words[2], words[3]};
+	}
+};
+
+// Smallest index format that can address this many vertices
+inline IndexFormat smallest_index_format(size_t vertices)
+{
+	if (vertices <= (1u << 16))
+		return eIndex16;
+
+	if (vertices <= (1u << 24))
+		return eIndex24;
+
+	return eIndex32;
+}
+
+// Woop's unit triangle transform: rows of the affine map taking v1, v2, v3
+// to (0, 0, 0), (1, 0, 0), (0, 1, 0) and the normal to the z axis, so a
+// ray hits where its z crosses 0 with x, y in the unit triangle. For the
+// matrix of columns e1, e2, n = e1 x e2 the inverse rows are e2 x n, n x e1
+// and n, over |n|^2. The third row is then along the normal. Degenerate
+// triangles get a record no ray hits
+inline void push_triangle_record(const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec3 &v3, RBuffer &records)
+{
+	glm::vec3 e1 = v2 - v1;
+	glm::vec3 e2 = v3 - v1;
+	glm::vec3 n = glm::cross(e1, e2);
+
+	float det = glm::dot(n, n);
+	if (det == 0.0f) {
+		records.push_back(glm::vec4 {0.0f});
+		records.push_back(glm::vec4 {0.0f});
+		records.push_back(glm::vec4 {0.0f, 0.0f, 0.0f, 1.0f});
+		return;
+	}
+
+	glm::vec3 rows[3] = {
+		glm::cross(e2, n) / det,
+		glm::cross(n, e1) / det,
+		n / det
+	};
+
+	for (const glm::vec3 &row : rows)
+		records.push_back(glm::vec4 {row, -glm::dot(row, v1)});
+}
+
+struct Mesh {
+	std::vector <Vertex> vertices;
+	std::vector <Triangle> triangles;
+
+	// Make room for this many more vertices and triangles, at least
+	// doubling so that repeated calls stay amortized
+	void reserve(size_t vertex_count, size_t triangle_count) {
+		size_t v = vertices.size() + vertex_count;
+		if (v > vertices.capacity())
+			vertices.reserve(std::max(v, 2 * vertices.capacity()));
+
+		size_t t = triangles.size() + triangle_count;
+		if (t > triangles.capacity())
+			triangles.reserve(std::max(t, 2 * triangles.capacity()));
+	}
+
+	// Add another mesh to this mesh
+	void add(const Mesh &mesh) {
+		reserve(mesh.vertices.size(), mesh.triangles.size());
+
+		uint32_t size = vertices.size();
+		vertices.insert(vertices.end(),
+			mesh.vertices.begin(),
+			mesh.vertices.end()
+		);
+
+		// Need to reindex indices
+		for (auto &triangle : mesh.triangles) {
+			triangles.emplace_back(
+				triangle.v1 + size,
+				triangle.v2 + size,
+				triangle.v3 + size,
+				triangle.shade
+			);
+		}
+	}
+
+	// Same, taking over the storage of the other mesh if this one is
+	// empty
+	void add(Mesh &&mesh) {
+		if (vertices.empty() && triangles.empty()) {
+			vertices = std::move(mesh.vertices);
+			triangles = std::move(mesh.triangles);
+			return;
+		}
+
+		add((const Mesh &) mesh);
+	}
+
+	// Serialize mesh vertices and indices to buffers
+	void serialize_vertices(VBuffer &vbuffer) const {
+		vbuffer.reserve(vertices.size());
+		for (const auto &v : vertices)
+			vbuffer.push_back(aligned_vec4(v.position));
+	}
+
+	// TODO: format should be uvec4: v1, v2, v3, type (water, leaves, grass,
+	// etc.)
+	void serialize_indices(IBuffer &ibuffer) const {
+		for (const auto &triangle : triangles) {
+			ibuffer.push_back(glm::uvec4 {
+				triangle.v1,
+				triangle.v2,
+				triangle.v3,
+				(uint32_t) triangle.shade
+			});
+		}
+	}
+
+	// Packed format for this mesh: quantized over its bounds, and the
+	// smallest indices the vertex count allows
+	PackedFormat packed_format(VertexFormat vertex_format) const {
+		PackedFormat format;
+		format.vertex_format = vertex_format;
+		format.index_format = smallest_index_format(vertices.size());
+
+		if (vertices.empty())
+			return format;
+
+		glm::vec3 min = vertices[0].position;
+		glm::vec3 max = min;
+		for (const auto &v : vertices) {
+			min = glm::min(min, v.position);
+			max = glm::max(max, v.position);
+		}
+
+		format.origin = min;
+		for (int axis = 0; axis < 3; axis++)
+			format.scale[axis] = max[axis] > min[axis] ? (max[axis] - min[axis]) / 65535.0f : 1.0f;
+
+		return format;
+	}
+
+	// Copy with the vertices where the packed ones decode, for a BVH
+	// that bounds the packed triangles exactly
+	Mesh quantized(const PackedFormat &format) const {
+		Mesh mesh = *this;
+		if (format.vertex_format != eVertexQuantized)
+			return mesh;
+
+		PBuffer packed;
+		for (auto &v : mesh.vertices) {
+			packed.clear();
+			format.pack_vertex(v.position, packed);
+			v.position = format.unpack_vertex(packed, 0);
+		}
+
+		return mesh;
+	}
+
+	// Packed equivalents of the two above
+	void serialize_vertices(PBuffer &pbuffer, const PackedFormat &format) const {
+		pbuffer.reserve(pbuffer.size() + format.vertex_words() * vertices.size());
+		for (const auto &v : vertices)
+			format.pack_vertex(v.position, pbuffer);
+	}
+
+	void serialize_indices(PBuffer &pbuffer, const PackedFormat &format) const {
+		pbuffer.reserve(pbuffer.size() + format.index_words() * triangles.size());
+		for (const auto &triangle : triangles) {
+			format.pack_triangle(glm::uvec4 {
+				triangle.v1,
+				triangle.v2,
+				triangle.v3,
+				(uint32_t) triangle.shade
+			}, pbuffer);
+		}
+	}
+
+	// Inverse of serialize_vertices and serialize_indices
+	void deserialize(const VBuffer &vbuffer, const IBuffer &ibuffer) {
+		vertices.clear();
+		vertices.reserve(vbuffer.size());
+		for (const auto &v : vbuffer)
+			vertices.push_back(Vertex {glm::vec3(v.v)});
+
+		triangles.clear();
+		triangles.reserve(ibuffer.size());
+		for (const auto &i : ibuffer)
+			triangles.push_back(Triangle {i.v.x, i.v.y, i.v.z, (Shades) i.v.w});
+	}
+
+	// Triangle records in the order of serialize_indices, so that the
+	// same primitive index works for both
+	void serialize_records(RBuffer &rbuffer) const {
+		rbuffer.reserve(rbuffer.size() + TRIANGLE_RECORD_SIZE * triangles.size());
+		for (const auto &triangle : triangles) {
+			push_triangle_record(
+				vertices[triangle.v1].position,
+				vertices[triangle.v2].position,
+				vertices[triangle.v3].position,
+				rbuffer
+			);
+		}
+	}
+
+	// Bounding box of a triangle
+	BBox bbox(const Triangle &tri) const {
+		glm::vec3 min = vertices[tri.v1].position;
+		glm::vec3 max = vertices[tri.v1].position;
+
+		min = glm::min(min, vertices[tri.v2].position);
+		max = glm::max(max, vertices[tri.v2].position);
+
+		min = glm::min(min, vertices[tri.v3].position);
+		max = glm::max(max, vertices[tri.v3].position);
+
+		return BBox {min, max};
+	}
+
+	// Bounding boxes of all triangles
+	void bounds(std::vector <BBox> &boxes) const {
+		boxes.resize(triangles.size());
+		for (size_t i = 0; i < triangles.size(); i++)
+			boxes[i] = bbox(triangles[i]);
+	}
+
+	// Make BVH
+	BVH make_bvh(BVHBuilder builder = BVHBuilder::eBinnedSAH) const {
+		ThreadPool *pool = bvh_builder_pool(builder);
+
+		std::vector <BVHPrimitive> prims(triangles.size());
+
+		auto fill = [&](int /*chunk*/, int begin, int end) {
+			for (int i = begin; i < end; i++)
+				prims[i] = BVHPrimitive(bbox(triangles[i]), i);
+		};
+
+		if (pool)
+			parallel_for(*pool, 0, prims.size(), BVH_BINNING_GRAIN, fill);
+		else
+			fill(0, 0, prims.size());
+
+		if (builder == BVHBuilder::eSpatialSAH) {
+			std::vector <SBVHTriangle> corners(triangles.size());
+			for (size_t i = 0; i < triangles.size(); i++) {
+				corners[i] = SBVHTriangle {
+					vertices[triangles[i].v1].position,
+					vertices[triangles[i].v2].position,
+					vertices[triangles[i].v3].position
+				};
+			}
+
+			return partition_sbvh(prims, corners);
+		}
+
+		return build_bvh(prims, builder);
+	}
+};
+
+// Generate transform matrix
+struct Transform {
+	glm::vec3 pos;
+	glm::vec3 rot;
+	glm::vec3 scale;
+
+	Transform(const glm::vec3 &pos_ = glm::vec3(0.0f),
+			const glm::vec3 &rot_ = glm::vec3(0.0f),
+			const glm::vec3 &scale_ = glm::vec3(1.0f))
+			: pos(pos_), rot(rot_), scale(scale_) {}
+
+	glm::mat4 matrix() {
+		// Convert rot to radians
+		glm::vec3 rad_rot = rot * (float) M_PI / 180.0f;
+
+		glm::mat4 mat {1.0f};
+		mat = glm::translate(mat, pos);
+		mat = glm::rotate(mat, rad_rot.x, glm::vec3(1.0f, 0.0f, 0.0f));
+		mat = glm::rotate(mat, rad_rot.y, glm::vec3(0.0f, 1.0f, 0.0f));
+		mat = glm::rotate(mat, rad_rot.z, glm::vec3(0.0f, 0.0f, 1.0f));
+		mat = glm::scale(mat, scale);
+		return mat;
+	}
+};
+
+// Pillars are boxes: 8 corners and 12 triangles over them
+constexpr int PILLAR_VERTICES = 8;
+constexpr int PILLAR_TRIANGLES = 12;
+
+constexpr uint32_t PILLAR_INDICES[PILLAR_TRIANGLES][3] = {
+	{0, 1, 2}, {0, 2, 3},
+	{4, 5, 6}, {4, 6, 7},
+	{0, 1, 5}, {0, 5, 4},
+	{1, 2, 6}, {1, 6, 5},
+	{2, 3, 7}, {2, 7, 6},
+	{3, 0, 4}, {3, 4, 7}
+};
+
+// Pillars per chunk when generating in parallel
+constexpr int MESH_BUILDER_GRAIN = 4096;
+
+// Builds a mesh by appending transformed primitives straight into its
+// storage, sized up front from known counts, instead of going through a
+// temporary mesh per primitive. Builders of separate chunks can run on
+// separate threads and be concatenated once at the end
+struct MeshBuilder {
+	Mesh mesh;
+
+	MeshBuilder(size_t vertex_count = 0, size_t triangle_count = 0) {
+		mesh.reserve(vertex_count, triangle_count);
+	}
+
+	void reserve(size_t vertex_count, size_t triangle_count) {
+		mesh.reserve(vertex_count, triangle_count);
+	}
+
+	void add(Mesh &&other) {
+		mesh.add(std::move(other));
+	}
+
+	// Unit box centered at the origin, through the transform
+	void add_pillar(const glm::mat4 &transform) {
+		// Properties
+		glm::vec4 center_ = transform * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		glm::vec3 dx = transform * glm::vec4(1.0f, 0.0f, 0.0f, 1.0f) - center_;
+		glm::vec3 dy = transform * glm::vec4(0.0f, 1.0f, 0.0f, 1.0f) - center_;
+		glm::vec3 dz = transform * glm::vec4(0.0f, 0.0f, 1.0f, 1.0f) - center_;
+
+		// Vertices
+		glm::vec3 center = glm::vec3(center_);
+
+		uint32_t base = mesh.vertices.size();
+		mesh.reserve(PILLAR_VERTICES, PILLAR_TRIANGLES);
+
+		mesh.vertices.push_back(Vertex {center + dx/2.0f + dy/2.0f + dz/2.0f});
+		mesh.vertices.push_back(Vertex {center + dx/2.0f + dy/2.0f - dz/2.0f});
+		mesh.vertices.push_back(Vertex {center + dx/2.0f - dy/2.0f - dz/2.0f});
+		mesh.vertices.push_back(Vertex {center + dx/2.0f - dy/2.0f + dz/2.0f});
+		mesh.vertices.push_back(Vertex {center - dx/2.0f + dy/2.0f + dz/2.0f});
+		mesh.vertices.push_back(Vertex {center - dx/2.0f + dy/2.0f - dz/2.0f});
+		mesh.vertices.push_back(Vertex {center - dx/2.0f - dy/2.0f - dz/2.0f});
+		mesh.vertices.push_back(Vertex {center - dx/2.0f - dy/2.0f + dz/2.0f});
+
+		// Indices
+		for (const uint32_t *t : PILLAR_INDICES)
+			mesh.triangles.emplace_back(base + t[0], base + t[1], base + t[2], Shades::ePillar);
+	}
+
+	Mesh build() {
+		return std::move(mesh);
+	}
+
+	// One mesh out of the chunks, in order; each chunk is copied to its
+	// offset, in parallel with a pool
+	static Mesh concatenate(std::vector <MeshBuilder> &chunks, ThreadPool *pool = nullptr) {
+		int count = chunks.size();
+		if (count == 1)
+			return chunks[0].build();
+
+		std::vector <size_t> vertex_offsets(count + 1, 0);
+		std::vector <size_t> triangle_offsets(count + 1, 0);
+		for (int c = 0; c < count; c++) {
+			vertex_offsets[c + 1] = vertex_offsets[c] + chunks[c].mesh.vertices.size();
+			triangle_offsets[c + 1] = triangle_offsets[c] + chunks[c].mesh.triangles.size();
+		}
+
+		Mesh mesh;
+		mesh.vertices.resize(vertex_offsets[count]);
+		mesh.triangles.resize(triangle_offsets[count]);
+
+		auto copy = [&](int, int begin, int end) {
+			for (int c = begin; c < end; c++) {
+				Mesh &chunk = chunks[c].mesh;
+				std::copy(chunk.vertices.begin(), chunk.vertices.end(),
+					mesh.vertices.begin() + vertex_offsets[c]);
+
+				uint32_t base = vertex_offsets[c];
+				Triangle *out = &mesh.triangles[triangle_offsets[c]];
+				for (const Triangle &t : chunk.triangles)
+					*out++ = Triangle {t.v1 + base, t.v2 + base, t.v3 + base, t.shade};
+
+				chunk = Mesh();
+			}
+		};
+
+		if (pool)
+			parallel_for(*pool, 0, count, 1, copy);
+		else
+			copy(0, 0, count);
+
+		return mesh;
+	}
+};
+
+// Generate pillar mesh
+inline Mesh generate_pillar(const glm::mat4 &transform)
+{
+	MeshBuilder builder(PILLAR_VERTICES, PILLAR_TRIANGLES);
+	builder.add_pillar(transform);
+	return builder.build();
+}
+
+// Generate rock mesh, an octahedron in the unit box
+inline Mesh generate_rock(const glm::mat4 &transform)
+{
+	Mesh rock;
+
+	glm::vec3 axes[6] = {
+		{0.5f, 0.0f, 0.0f}, {-0.5f, 0.0f, 0.0f},
+		{0.0f, 0.5f, 0.0f}, {0.0f, -0.5f, 0.0f},
+		{0.0f, 0.0f, 0.5f}, {0.0f, 0.0f, -0.5f}
+	};
+
+	for (const glm::vec3 &axis : axes)
+		rock.vertices.push_back(Vertex {glm::vec3(transform * glm::vec4(axis, 1.0f))});
+
+	// Two fans around the equator
+	uint32_t ring[4] = {0, 4, 1, 5};
+	for (int i = 0; i < 4; i++) {
+		uint32_t a = ring[i];
+		uint32_t b = ring[(i + 1) % 4];
+		rock.triangles.push_back(Triangle {2, a, b, Shades::ePillar});
+		rock.triangles.push_back(Triangle {3, b, a, Shades::ePillar});
+	}
+
+	return rock;
+}
+
+// Generate terrain tile mesh
+// Uniform grid of random heights; terrain.hpp meshes height maps adaptively
+inline Mesh generate_terrain(int resolution)
+{
+	float width = 10.0f;
+	float height = 10.0f;
+
+	// Height map
+	size_t mapres = resolution + 1;
+	std::vector <float> height_map(mapres * mapres);
+
+	srand(clock());
+	for (size_t i = 0; i < mapres * mapres; i++)
+		height_map[i] = randf() * 1.0f;
+
+	float slice = width/resolution;
+
+	float x = -width/2.0f;
+	float z = -height/2.0f;
+
+	Mesh tile;
+	for (int i = 0; i <= resolution; i++) {
+		for (int j = 0; j <= resolution; j++) {
+			Vertex vertex;
+			vertex.position = glm::vec3(x, height_map[i * resolution + j], z);
+			tile.vertices.push_back(vertex);
+			x += slice;
+		}
+
+		x = -width/2.0f;
+		z += slice;
+	}
+
+	// Generate indices
+	for (int i = 0; i < resolution; i++) {
+		for (int j = 0; j < resolution; j++) {
+			// Indices of square
+			uint32_t a = i * (resolution + 1) + j;
+			uint32_t b = (i + 1) * (resolution + 1) + j;
+			uint32_t c = (i + 1) * (resolution + 1) + j + 1;
+			uint32_t d = i * (resolution + 1) + j + 1;
+
+			// Push
+			tile.triangles.push_back(Triangle {a, b, c, Shades::eGrass});
+			tile.triangles.push_back(Triangle {a, c, d, Shades::eGrass});
+		}
+	}
+
+	return tile;
+}
+
+// Generate a scene tile, the same one for the same seed
+inline Mesh generate_tile(int resolution, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+
+	// Generate terrain tile
+	// TODO: pass height map
+	// Mesh tile = generate_terrain(resolution);
+
+	// Add random columns
+	int nboxes = std::uniform_int_distribution <int> (10, 14)(rng);
+
+	MeshBuilder builder(nboxes * PILLAR_VERTICES, nboxes * PILLAR_TRIANGLES);
+
+	for (int i = 0; i < nboxes; i++) {
+		// Random size
+		float width = randf(rng) * 0.6f + 0.5f;
+		float depth = randf(rng) * 0.6f + 0.5f;
+		float height = randf(rng) * 2.0f + 0.5f;
+
+		// Random position within the tile
+		float x = randf(rng, -4.5f, 4.5f);
+		float z = randf(rng, -4.5f, 4.5f);
+		float y = height / 2.0f + randf(rng);
+
+		// Random rotation
+		float rx = randf(rng) * 15.0f;
+		float ry = randf(rng) * 360.0f;
+		float rz = randf(rng) * 15.0f;
+
+		// Generate box
+		glm::mat4 mat = Transform {
+			glm::vec3(x, y, z),
+			glm::vec3(rx, ry, rz),
+			glm::vec3(width, height, depth)
+		}.matrix();
+
+		// Add box
+		builder.add_pillar(mat);
+	}
+
+	return builder.build();
+}
+
+// Scatter pillars until the mesh reaches the requested triangle count.
+// The random placements are drawn in order first, so the mesh is the same
+// with or without a pool; the geometry is then built in chunks
+inline Mesh generate_pillars(int triangles, ThreadPool *pool = nullptr)
+{
+	int nboxes = (triangles + 11) / 12;
+	float extent = std::sqrt((float) nboxes);
+
+	std::vector <Transform> transforms;
+	transforms.reserve(nboxes);
+
+	for (int i = 0; i < nboxes; i++) {
+		transforms.push_back(Transform {
+			glm::vec3(randf(-extent, extent), randf(), randf(-extent, extent)),
+			glm::vec3(randf() * 15.0f, randf() * 360.0f, randf() * 15.0f),
+			glm::vec3(randf() * 0.6f + 0.5f, randf() * 2.0f + 0.5f, randf() * 0.6f + 0.5f)
+		});
+	}
+
+	auto build = [&](MeshBuilder &builder, int begin, int end) {
+		builder.reserve((end - begin) * PILLAR_VERTICES, (end - begin) * PILLAR_TRIANGLES);
+		for (int i = begin; i < end; i++)
+			builder.add_pillar(transforms[i].matrix());
+	};
+
+	if (!pool) {
+		MeshBuilder builder;
+		build(builder, 0, nboxes);
+		return builder.build();
+	}
+
+	std::vector <MeshBuilder> chunks(parallel_chunks(*pool, nboxes, MESH_BUILDER_GRAIN));
+	parallel_for(*pool, 0, nboxes, MESH_BUILDER_GRAIN,
+		[&](int c, int begin, int end) {
+			build(chunks[c], begin, end);
+		}
+	);
+
+	return MeshBuilder::concatenate(chunks, pool);
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef REFIT_H_
+#define REFIT_H_
+
+// Standard headers
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "core.hpp"
+#include "wide_bvh.hpp"
+
+// Rebuild once the refit tree is this much worse than the built one
+constexpr float BVH_REFIT_REBUILD_RATIO = 1.5f;
+
+// Integer field of a serialized node header
+inline int node_field(const BVHBuffer &buffer, int node, int field)
+{
+	return float_to_bits(buffer[node].v[field]);
+}
+
+// SAH cost of a serialized BVH, relative to the root surface area
+inline float sah_cost(const BVHBuffer &buffer)
+{
+	if (buffer.empty())
+		return 0.0f;
+
+	float root_area = BBox {buffer[1].v, buffer[2].v}.surface_area();
+
+	float cost = 0.0f;
+	for (int n = 0; n < (int) buffer.size(); n += 3) {
+		float area = BBox {buffer[n + 1].v, buffer[n + 2].v}.surface_area() / root_area;
+		if (node_field(buffer, n, 0) != -1)
+			cost += area * BVH_INTERSECTION_COST;
+		else
+			cost += area * BVH_TRAVERSAL_COST;
+	}
+
+	return cost;
+}
+
+// Total node area over total leaf area of a serialized BVH; leaf boxes
+// only depend on the geometry, so unlike the SAH cost this does not
+// change when the root grows or the scene scales
+inline float area_ratio(const BVHBuffer &buffer)
+{
+	float total = 0.0f;
+	float leaves = 0.0f;
+
+	for (int n = 0; n < (int) buffer.size(); n += 3) {
+		float area = BBox {buffer[n + 1].v, buffer[n + 2].v}.surface_area();
+		if (node_field(buffer, n, 0) != -1)
+			leaves += area;
+
+		total += area;
+	}
+
+	return leaves > 0.0f ? total / leaves : 1.0f;
+}
+
+// Refits a serialized BVH in place when primitives move but the topology
+// stays the same, and tracks which parts of the buffer need uploading
+struct BVHRefit {
+	float cost = 0.0f;		// SAH cost after the last refit
+	float build_ratio = 1.0f;	// Area ratio when the tree was built
+	float ratio = 1.0f;		// Area ratio after the last refit
+	DirtyRanges dirty;
+
+	// Start tracking a freshly built tree
+	void reset(const BVHBuffer &buffer) {
+		cost = sah_cost(buffer);
+		build_ratio = area_ratio(buffer);
+		ratio = build_ratio;
+		dirty.clear();
+	}
+
+	// How much worse the tree is than when it was built
+	float degradation() const {
+		return ratio / build_ratio;
+	}
+
+	bool needs_rebuild() const {
+		return degradation() > BVH_REFIT_REBUILD_RATIO;
+	}
+
+	// Recompute bounds bottom up from the primitive bounds; parents come
+	// before their children, so walking backwards visits children first
+	void refit(BVHBuffer &buffer, const std::vector <BBox> &bounds) {
+		int count = buffer.size() / 3;
+		std::vector <bool> changed(count, false);
+
+		for (int i = count - 1; i >= 0; i--) {
+			int n = 3 * i;
+
+			BBox box;
+
+			// Pad nodes of blocked layouts link nowhere
+			int primitive = node_field(buffer, n, 0);
+			if (primitive == -1 && node_field(buffer, n, 1) == -1)
+				continue;
+
+			if (primitive != -1) {
+				box = bounds[primitive];
+			} else {
+				// Left child follows, right child is its miss link
+				int left = node_field(buffer, n, 1);
+				int right = node_field(buffer, left, 2);
+
+				box = BBox {buffer[left + 1].v, buffer[left + 2].v};
+				box.grow(BBox {buffer[right + 1].v, buffer[right + 2].v});
+			}
+
+			if (glm::vec3(buffer[n + 1].v) != box.min
+					|| glm::vec3(buffer[n + 2].v) != box.max) {
+				buffer[n + 1] = box.min;
+				buffer[n + 2] = box.max;
+				changed[i] = true;
+			}
+		}
+
+		// Only the bounds of a node change, never its header
+		dirty.clear();
+		for (int i = 0; i < count; i++) {
+			if (changed[i])
+				dirty.mark(3 * i + 1, 3 * i + 3);
+		}
+
+		cost = sah_cost(buffer);
+		ratio = area_ratio(buffer);
+	}
+};
+
+#endif
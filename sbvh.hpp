@@ -0,0 +1,350 @@
+#ifndef SBVH_H_
+#define SBVH_H_
+
+// Standard headers
+#include <array>
+#include <limits>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+
+// Spatial split BVH builder (SBVH): besides the binned object split, a node
+// may be cut by a plane with the triangles crossing it referenced on both
+// sides, each reference bounded by the part of the triangle on its side.
+// Tilted, elongated triangles then stop inflating the boxes of both
+// children. Spatial splits are only tried where the object split children
+// overlap noticeably, and stop once the references reach a budget over the
+// triangle count. Leaves still hold a single reference, so the result
+// serializes like any other BVH; a triangle may just sit in several leaves.
+
+using SBVHTriangle = std::array <glm::vec3, 3>;
+
+// Spatial bins per axis
+constexpr int SBVH_BINS = 16;
+
+// Overlap of the object split children, relative to the root area, above
+// which spatial splits are tried
+constexpr float SBVH_OVERLAP = 1e-4f;
+
+// References allowed, relative to the triangle count
+constexpr float SBVH_MEMORY_BUDGET = 1.3f;
+
+// Intersection of two boxes, empty if they do not overlap
+inline BBox intersection(const BBox &a, const BBox &b)
+{
+	BBox box {glm::max(a.min, b.min), glm::min(a.max, b.max)};
+	for (int axis = 0; axis < 3; axis++) {
+		if (box.min[axis] > box.max[axis])
+			return BBox::empty();
+	}
+
+	return box;
+}
+
+inline bool is_empty(const BBox &box)
+{
+	return box.min.x > box.max.x;
+}
+
+// Bounds of the part of a triangle between two planes along an axis: the
+// corners inside the slab, and the edge crossings of both planes
+inline BBox clip_bounds(const SBVHTriangle &triangle, int axis, float lo, float hi)
+{
+	BBox box = BBox::empty();
+
+	for (int i = 0; i < 3; i++) {
+		const glm::vec3 &a = triangle[i];
+		const glm::vec3 &b = triangle[(i + 1) % 3];
+
+		if (a[axis] >= lo && a[axis] <= hi)
+			box.grow(a);
+
+		for (float plane : { lo, hi }) {
+			if ((a[axis] < plane) == (b[axis] < plane))
+				continue;
+
+			float t = (plane - a[axis]) / (b[axis] - a[axis]);
+			glm::vec3 p = a + (b - a) * t;
+			p[axis] = plane;
+			box.grow(p);
+		}
+	}
+
+	return box;
+}
+
+struct SBVHBin {
+	BBox bbox = BBox::empty();
+	int entries = 0;
+	int exits = 0;
+};
+
+// Result of the spatial split search
+struct SBVHSplit {
+	int axis = -1;
+	int bin = -1;		// Plane after this bin
+	float cost = std::numeric_limits <float> ::max();
+	BBox left = BBox::empty();
+	BBox right = BBox::empty();
+};
+
+struct SBVHBuilder {
+	const std::vector <SBVHTriangle> &triangles;
+	float root_area = 0.0f;
+	int references = 0;
+	int limit = 0;
+
+	SBVHBuilder(const std::vector <SBVHTriangle> &triangles_, float budget)
+			: triangles(triangles_), references(triangles_.size()),
+			limit(budget * triangles_.size()) {}
+
+	// Bounds of a reference clipped to a slab
+	BBox clip(const BVHPrimitive &ref, int axis, float lo, float hi) const {
+		return intersection(clip_bounds(triangles[ref.id], axis, lo, hi), ref.bbox);
+	}
+
+	// Bin the clipped parts of every reference along each axis, then sweep
+	// the planes between bins; references count on the left from the bin
+	// they enter and on the right up to the bin they exit
+	SBVHSplit find_spatial_split(const std::vector <BVHPrimitive> &refs, const BBox &bbox) const {
+		SBVHSplit split;
+
+		int count = refs.size();
+		float sa_total = bbox.surface_area();
+
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = bbox.max[axis] - bbox.min[axis];
+			if (extent <= 0.0f)
+				continue;
+
+			float width = extent / SBVH_BINS;
+			float scale = SBVH_BINS / extent;
+
+			auto bin_index = [&](float x) {
+				int b = (int) ((x - bbox.min[axis]) * scale);
+				return std::min(std::max(b, 0), SBVH_BINS - 1);
+			};
+
+			std::array <SBVHBin, SBVH_BINS> bins;
+			for (const BVHPrimitive &ref : refs) {
+				int first = bin_index(ref.bbox.min[axis]);
+				int last = bin_index(ref.bbox.max[axis]);
+
+				bins[first].entries++;
+				bins[last].exits++;
+
+				if (first == last) {
+					bins[first].bbox.grow(ref.bbox);
+					continue;
+				}
+
+				for (int b = first; b <= last; b++) {
+					float lo = bbox.min[axis] + b * width;
+					float hi = (b == SBVH_BINS - 1) ? bbox.max[axis] : lo + width;
+
+					BBox part = clip(ref, axis, lo, hi);
+					if (!is_empty(part))
+						bins[b].bbox.grow(part);
+				}
+			}
+
+			// Right side bounds and counts, for planes after bin i
+			std::array <BBox, SBVH_BINS> right_box;
+			std::array <int, SBVH_BINS> right_count;
+
+			BBox right = BBox::empty();
+			int count_right = 0;
+			for (int i = SBVH_BINS - 1; i > 0; i--) {
+				right.grow(bins[i].bbox);
+				count_right += bins[i].exits;
+				right_box[i - 1] = right;
+				right_count[i - 1] = count_right;
+			}
+
+			BBox left = BBox::empty();
+			int count_left = 0;
+			for (int i = 0; i < SBVH_BINS - 1; i++) {
+				left.grow(bins[i].bbox);
+				count_left += bins[i].entries;
+
+				// Both children must shrink, as in split_spatial
+				if (count_left == 0 || right_count[i] == 0)
+					continue;
+				if (count_left == count || right_count[i] == count)
+					continue;
+
+				float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST
+					* (count_left * left.surface_area()
+					+ right_count[i] * right_box[i].surface_area()) / sa_total;
+
+				if (cost < split.cost) {
+					split.axis = axis;
+					split.bin = i;
+					split.cost = cost;
+					split.left = left;
+					split.right = right_box[i];
+				}
+			}
+		}
+
+		return split;
+	}
+
+	// Distribute references across a spatial plane; straddling ones are
+	// split, unless moving them wholly to one side is cheaper. Returns
+	// false unless both sides end up with fewer references
+	bool split_spatial(const std::vector <BVHPrimitive> &refs, const BBox &bbox, const SBVHSplit &split,
+			std::vector <BVHPrimitive> &left, std::vector <BVHPrimitive> &right) {
+		int axis = split.axis;
+
+		float extent = bbox.max[axis] - bbox.min[axis];
+		float plane = bbox.min[axis] + (split.bin + 1) * extent / SBVH_BINS;
+
+		auto bin_index = [&](float x) {
+			int b = (int) ((x - bbox.min[axis]) * (SBVH_BINS / extent));
+			return std::min(std::max(b, 0), SBVH_BINS - 1);
+		};
+
+		std::vector <const BVHPrimitive *> straddling;
+
+		for (const BVHPrimitive &ref : refs) {
+			if (bin_index(ref.bbox.max[axis]) <= split.bin)
+				left.push_back(ref);
+			else if (bin_index(ref.bbox.min[axis]) > split.bin)
+				right.push_back(ref);
+			else
+				straddling.push_back(&ref);
+		}
+
+		int count_left = left.size() + straddling.size();
+		int count_right = right.size() + straddling.size();
+
+		for (const BVHPrimitive *ref : straddling) {
+			BBox l = clip(*ref, axis, ref->bbox.min[axis], plane);
+			BBox r = clip(*ref, axis, plane, ref->bbox.max[axis]);
+
+			BBox whole_left = split.left;
+			whole_left.grow(ref->bbox);
+
+			BBox whole_right = split.right;
+			whole_right.grow(ref->bbox);
+
+			// Costs up to the common factors; rounding can also leave
+			// nothing of the triangle on one side
+			float cost_split = split.left.surface_area() * count_left
+				+ split.right.surface_area() * count_right;
+			float cost_left = whole_left.surface_area() * count_left
+				+ split.right.surface_area() * (count_right - 1);
+			float cost_right = split.left.surface_area() * (count_left - 1)
+				+ whole_right.surface_area() * count_right;
+
+			if (is_empty(r) || (!is_empty(l) && cost_left < cost_split && cost_left <= cost_right)) {
+				left.push_back(*ref);
+				count_right--;
+			} else if (is_empty(l) || cost_right < cost_split) {
+				right.push_back(*ref);
+				count_left--;
+			} else {
+				left.push_back(BVHPrimitive(l, ref->id));
+				right.push_back(BVHPrimitive(r, ref->id));
+				references++;
+			}
+		}
+
+		// Both children must shrink, or the recursion would not end
+		int count = refs.size();
+		return !left.empty() && !right.empty()
+			&& (int) left.size() < count && (int) right.size() < count;
+	}
+
+	// Appends the subtree to the tree in pre-order and returns the index
+	// of its root
+	int build(std::vector <BVHPrimitive> &refs, BVH &bvh) {
+		if (refs.size() == 1)
+			return bvh.push(refs[0].bbox, refs[0].id);
+
+		int count = refs.size();
+		BVHSplit object = find_binned_split(refs.data(), count);
+
+		std::vector <BVHPrimitive> left;
+		std::vector <BVHPrimitive> right;
+
+		// Children of the object split, to measure their overlap
+		BBox object_left = BBox::empty();
+		BBox object_right = BBox::empty();
+		if (object.axis != -1) {
+			for (const BVHPrimitive &ref : refs)
+				(object.left(ref.centroid) ? object_left : object_right).grow(ref.bbox);
+		}
+
+		// Spatial splits where the object split leaves much overlap, as
+		// long as the budget lasts
+		bool spatial = false;
+		if (references < limit) {
+			BBox overlap = intersection(object_left, object_right);
+			bool overlapping = object.axis == -1
+				|| (!is_empty(overlap) && overlap.surface_area() > SBVH_OVERLAP * root_area);
+
+			if (overlapping) {
+				SBVHSplit split = find_spatial_split(refs, object.bbox);
+				if (split.axis != -1 && split.cost < object.cost) {
+					int before = references;
+					spatial = split_spatial(refs, object.bbox, split, left, right);
+
+					// Over budget, or a degenerate split; undo it
+					if (!spatial || references > limit) {
+						references = before;
+						spatial = false;
+						left.clear();
+						right.clear();
+					}
+				}
+			}
+		}
+
+		if (!spatial) {
+			if (object.axis != -1) {
+				for (const BVHPrimitive &ref : refs)
+					(object.left(ref.centroid) ? left : right).push_back(ref);
+			} else {
+				// Coincident centroids fall back to an even split
+				int mid = count / 2;
+				left.assign(refs.begin(), refs.begin() + mid);
+				right.assign(refs.begin() + mid, refs.end());
+			}
+		}
+
+		// References of this node are no longer needed
+		std::vector <BVHPrimitive> ().swap(refs);
+
+		int node = bvh.push(object.bbox);
+		int left_node = build(left, bvh);
+		int right_node = build(right, bvh);
+
+		bvh.link(node, left_node, right_node);
+		return node;
+	}
+};
+
+// SBVH build over triangles; prims are their bounds, with ids indexing the
+// triangles
+inline BVH partition_sbvh(std::vector <BVHPrimitive> &prims, const std::vector <SBVHTriangle> &triangles,
+		float budget = SBVH_MEMORY_BUDGET)
+{
+	BVH bvh;
+	if (prims.empty())
+		return bvh;
+
+	SBVHBuilder builder(triangles, budget);
+	builder.root_area = union_of(prims).surface_area();
+
+	bvh.nodes.reserve(2 * budget * prims.size());
+
+	std::vector <BVHPrimitive> refs = prims;
+	builder.build(refs, bvh);
+
+	return bvh;
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef SCENE_CACHE_H_
+#define SCENE_CACHE_H_
+
+// Standard headers
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+// App headers
+#include "bvh.hpp"
+#include "core.hpp"
+#include "leaves.hpp"
+#include "mesh.hpp"
+
+// On-disk cache of a generated tile and its serialized BVH, so startup can
+// map the buffers and upload them as they are. One file per key; the file
+// is a header followed by the sections, each aligned:
+//
+//	header:		magic, version, key, checksum, section offsets and sizes,
+//			build statistics
+//	sections:	vertices, indices, bvh, leaves
+//
+// The key holds everything the buffers depend on. The version changes
+// whenever the generation code or any buffer layout does, and the checksum
+// over the sections catches truncated or corrupted files. Anything that
+// does not match is a miss, and the file is written again.
+
+// Bump whenever generate_tile, a builder, a buffer layout, the key or the
+// header changes
+//	2: blocked BVH layout, build statistics, tile from its own generator
+constexpr uint32_t SCENE_CACHE_VERSION = 2;
+
+constexpr char SCENE_CACHE_MAGIC[4] = { 'T', 'Q', 'S', 'C' };
+
+// Section alignment in the file, a cache line
+constexpr size_t SCENE_CACHE_ALIGNMENT = 64;
+
+constexpr const char *SCENE_CACHE_DIRECTORY = "cache";
+
+enum SceneCacheSection : uint32_t {
+	eCacheVertices,
+	eCacheIndices,
+	eCacheBVH,
+	eCacheLeaves,
+	eCacheSectionCount
+};
+
+// Scene seed and generation parameters, BVH layout included; compared as
+// raw bytes, so every field is a 32 bit integer and there is no padding
+struct SceneCacheKey {
+	uint32_t seed = 0;
+	uint32_t resolution = 0;
+	uint32_t builder = 0;
+	uint32_t width = 2;
+	uint32_t quantized = 0;
+	uint32_t optimize = 0;
+	uint32_t leaf_size = 1;
+	uint32_t blocked = 0;
+
+	bool operator==(const SceneCacheKey &other) const {
+		return memcmp(this, &other, sizeof(SceneCacheKey)) == 0;
+	}
+};
+
+// What building the BVH took, reported again when it is mapped instead
+struct SceneCacheStats {
+	float build_time = 0.0f;	// In milliseconds
+	float optimize_time = 0.0f;
+	float sah_cost = 0.0f;
+};
+
+struct SceneCacheHeader {
+	char magic[4];
+	uint32_t version;
+	SceneCacheKey key;
+	uint64_t checksum;
+	uint64_t offsets[eCacheSectionCount];
+	uint64_t sizes[eCacheSectionCount];	// In bytes
+	SceneCacheStats stats;
+};
+
+// FNV-1a, over the section bytes
+inline uint64_t scene_cache_checksum(const uint8_t *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+{
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+inline size_t scene_cache_align(size_t offset)
+{
+	return (offset + SCENE_CACHE_ALIGNMENT - 1) & ~(SCENE_CACHE_ALIGNMENT - 1);
+}
+
+// File of a key, named after a hash of it
+inline std::string scene_cache_path(const SceneCacheKey &key, const char *directory = SCENE_CACHE_DIRECTORY)
+{
+	uint64_t hash = scene_cache_checksum((const uint8_t *) &key, sizeof(SceneCacheKey));
+
+	char name[64];
+	snprintf(name, sizeof(name), "/tile-%016llx.bin", (unsigned long long) hash);
+	return directory + std::string(name);
+}
+
+// Read-only mapping of a cache file that passed every check; sections are
+// handed out in place
+struct SceneCache {
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+
+	SceneCache() = default;
+	SceneCache(const SceneCache &) = delete;
+	SceneCache &operator=(const SceneCache &) = delete;
+
+	~SceneCache() {
+		close();
+	}
+
+	const SceneCacheHeader &header() const {
+		return *(const SceneCacheHeader *) data;
+	}
+
+	// Section as an array of T
+	template <class T>
+	const T *section(SceneCacheSection s, size_t &count) const {
+		count = header().sizes[s] / sizeof(T);
+		return (const T *) (data + header().offsets[s]);
+	}
+
+	// Copy of a section, for the buffers the CPU side keeps
+	template <class T>
+	void copy(SceneCacheSection s, std::vector <T> &buffer) const {
+		size_t count;
+		const T *items = section <T> (s, count);
+		buffer.assign(items, items + count);
+	}
+
+	void close() {
+		if (data)
+			munmap((void *) data, size);
+
+		data = nullptr;
+		size = 0;
+	}
+
+	// Map the file of a key; false on a miss, leaving nothing mapped
+	bool open(const SceneCacheKey &key, const char *directory = SCENE_CACHE_DIRECTORY) {
+		close();
+
+		int fd = ::open(scene_cache_path(key, directory).c_str(), O_RDONLY);
+		if (fd == -1)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SceneCacheHeader)) {
+			::close(fd);
+			return false;
+		}
+
+		size = st.st_size;
+
+		void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+
+		if (mapped == MAP_FAILED) {
+			size = 0;
+			return false;
+		}
+
+		data = (const uint8_t *) mapped;
+		if (!valid(key)) {
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	bool valid(const SceneCacheKey &key) const {
+		const SceneCacheHeader &h = header();
+		if (memcmp(h.magic, SCENE_CACHE_MAGIC, 4) != 0)
+			return false;
+
+		if (h.version != SCENE_CACHE_VERSION || !(h.key == key))
+			return false;
+
+		uint64_t checksum = scene_cache_checksum(nullptr, 0);
+		for (int s = 0; s < (int) eCacheSectionCount; s++) {
+			uint64_t offset = h.offsets[s];
+			if (offset % SCENE_CACHE_ALIGNMENT != 0)
+				return false;
+			if (offset > size || h.sizes[s] > size - offset)
+				return false;
+
+			checksum = scene_cache_checksum(data + offset, h.sizes[s], checksum);
+		}
+
+		return checksum == h.checksum;
+	}
+};
+
+// Write the buffers of a key; to a temporary file renamed into place, so a
+// reader never maps a partial one
+inline bool write_scene_cache(const SceneCacheKey &key, const SceneCacheStats &stats,
+		const VBuffer &vertices, const IBuffer &indices, const BVHBuffer &bvh, const LeafBuffer &leaves,
+		const char *directory = SCENE_CACHE_DIRECTORY)
+{
+	mkdir(directory, 0755);
+
+	const void *sections[eCacheSectionCount] = {
+		vertices.data(),
+		indices.data(),
+		bvh.data(),
+		leaves.data()
+	};
+
+	SceneCacheHeader header {};
+	memcpy(header.magic, SCENE_CACHE_MAGIC, 4);
+	header.version = SCENE_CACHE_VERSION;
+	header.key = key;
+	header.stats = stats;
+
+	header.sizes[eCacheVertices] = vertices.size() * sizeof(aligned_vec4);
+	header.sizes[eCacheIndices] = indices.size() * sizeof(aligned_uvec4);
+	header.sizes[eCacheBVH] = bvh.size() * sizeof(aligned_vec4);
+	header.sizes[eCacheLeaves] = leaves.size() * sizeof(aligned_vec4);
+
+	header.checksum = scene_cache_checksum(nullptr, 0);
+
+	size_t offset = scene_cache_align(sizeof(SceneCacheHeader));
+	for (int s = 0; s < (int) eCacheSectionCount; s++) {
+		header.offsets[s] = offset;
+		header.checksum = scene_cache_checksum((const uint8_t *) sections[s], header.sizes[s], header.checksum);
+		offset = scene_cache_align(offset + header.sizes[s]);
+	}
+
+	std::string path = scene_cache_path(key, directory);
+	std::string temporary = path + ".tmp";
+
+	FILE *file = fopen(temporary.c_str(), "wb");
+	if (!file)
+		return false;
+
+	static const uint8_t zeros[SCENE_CACHE_ALIGNMENT] = {};
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+	size_t written = sizeof(header);
+	for (int s = 0; s < (int) eCacheSectionCount && ok; s++) {
+		size_t padding = header.offsets[s] - written;
+		ok = fwrite(zeros, 1, padding, file) == padding
+			&& fwrite(sections[s], 1, header.sizes[s], file) == header.sizes[s];
+
+		written = header.offsets[s] + header.sizes[s];
+	}
+
+	ok = (fclose(file) == 0) && ok;
+	if (ok)
+		ok = rename(temporary.c_str(), path.c_str()) == 0;
+
+	if (!ok)
+		remove(temporary.c_str());
+
+	return ok;
+}
+
+#endif
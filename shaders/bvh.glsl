@@ -1,3 +1,13 @@
+// Wide BVH nodes store children in SoA groups of four: min.x, min.y,
+// min.z, max.x, max.y, max.z and child links, one vec4 each
+const int BVH_WIDE_GROUP_SIZE = 7;
+const int BVH_QUANTIZED_GROUP_SIZE = 3;
+const int BVH_STACK_SIZE = 64;
+const int BVH_SHORT_STACK_SIZE = 32;
+
+// Levels of the wide traversal fallback, a single int each
+const int BVH_WIDE_LEVELS = 128;
+
 // Get left and right child of the node
 int object(int node)
 {
@@ -85,3 +95,89 @@ BoundingBox bbox(int node)
 	return BoundingBox(min, max);
 }
 
+
+// Entry times of the ray into four boxes given as SoA bounds; lanes that
+// miss get infinity
+vec4 intersect_boxes(Ray ray, vec3 inv_d, vec4 minx, vec4 miny, vec4 minz,
+		vec4 maxx, vec4 maxy, vec4 maxz)
+{
+	vec4 t0x = (minx - ray.p.x) * inv_d.x;
+	vec4 t0y = (miny - ray.p.y) * inv_d.y;
+	vec4 t0z = (minz - ray.p.z) * inv_d.z;
+	vec4 t1x = (maxx - ray.p.x) * inv_d.x;
+	vec4 t1y = (maxy - ray.p.y) * inv_d.y;
+	vec4 t1z = (maxz - ray.p.z) * inv_d.z;
+
+	vec4 tnear = max(max(min(t0x, t1x), min(t0y, t1y)), min(t0z, t1z));
+	vec4 tfar = min(min(max(t0x, t1x), max(t0y, t1y)), max(t0z, t1z));
+
+	bvec4 miss = bvec4(
+		tnear.x > tfar.x || tfar.x < 0.0,
+		tnear.y > tfar.y || tfar.y < 0.0,
+		tnear.z > tfar.z || tfar.z < 0.0,
+		tnear.w > tfar.w || tfar.w < 0.0
+	);
+
+	return mix(tnear, vec4(1.0/0.0), miss);
+}
+
+// Four children of a wide node
+vec4 intersect_group(Ray ray, vec3 inv_d, int group)
+{
+	return intersect_boxes(ray, inv_d,
+		bvh.data[group + 0], bvh.data[group + 1], bvh.data[group + 2],
+		bvh.data[group + 3], bvh.data[group + 4], bvh.data[group + 5]
+	);
+}
+
+// Unpack one byte per lane
+vec4 unpack_bytes(float word)
+{
+	uvec4 shifts = uvec4(0, 8, 16, 24);
+	return vec4((uvec4(floatBitsToUint(word)) >> shifts) & 0xffu);
+}
+
+// Four children of a quantized wide node; cell sizes are powers of two
+// built straight from the exponent bits
+vec4 intersect_group_quantized(Ray ray, vec3 inv_d, int node, int group)
+{
+	vec4 header = bvh.data[node];
+	uint exponents = floatBitsToUint(header.w);
+
+	vec3 scale = vec3(
+		uintBitsToFloat((exponents & 0xffu) << 23),
+		uintBitsToFloat(((exponents >> 8) & 0xffu) << 23),
+		uintBitsToFloat(((exponents >> 16) & 0xffu) << 23)
+	);
+
+	vec4 q0 = bvh.data[group];
+	vec4 q1 = bvh.data[group + 1];
+
+	return intersect_boxes(ray, inv_d,
+		header.x + unpack_bytes(q0.x) * scale.x,
+		header.y + unpack_bytes(q0.y) * scale.y,
+		header.z + unpack_bytes(q0.z) * scale.z,
+		header.x + unpack_bytes(q0.w) * scale.x,
+		header.y + unpack_bytes(q1.x) * scale.y,
+		header.z + unpack_bytes(q1.y) * scale.z
+	);
+}
+
+// Entry time of the ray into the box of a binary node, negative if it
+// starts inside and infinity on a miss
+float box_time(Ray ray, vec3 inv_d, int node)
+{
+	vec3 t0 = (bvh.data[node + 1].xyz - ray.p) * inv_d;
+	vec3 t1 = (bvh.data[node + 2].xyz - ray.p) * inv_d;
+
+	vec3 tmin = min(t0, t1);
+	vec3 tmax = max(t0, t1);
+
+	float tnear = max(max(tmin.x, tmin.y), tmin.z);
+	float tfar = min(min(tmax.x, tmax.y), tmax.z);
+
+	if (tnear > tfar || tfar < 0.0)
+		return 1.0/0.0;
+
+	return tnear;
+}
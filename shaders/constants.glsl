@@ -31,3 +31,12 @@ vec2 terrain_uv(vec2 xz)
 {
 	return (xz - vec2(xmin, zmin)) / vec2(terrain_size);
 }
+
+// Cloud texture uv
+vec2 cloud_uv(vec2 uv)
+{
+	if (cloud_atlas == 0)
+		return uv;
+
+	return uv * cloud_atlas_scale + cloud_scroll;
+}
@@ -16,6 +16,30 @@ layout (std430, binding = 3) buffer BVH {
 	vec4 data[];
 } bvh;
 
+// Inverse transform rows and BLAS root of each instance
+layout (std430, binding = 4) buffer Instances {
+	vec4 data[];
+} instances;
+
+// Inlined triangles of clustered leaves, 3 vec4 each
+layout (std430, binding = 5) buffer LeafTriangles {
+	vec4 data[];
+} leaf_triangles;
+
+// Unit triangle transform of each triangle, 3 vec4 rows, see mesh.hpp
+layout (std430, binding = 6) buffer TriangleRecords {
+	vec4 data[];
+} triangle_records;
+
+// Packed vertices and indices, 32-bit words laid out as in mesh.hpp
+layout (std430, binding = 7) buffer PackedVertices {
+	uint data[];
+} packed_vertices;
+
+layout (std430, binding = 8) buffer PackedTriangles {
+	uint data[];
+} packed_triangles;
+
 layout (binding = 0) uniform sampler2D s_heightmap;
 layout (binding = 1) uniform sampler2D s_heightmap_normal;
 
@@ -45,6 +69,12 @@ uniform float ray_shadow_step;
 uniform float terrain_size;
 
 uniform int clouds;
+
+// Sample the tileable cloud atlas, scaled and scrolled, instead of the
+// density regenerated on the CPU
+uniform int cloud_atlas;
+uniform float cloud_atlas_scale;
+uniform vec2 cloud_scroll;
 uniform int grass;
 uniform int grass_blades;
 uniform int grass_density;
@@ -53,6 +83,33 @@ uniform int grass_power;
 uniform int normals;
 uniform int primitives;
 
+// 2 for the threaded binary BVH, 4 or 8 for wide BVHs
+uniform int bvh_width;
+uniform int bvh_quantized;
+uniform int bvh_ordered;
+
+// Binary BVH leaves hold several inlined triangles, see leaves.hpp
+uniform int bvh_leaves;
+
+// Intersect through triangle records instead of the index buffer
+uniform int records;
+
+// Intersect through the packed buffers, with 16-bit quantized positions
+// if vertex_quantized and indices of 32, 24 or 16 bits
+uniform int packed_mesh;
+uniform int vertex_quantized;
+uniform int index_bits;
+uniform vec3 vertex_origin;
+uniform vec3 vertex_scale;
+
+// Number of instances, 0 when the BVH is over a flat mesh
+uniform int instance_count;
+
+// Terrain as triangles in the BVH, from terrain_first on, instead of
+// marching the height map
+uniform int terrain_mesh;
+uniform int terrain_first;
+
 uniform int wind_map;
 
 // uniform vec2 wind_offset;
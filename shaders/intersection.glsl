@@ -13,8 +13,107 @@ Intersection _intersect(Ray r, Triangle tri)
 	return Intersection(t, p, normalize(n), 0, vec3(0.5), ePillar);
 }
 
+// Ray-triangle intersection through the precomputed record of triangle
+// i: the ray is moved into unit triangle space, where it hits at z = 0.
+// The third row is along the normal, so nothing else is fetched
+Intersection intersect_record(Ray r, int i)
+{
+	vec4 x = triangle_records.data[3 * i];
+	vec4 y = triangle_records.data[3 * i + 1];
+	vec4 z = triangle_records.data[3 * i + 2];
+
+	float t = -(dot(z.xyz, r.p) + z.w) / dot(z.xyz, r.d);
+	if (!(t >= 0.0))
+		return def_it();
+
+	vec3 p = r.p + r.d * t;
+
+	float u = dot(x.xyz, p) + x.w;
+	if (u < 0.0 || u > 1.0)
+		return def_it();
+
+	float v = dot(y.xyz, p) + y.w;
+	if (v < 0.0 || u + v > 1.0)
+		return def_it();
+
+	vec3 n = -z.xyz;
+	if (dot(n, vec3(1, 0, 0)) > 0.0)
+		n = -n;
+
+	return Intersection(t, p, normalize(n), 0, vec3(0.5), ePillar);
+}
+
+// Terrain triangles are shaded as the marched height map
+Intersection shade_primitive(Intersection it, int i)
+{
+	if (it.id == -1 || terrain_mesh == 0 || i < terrain_first)
+		return it;
+
+	it.shading = eGrass;
+	it.Kd = vec3(0.5, 1, 0.5);
+	if (it.n.y < 0.0)
+		it.n = -it.n;
+
+	return it;
+}
+
+// Vertex i of the packed buffer
+vec3 packed_vertex(uint i)
+{
+	if (vertex_quantized == 0) {
+		return uintBitsToFloat(uvec3(
+			packed_vertices.data[3 * i],
+			packed_vertices.data[3 * i + 1],
+			packed_vertices.data[3 * i + 2]
+		));
+	}
+
+	uint xy = packed_vertices.data[2 * i];
+	uint z = packed_vertices.data[2 * i + 1];
+	return vertex_origin + vertex_scale * vec3(xy & 0xffffu, xy >> 16, z & 0xffffu);
+}
+
+// Vertex indices of triangle i of the packed buffer
+uvec3 packed_triangle(int i)
+{
+	if (index_bits == 16) {
+		uint ab = packed_triangles.data[2 * i];
+		uint c = packed_triangles.data[2 * i + 1];
+		return uvec3(ab & 0xffffu, ab >> 16, c & 0xffffu);
+	}
+
+	if (index_bits == 24) {
+		return uvec3(
+			packed_triangles.data[3 * i] & 0xffffffu,
+			packed_triangles.data[3 * i + 1],
+			packed_triangles.data[3 * i + 2]
+		);
+	}
+
+	return uvec3(
+		packed_triangles.data[4 * i],
+		packed_triangles.data[4 * i + 1],
+		packed_triangles.data[4 * i + 2]
+	);
+}
+
 Intersection intersect(Ray r, int i)
 {
+	if (records == 1)
+		return shade_primitive(intersect_record(r, i), i);
+
+	if (packed_mesh == 1) {
+		uvec3 tri = packed_triangle(i);
+
+		Triangle t = Triangle(
+			packed_vertex(tri.x),
+			packed_vertex(tri.y),
+			packed_vertex(tri.z)
+		);
+
+		return shade_primitive(_intersect(r, t), i);
+	}
+
 	uvec4 tri = triangles.data[i];
 	uint a = tri.x;
 	uint b = tri.y;
@@ -26,7 +125,38 @@ Intersection intersect(Ray r, int i)
 		vertices.data[c].xyz
 	);
 
-	return _intersect(r, t);
+	return shade_primitive(_intersect(r, t), i);
+}
+
+// Intersect the primitives of a binary BVH leaf, keeping the closest hit;
+// clustered leaves have their first triangle and count in the header
+void intersect_leaf(Ray r, int node, inout Intersection mini)
+{
+	if (bvh_leaves == 0) {
+		Intersection it = intersect(r, object(node));
+		if (it.id != -1 && it.t < mini.t)
+			mini = it;
+
+		return;
+	}
+
+	int first = object(node);
+	int count = floatBitsToInt(bvh.data[node].w);
+
+	for (int i = 0; i < count; i++) {
+		int base = 3 * (first + i);
+
+		Triangle t = Triangle(
+			leaf_triangles.data[base].xyz,
+			leaf_triangles.data[base + 1].xyz,
+			leaf_triangles.data[base + 2].xyz
+		);
+
+		int index = floatBitsToInt(leaf_triangles.data[base].w);
+		Intersection it = shade_primitive(_intersect(r, t), index);
+		if (it.id != -1 && it.t < mini.t)
+			mini = it;
+	}
 }
 
 // Ray-quad intersection
@@ -263,6 +393,274 @@ Intersection intersect_water(Ray r)
 	return it;
 }
 
+// Traverse BVH as a threaded binary tree, from the given root
+void trace_threaded(Ray ray, int root, inout Intersection mini)
+{
+	int node = root;
+	while (node != -1) {
+		if (object(node) != -1) {
+			// Intersect the leaf, keeping the minimum
+			intersect_leaf(ray, node, mini);
+
+			// Go to next node (same as miss)
+			node = miss(node);
+		} else {
+			// Get bounding box
+			BoundingBox box = bbox(node);
+
+			// Check if ray intersects (or is inside)
+			// the bounding box
+			float t = intersect_box(ray, box);
+			bool inside = in_box(ray.p, box);
+
+			if ((t > 0.0 && t < mini.t) || inside)
+				node = hit(node);
+			else
+				node = miss(node);
+		}
+	}
+}
+
+// Traverse a two level BVH: the TLAS at the start of the buffer has
+// instances as leaves, and the ray walks the BLAS of each instance it
+// reaches in object space. The direction is not renormalized, so hit times
+// carry over; hits are moved back to world space
+void trace_instances(Ray ray, inout Intersection mini)
+{
+	vec3 inv_d = 1.0 / ray.d;
+
+	int node = 0;
+	while (node != -1) {
+		int instance = object(node);
+		if (instance != -1) {
+			vec4 r0 = instances.data[4 * instance];
+			vec4 r1 = instances.data[4 * instance + 1];
+			vec4 r2 = instances.data[4 * instance + 2];
+			int root = floatBitsToInt(instances.data[4 * instance + 3].x);
+
+			Ray local = Ray(
+				vec3(dot(r0.xyz, ray.p) + r0.w, dot(r1.xyz, ray.p) + r1.w, dot(r2.xyz, ray.p) + r2.w),
+				vec3(dot(r0.xyz, ray.d), dot(r1.xyz, ray.d), dot(r2.xyz, ray.d))
+			);
+
+			Intersection it = def_it();
+			it.t = mini.t;
+			trace_threaded(local, root, it);
+
+			if (it.id != -1 && it.t < mini.t) {
+				// Normals go through the inverse transpose
+				vec3 n = normalize(r0.xyz * it.n.x + r1.xyz * it.n.y + r2.xyz * it.n.z);
+				if (dot(n, vec3(1, 0, 0)) > 0.0)
+					n = -n;
+
+				it.p = ray.p + ray.d * it.t;
+				it.n = n;
+				mini = it;
+			}
+
+			node = miss(node);
+		} else {
+			float t = box_time(ray, inv_d, node);
+			if (t < mini.t)
+				node = hit(node);
+			else
+				node = miss(node);
+		}
+	}
+}
+
+// Traverse the binary BVH nearer child first: both child boxes are tested
+// at the parent, the right child being the miss link of the left one, and
+// the far child is pushed with its entry time so it can be skipped once a
+// closer hit is found. If the short stack overflows, the threaded traversal
+// finishes the job with the hit found so far
+void trace_ordered(Ray ray, inout Intersection mini)
+{
+	vec3 inv_d = 1.0 / ray.d;
+
+	int stack_node[BVH_SHORT_STACK_SIZE];
+	float stack_t[BVH_SHORT_STACK_SIZE];
+	int top = 0;
+	bool overflow = false;
+
+	int node = 0;
+	float t = box_time(ray, inv_d, 0);
+
+	while (true) {
+		if (t < mini.t) {
+			if (object(node) != -1) {
+				intersect_leaf(ray, node, mini);
+			} else {
+				int near_child = hit(node);
+				int far_child = miss(near_child);
+
+				float t_near = box_time(ray, inv_d, near_child);
+				float t_far = box_time(ray, inv_d, far_child);
+
+				if (t_far < t_near) {
+					int tmp = near_child;
+					near_child = far_child;
+					far_child = tmp;
+
+					float tmp_t = t_near;
+					t_near = t_far;
+					t_far = tmp_t;
+				}
+
+				if (t_near < mini.t) {
+					if (t_far < mini.t) {
+						if (top < BVH_SHORT_STACK_SIZE) {
+							stack_node[top] = far_child;
+							stack_t[top] = t_far;
+							top++;
+						} else {
+							overflow = true;
+						}
+					}
+
+					node = near_child;
+					t = t_near;
+					continue;
+				}
+			}
+		}
+
+		if (top == 0)
+			break;
+
+		top--;
+		node = stack_node[top];
+		t = stack_t[top];
+	}
+
+	if (overflow)
+		trace_threaded(ray, 0, mini);
+}
+
+// Child group of a wide node, box times and links
+void wide_group(Ray ray, vec3 inv_d, int node, int g, out vec4 times4, out ivec4 links4)
+{
+	if (bvh_quantized == 1) {
+		int group = node + 1 + BVH_QUANTIZED_GROUP_SIZE * g;
+		times4 = intersect_group_quantized(ray, inv_d, node, group);
+		links4 = floatBitsToInt(bvh.data[group + 2]);
+	} else {
+		int group = node + BVH_WIDE_GROUP_SIZE * g;
+		times4 = intersect_group(ray, inv_d, group);
+		links4 = floatBitsToInt(bvh.data[group + 6]);
+	}
+}
+
+// Traverse a wide BVH in child order, keeping only the node and next
+// child of each level, packed as node * 8 + child, so the stack grows with
+// the depth alone; the fallback of trace_wide when its stack overflows
+void trace_wide_levels(Ray ray, inout Intersection mini)
+{
+	vec3 inv_d = 1.0 / ray.d;
+
+	int levels[BVH_WIDE_LEVELS];
+	int level = 0;
+
+	levels[0] = 0;
+	while (level >= 0) {
+		int node = levels[level] >> 3;
+		int i = levels[level] & 7;
+		if (i == bvh_width - 1)
+			level--;
+		else
+			levels[level]++;
+
+		vec4 times4;
+		ivec4 links4;
+		wide_group(ray, inv_d, node, i / 4, times4, links4);
+
+		int link = links4[i % 4];
+		if (link == -1 || times4[i % 4] >= mini.t)
+			continue;
+
+		// Leaves hold -(primitive + 2)
+		if (link < -1) {
+			Intersection it = intersect(ray, -link - 2);
+			if (it.id != -1 && it.t < mini.t)
+				mini = it;
+
+			continue;
+		}
+
+		// Deeper than any collapsed tree gets
+		if (level + 1 == BVH_WIDE_LEVELS)
+			continue;
+
+		level++;
+		levels[level] = link << 3;
+	}
+}
+
+// Traverse a wide BVH; children that are hit are pushed far to near, so
+// the nearest one is visited first. Children that do not fit on the stack
+// are covered by walking again level by level
+void trace_wide(Ray ray, inout Intersection mini)
+{
+	vec3 inv_d = 1.0 / ray.d;
+
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	bool overflow = false;
+
+	stack[top++] = 0;
+	while (top > 0) {
+		int node = stack[--top];
+
+		int links[8];
+		float times[8];
+		int count = 0;
+
+		for (int g = 0; g < bvh_width / 4; g++) {
+			vec4 times4;
+			ivec4 links4;
+			wide_group(ray, inv_d, node, g, times4, links4);
+
+			for (int i = 0; i < 4; i++) {
+				int link = links4[i];
+				float t = times4[i];
+
+				if (link == -1 || t >= mini.t)
+					continue;
+
+				// Leaves hold -(primitive + 2)
+				if (link < -1) {
+					Intersection it = intersect(ray, -link - 2);
+					if (it.id != -1 && it.t < mini.t)
+						mini = it;
+
+					continue;
+				}
+
+				// Insertion sort, farthest first
+				int j = count++;
+				for (; j > 0 && times[j - 1] < t; j--) {
+					links[j] = links[j - 1];
+					times[j] = times[j - 1];
+				}
+
+				links[j] = link;
+				times[j] = t;
+			}
+		}
+
+		// Farthest first, so on overflow the nearest ones stay
+		int skip = max(count - (BVH_STACK_SIZE - top), 0);
+		if (skip > 0)
+			overflow = true;
+
+		for (int i = skip; i < count; i++)
+			stack[top++] = links[i];
+	}
+
+	if (overflow)
+		trace_wide_levels(ray, mini);
+}
+
 // Whole scene intersection
 // TODO: bool porameter for shadowing or not
 Intersection trace(Ray ray, bool shadow)
@@ -277,7 +675,11 @@ Intersection trace(Ray ray, bool shadow)
 
 	// "Min" intersection
 	// TODO: configs for self shadowing?
-	Intersection mini = intersect_heightmap(ray);
+	Intersection mini = def_it();
+
+	// A terrain mesh is traced with the rest of the primitives
+	if (terrain_mesh == 0)
+		mini = intersect_heightmap(ray);
 
 	bool heightmap = true;
 
@@ -306,37 +708,14 @@ Intersection trace(Ray ray, bool shadow)
 	if (primitives == 0)
 		return mini;
 
-	// Traverse BVH as a threaded binary tree
-	int node = 0;
-	while (node != -1) {
-		if (object(node) != -1) {
-			// Get object index
-			int index = object(node);
-
-			// Get object
-			Intersection it = intersect(ray, index);
-
-			// If intersection is valid, update minimum
-			if (it.id != -1 && it.t < mini.t)
-				mini = it;
-
-			// Go to next node (same as miss)
-			node = miss(node);
-		} else {
-			// Get bounding box
-			BoundingBox box = bbox(node);
-
-			// Check if ray intersects (or is inside)
-			// the bounding box
-			float t = intersect_box(ray, box);
-			bool inside = in_box(ray.p, box);
-
-			if ((t > 0.0 && t < mini.t) || inside)
-				node = hit(node);
-			else
-				node = miss(node);
-		}
-	}
+	if (instance_count > 0)
+		trace_instances(ray, mini);
+	else if (bvh_width != 2)
+		trace_wide(ray, mini);
+	else if (bvh_ordered == 1)
+		trace_ordered(ray, mini);
+	else
+		trace_threaded(ray, 0, mini);
 
 	// Return intersection
 	return mini;
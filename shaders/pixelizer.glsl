@@ -47,7 +47,7 @@ void main()
 				if (t > 0 && x > xmin && x < xmax && z > zmin && z < zmax) {
 					// TODO: function to get terrain uv coordinate
 					vec2 uv = terrain_uv(vec2(x, z));
-					float cloud = texture(s_clouds, uv).x;
+					float cloud = texture(s_clouds, cloud_uv(uv)).x;
 
 					if (cloud > 0.2f) {
 						vec4 c = vec4(0.3, 0.3, 0.3, 1.0);
@@ -52,7 +52,7 @@ vec3 shade(Intersection it)
 	vec3 p = it.p;
 	if (p.x > xmin && p.x < xmax && p.z > zmin && p.z < zmax) {
 		vec2 uv = terrain_uv(vec2(p.x, p.z));
-		cloud_density = texture(s_clouds, uv).r;
+		cloud_density = texture(s_clouds, cloud_uv(uv)).r;
 	}
 
 	float kcloud = 1.0f;
@@ -0,0 +1,200 @@
+#ifndef SIMULATION_H_
+#define SIMULATION_H_
+
+// Standard headers
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+
+// Lock-free triple buffer between one writer and one reader: the writer
+// fills its back slot and swaps it into the middle, the reader swaps the
+// middle out for its front slot when a newer one is there. Neither side
+// ever waits on the other; unread slots are simply written over
+template <class T>
+class TripleBuffer {
+	static constexpr int FRESH = 4;
+
+	T slots[3];
+
+	// Middle slot, with FRESH set when it has not been read yet
+	std::atomic <int> middle {1};
+
+	int back = 0;
+	int front = 2;
+public:
+	// Slot the writer fills next
+	T &write() {
+		return slots[back];
+	}
+
+	void publish() {
+		back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+	}
+
+	// Latest published slot, nullptr if there is nothing newer than the
+	// last one read; valid until the next call
+	const T *read() {
+		if (!(middle.load(std::memory_order_relaxed) & FRESH))
+			return nullptr;
+
+		front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+		return &slots[front];
+	}
+};
+
+// Everything one simulation step hands to the render thread
+struct SimulationFrame {
+	uint64_t tick = 0;
+
+	// Cloud densities, empty when the atlas is scrolled instead
+	std::vector <uint8_t> clouds;
+	glm::vec2 cloud_scroll {0, 0};
+
+	std::vector <glm::vec3> wind;
+	glm::vec2 wind_offset {0, 0};
+
+	glm::vec2 water_offset {0, 0};
+	glm::vec3 light_dir {0, 1, 0};
+};
+
+// Clouds, wind and sun stepped on their own thread every tick; the render
+// thread picks up the latest finished frame and uploads it
+class Simulation {
+	const HeightMap &heightmap;
+
+	PerlinBatch cloud_batch;
+	int cloud_resolution;
+	float cloud_frequency;
+	int cloud_period;
+
+	TripleBuffer <SimulationFrame> frames;
+	std::vector <float> cloud_data;
+
+	// State carried from step to step, only touched by the thread
+	glm::vec2 cloud_offset {0, 0};
+	glm::vec2 wind_velocity {0, 0};
+	glm::vec2 wind_acceleration {0, 0};
+	glm::vec2 water_offset {0, 0};
+	float theta_a = 0;
+	float sun_time = 0;
+	uint64_t tick = 0;
+
+	// Own generator, rand() is left to the render thread
+	std::mt19937 rng;
+
+	// Own pool for the fields, so waits on the render side never end up
+	// running noise tasks
+	ThreadPool pool;
+
+	std::atomic <bool> stop {false};
+	std::thread thread;
+
+	void step(float dt, SimulationFrame &frame) {
+		frame.tick = ++tick;
+
+		// Clouds, on the CPU only without the atlas
+		cloud_offset += 0.005f;
+		frame.cloud_scroll = glm::fract(cloud_offset/float(cloud_period));
+
+		if (cloud_atlas) {
+			frame.clouds.clear();
+		} else {
+			const double f = (cloud_frequency/cloud_resolution);
+			cloud_batch.octave2D_01(cloud_offset.x, cloud_offset.y, f, f,
+				cloud_resolution, cloud_resolution, 16, cloud_data.data(), 0.5, &pool);
+
+			frame.clouds.resize(cloud_data.size());
+			for (size_t i = 0; i < cloud_data.size(); i++)
+				frame.clouds[i] = (uint8_t) (cloud_data[i] * 250.0f + 1);
+		}
+
+		// Water offset
+		water_offset += 0.5f * glm::normalize(glm::vec2 {randf(rng), randf(rng)}) * dt;
+		frame.water_offset = water_offset;
+
+		// Wind map
+		float theta = randf(rng, -1, 1) * glm::pi <float> ();
+		theta_a = lerp(theta_a, theta, 0.2f);
+
+		wind_acceleration += 0.5f * glm::vec2 {glm::cos(theta_a), glm::sin(theta_a)};
+		wind_acceleration = glm::clamp(wind_acceleration, -0.5f, 0.5f);
+
+		wind_velocity += wind_acceleration * dt * 25.0f;
+		frame.wind_offset = wind_velocity;
+
+		int wind_res = heightmap.wind_resolution();
+		frame.wind.resize(wind_res * wind_res);
+		heightmap.wind_field(frame.wind.data(), wind_velocity.x, wind_velocity.y, &pool);
+
+		// Sun direction, should lie on the x = z plane
+		float y = glm::sin(sun_time);
+		float x = glm::cos(sun_time);
+
+		frame.light_dir = glm::normalize(glm::vec3 {x, y, x});
+		sun_time = std::fmod(sun_time + dt/25.0f, 2 * glm::pi <float> ());
+	}
+
+	void run() {
+		using clock = std::chrono::steady_clock;
+
+		auto last = clock::now();
+		auto next = last;
+		while (!stop) {
+			next += tick_interval;
+			std::this_thread::sleep_until(next);
+
+			auto now = clock::now();
+			float dt = std::chrono::duration <float> (now - last).count();
+			last = now;
+
+			// Fell behind, e.g. after a stall; start counting again
+			if (next < now)
+				next = now;
+
+			if (paused)
+				continue;
+
+			step(dt, frames.write());
+			frames.publish();
+		}
+	}
+public:
+	static constexpr std::chrono::milliseconds tick_interval {10};
+
+	// Settings from the render thread
+	std::atomic <bool> paused {false};
+	std::atomic <bool> cloud_atlas {true};
+
+	Simulation(const HeightMap &heightmap_, const siv::PerlinNoise &cloud_noise,
+			int cloud_resolution_, float cloud_frequency_, int cloud_period_,
+			int threads = std::max((int) std::thread::hardware_concurrency() / 4, 1))
+			: heightmap(heightmap_),
+			cloud_batch(cloud_noise),
+			cloud_resolution(cloud_resolution_),
+			cloud_frequency(cloud_frequency_),
+			cloud_period(cloud_period_),
+			cloud_data(cloud_resolution_ * cloud_resolution_),
+			rng(std::random_device {}()),
+			pool(threads) {
+		thread = std::thread(&Simulation::run, this);
+	}
+
+	~Simulation() {
+		stop = true;
+		thread.join();
+	}
+
+	Simulation(const Simulation &) = delete;
+	Simulation &operator=(const Simulation &) = delete;
+
+	// Latest finished frame, nullptr if there is none since the last call
+	const SimulationFrame *latest() {
+		return frames.read();
+	}
+};
+
+#endif
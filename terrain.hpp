@@ -0,0 +1,291 @@
+#ifndef TERRAIN_H_
+#define TERRAIN_H_
+
+// Standard headers
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// App headers
+#include "core.hpp"
+#include "mesh.hpp"
+#include "traversal.hpp"
+
+// Adaptive triangle meshes of a height field, so the terrain can go
+// through the BVH with exact hits instead of being marched in fixed steps.
+// Heights are sampled on a grid of 2^k + 1 points a side and meshed as a
+// right triangulated irregular network (RTIN, as in Martini): the square
+// is split into right triangles along their hypotenuse, recursively, and a
+// triangle is only split when a sample inside it is further than the error
+// bound from its plane.
+//
+// Errors are kept at the hypotenuse midpoints and include those of every
+// triangle below, on both sides of the hypotenuse, so both sides make the
+// same choice and the mesh has no cracks. Every grid sample is within the
+// bound of the mesh surface.
+
+// Default vertical error bound, in world units
+constexpr float TERRAIN_MESH_ERROR = 0.02f;
+
+// Height samples over a square centered at the origin
+struct TerrainGrid {
+	int size = 0;			// Samples a side, 2^k + 1
+	float extent = 0.0f;		// World size a side
+	std::vector <float> heights;	// Rows along z
+
+	float height(int x, int z) const {
+		return heights[z * size + x];
+	}
+
+	glm::vec3 position(int x, int z) const {
+		float cell = extent / (size - 1);
+		return glm::vec3 {
+			x * cell - extent / 2.0f,
+			height(x, z),
+			z * cell - extent / 2.0f
+		};
+	}
+
+	// Bilinear between samples, clamped to the grid
+	float height(float x, float z) const {
+		float cell = extent / (size - 1);
+		float u = glm::clamp((x + extent / 2.0f) / cell, 0.0f, size - 1.0f);
+		float v = glm::clamp((z + extent / 2.0f) / cell, 0.0f, size - 1.0f);
+
+		int x0 = std::min((int) u, size - 2);
+		int z0 = std::min((int) v, size - 2);
+
+		float xf = u - x0;
+		float zf = v - z0;
+
+		float h0 = height(x0, z0) + (height(x0 + 1, z0) - height(x0, z0)) * xf;
+		float h1 = height(x0, z0 + 1) + (height(x0 + 1, z0 + 1) - height(x0, z0 + 1)) * xf;
+		return h0 + (h1 - h0) * zf;
+	}
+};
+
+// Sample a height function f(x, z) on a grid of at least cells cells a
+// side, rounded up to a power of two
+template <class F>
+TerrainGrid sample_terrain(F &&f, int cells, float extent)
+{
+	int tiles = 1;
+	while (tiles < cells)
+		tiles *= 2;
+
+	TerrainGrid grid;
+	grid.size = tiles + 1;
+	grid.extent = extent;
+	grid.heights.resize(grid.size * grid.size);
+
+	float cell = extent / tiles;
+	for (int z = 0; z < grid.size; z++) {
+		for (int x = 0; x < grid.size; x++)
+			grid.heights[z * grid.size + x] = f(x * cell - extent / 2.0f, z * cell - extent / 2.0f);
+	}
+
+	return grid;
+}
+
+// Errors of a grid, computed once, then meshes for any bound
+class TerrainMesher {
+	const TerrainGrid &grid;
+
+	// Error of splitting at each sample, the midpoint of a hypotenuse
+	std::vector <float> errors;
+
+	// Corners a and b (the hypotenuse) of every triangle of the
+	// hierarchy, in breadth first order
+	std::vector <uint16_t> coords;
+	int parents = 0;
+
+	void make_coords() {
+		int tiles = grid.size - 1;
+		int count = 2 * tiles * tiles - 2;
+
+		parents = count - tiles * tiles;
+		coords.resize(4 * count);
+
+		// Walk down from the two halves of the square by the bits of
+		// the triangle id, the lowest one picking a half
+		for (int i = 0; i < count; i++) {
+			int id = i + 2;
+			int ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+
+			if (id & 1) {
+				bx = by = cx = tiles;
+			} else {
+				ax = ay = cy = tiles;
+			}
+
+			while ((id >>= 1) > 1) {
+				int mx = (ax + bx) >> 1;
+				int my = (ay + by) >> 1;
+
+				if (id & 1) {
+					bx = ax;
+					by = ay;
+					ax = cx;
+					ay = cy;
+				} else {
+					ax = bx;
+					ay = by;
+					bx = cx;
+					by = cy;
+				}
+
+				cx = mx;
+				cy = my;
+			}
+
+			coords[4 * i] = ax;
+			coords[4 * i + 1] = ay;
+			coords[4 * i + 2] = bx;
+			coords[4 * i + 3] = by;
+		}
+	}
+
+	// Largest vertical distance from the plane of a triangle to the
+	// samples inside it, with exact integer barycentrics
+	float plane_error(int ax, int ay, int bx, int by, int cx, int cy) const {
+		int area = (bx - ax) * (cy - ay) - (cx - ax) * (by - ay);
+		float ha = grid.height(ax, ay);
+		float hb = grid.height(bx, by);
+		float hc = grid.height(cx, cy);
+
+		float error = 0.0f;
+		for (int y = std::min({ ay, by, cy }); y <= std::max({ ay, by, cy }); y++) {
+			for (int x = std::min({ ax, bx, cx }); x <= std::max({ ax, bx, cx }); x++) {
+				int wa = (bx - x) * (cy - y) - (cx - x) * (by - y);
+				int wb = (cx - x) * (ay - y) - (ax - x) * (cy - y);
+				int wc = area - wa - wb;
+
+				bool inside = area > 0 ? (wa >= 0 && wb >= 0 && wc >= 0) : (wa <= 0 && wb <= 0 && wc <= 0);
+				if (!inside)
+					continue;
+
+				float h = (wa * ha + wb * hb + wc * hc) / area;
+				error = std::max(error, std::abs(h - grid.height(x, y)));
+			}
+		}
+
+		return error;
+	}
+
+	// Smallest triangles first, so the errors of children are final
+	// before their parents read them
+	void make_errors() {
+		int size = grid.size;
+		errors.assign(size * size, 0.0f);
+
+		for (int i = coords.size() / 4 - 1; i >= 0; i--) {
+			int ax = coords[4 * i];
+			int ay = coords[4 * i + 1];
+			int bx = coords[4 * i + 2];
+			int by = coords[4 * i + 3];
+
+			int mx = (ax + bx) >> 1;
+			int my = (ay + by) >> 1;
+			int cx = mx + my - ay;
+			int cy = my + ax - mx;
+
+			int middle = my * size + mx;
+			float error = plane_error(ax, ay, bx, by, cx, cy);
+			errors[middle] = std::max(errors[middle], error);
+
+			if (i < parents) {
+				int left = ((ay + cy) >> 1) * size + ((ax + cx) >> 1);
+				int right = ((by + cy) >> 1) * size + ((bx + cx) >> 1);
+				errors[middle] = std::max({ errors[middle], errors[left], errors[right] });
+			}
+		}
+	}
+public:
+	TerrainMesher(const TerrainGrid &grid_) : grid(grid_) {
+		make_coords();
+		make_errors();
+	}
+
+	// Mesh within max_error of every sample, as triangles of one shade
+	Mesh build(float max_error, Shades shade = Shades::eGrass) const {
+		int size = grid.size;
+		int tiles = size - 1;
+
+		Mesh mesh;
+		std::vector <int> indices(size * size, -1);
+
+		auto vertex = [&](int x, int z) -> uint32_t {
+			int &index = indices[z * size + x];
+			if (index == -1) {
+				index = mesh.vertices.size();
+				mesh.vertices.push_back(Vertex {grid.position(x, z)});
+			}
+
+			return index;
+		};
+
+		auto split = [&](auto &&self, int ax, int ay, int bx, int by, int cx, int cy) -> void {
+			int mx = (ax + bx) >> 1;
+			int my = (ay + by) >> 1;
+
+			if (std::abs(ax - cx) + std::abs(ay - cy) > 1 && errors[my * size + mx] > max_error) {
+				self(self, cx, cy, ax, ay, mx, my);
+				self(self, bx, by, cx, cy, mx, my);
+				return;
+			}
+
+			mesh.triangles.emplace_back(vertex(ax, ay), vertex(bx, by), vertex(cx, cy), shade);
+		};
+
+		split(split, 0, 0, tiles, tiles, tiles, 0);
+		split(split, tiles, tiles, 0, 0, 0, tiles);
+
+		return mesh;
+	}
+};
+
+// Fixed step march of a height field, as intersect_heightmap does in the
+// shader for rays from above: step until the ray is below the surface and
+// interpolate between the last two steps. For comparing the cost and the
+// accuracy of marching against exact triangle hits
+inline float march_terrain(const TerrainGrid &grid, const Ray &ray, float step, int &steps)
+{
+	float half = grid.extent / 2.0f;
+
+	float t1 = (-half - ray.p.x) / ray.d.x;
+	float t2 = (half - ray.p.x) / ray.d.x;
+	float t3 = (-half - ray.p.z) / ray.d.z;
+	float t4 = (half - ray.p.z) / ray.d.z;
+
+	float tmin = std::max(std::min(t1, t2), std::min(t3, t4));
+	float tmax = std::min(std::max(t1, t2), std::max(t3, t4));
+	tmin = std::max(tmin, 0.0f);
+
+	float miss = std::numeric_limits <float> ::infinity();
+	if (tmax < tmin)
+		return miss;
+
+	float last_height = 0.0f;
+	float last_y = 0.0f;
+
+	for (float t = tmin; t < tmax; t += step) {
+		glm::vec3 p = ray.p + ray.d * t;
+		float y = grid.height(p.x, p.z);
+		steps++;
+
+		if (y >= p.y) {
+			if (t == tmin)
+				return t;
+
+			return t + step * (last_height - last_y) / (p.y - last_y - y + last_height) - step;
+		}
+
+		last_y = p.y;
+		last_height = y;
+	}
+
+	return miss;
+}
+
+#endif
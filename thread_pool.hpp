@@ -0,0 +1,221 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+// Standard headers
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work stealing thread pool; each worker owns a deque, pops its own tasks
+// from the back and steals from the front of the others
+class ThreadPool {
+public:
+	using Task = std::function <void ()>;
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque <Task> tasks;
+	};
+
+	std::vector <std::unique_ptr <Queue>> queues;
+	std::vector <std::thread> workers;
+
+	// Sleeping when there is nothing to do
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::atomic <int> queued {0};
+	bool stop = false;
+
+	// Index of the calling worker in this pool, -1 otherwise
+	int worker_index() const {
+		return current() == this ? index() : -1;
+	}
+
+	static const ThreadPool *&current() {
+		static thread_local const ThreadPool *pool = nullptr;
+		return pool;
+	}
+
+	static int &index() {
+		static thread_local int i = -1;
+		return i;
+	}
+
+	bool pop(int i, Task &task) {
+		Queue &q = *queues[i];
+		std::lock_guard <std::mutex> lock(q.mutex);
+		if (q.tasks.empty())
+			return false;
+
+		task = std::move(q.tasks.back());
+		q.tasks.pop_back();
+		return true;
+	}
+
+	bool steal(int i, Task &task) {
+		Queue &q = *queues[i];
+		std::lock_guard <std::mutex> lock(q.mutex);
+		if (q.tasks.empty())
+			return false;
+
+		task = std::move(q.tasks.front());
+		q.tasks.pop_front();
+		return true;
+	}
+
+	void work(int i) {
+		current() = this;
+		index() = i;
+
+		while (true) {
+			if (run_one())
+				continue;
+
+			std::unique_lock <std::mutex> lock(mutex);
+			cv.wait(lock, [&]() { return stop || queued > 0; });
+			if (stop && queued == 0)
+				return;
+		}
+	}
+public:
+	ThreadPool(int threads = std::thread::hardware_concurrency()) {
+		threads = std::max(threads, 1);
+
+		// One extra queue for tasks submitted from outside the pool
+		for (int i = 0; i <= threads; i++)
+			queues.emplace_back(new Queue);
+
+		for (int i = 0; i < threads; i++)
+			workers.emplace_back(&ThreadPool::work, this, i);
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard <std::mutex> lock(mutex);
+			stop = true;
+		}
+
+		cv.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	int size() const {
+		return workers.size();
+	}
+
+	void submit(Task task) {
+		int i = worker_index();
+		if (i == -1)
+			i = workers.size();
+
+		{
+			Queue &q = *queues[i];
+			std::lock_guard <std::mutex> lock(q.mutex);
+			q.tasks.push_back(std::move(task));
+		}
+
+		{
+			std::lock_guard <std::mutex> lock(mutex);
+			queued++;
+		}
+
+		cv.notify_one();
+	}
+
+	// Run a single pending task, own queue first; returns false if
+	// there was nothing to run
+	bool run_one() {
+		Task task;
+
+		int self = worker_index();
+		int n = queues.size();
+
+		bool found = self != -1 && pop(self, task);
+		for (int k = 1; k <= n && !found; k++) {
+			int i = (std::max(self, 0) + k) % n;
+			found = steal(i, task);
+		}
+
+		if (!found)
+			return false;
+
+		queued--;
+		task();
+		return true;
+	}
+
+	// Shared pool for the whole application
+	static ThreadPool &global() {
+		static ThreadPool pool;
+		return pool;
+	}
+};
+
+// Fork-join group of tasks; waiting helps run pending tasks instead of
+// blocking, so groups can be nested from inside tasks
+class TaskGroup {
+	ThreadPool &pool;
+	std::atomic <int> pending {0};
+public:
+	TaskGroup(ThreadPool &pool_) : pool(pool_) {}
+
+	~TaskGroup() {
+		wait();
+	}
+
+	template <class F>
+	void spawn(F &&f) {
+		pending++;
+		pool.submit([this, f = std::forward <F> (f)]() mutable {
+			f();
+			pending--;
+		});
+	}
+
+	void wait() {
+		while (pending > 0) {
+			if (!pool.run_one())
+				std::this_thread::yield();
+		}
+	}
+};
+
+// Number of chunks parallel_for would use
+inline int parallel_chunks(ThreadPool &pool, int count, int grain)
+{
+	return std::max(std::min(count / std::max(grain, 1), 4 * pool.size()), 1);
+}
+
+// Split [begin, end) into chunks of at least grain elements and run
+// f(chunk, chunk_begin, chunk_end) for each; returns the number of chunks
+template <class F>
+int parallel_for(ThreadPool &pool, int begin, int end, int grain, F &&f)
+{
+	int count = end - begin;
+	int chunks = parallel_chunks(pool, count, grain);
+
+	TaskGroup group(pool);
+	for (int c = 1; c < chunks; c++) {
+		int b = begin + (long long) count * c / chunks;
+		int e = begin + (long long) count * (c + 1) / chunks;
+		group.spawn([&f, c, b, e]() { f(c, b, e); });
+	}
+
+	// First chunk on the calling thread
+	f(0, begin, begin + (int) ((long long) count / chunks));
+	group.wait();
+
+	return chunks;
+}
+
+#endif
@@ -0,0 +1,646 @@
+#ifndef TRAVERSAL_H_
+#define TRAVERSAL_H_
+
+// Standard headers
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "core.hpp"
+#include "instances.hpp"
+#include "leaves.hpp"
+#include "mesh.hpp"
+#include "refit.hpp"
+#include "wide_bvh.hpp"
+
+// CPU reference of the BVH traversal in shaders/intersection.glsl, for
+// validating buffer formats and counting traversal work offline
+
+// Depth of the traversal stack for wide BVHs, same as the shader
+constexpr int BVH_STACK_SIZE = 64;
+
+// Depth of the short stack for ordered binary traversal; deeper trees fall
+// back to the threaded links
+constexpr int BVH_SHORT_STACK_SIZE = 32;
+
+// Buffer layout and traversal to use
+struct BVHLayout {
+	int width = 2;			// 2 for binary, 4 or 8 for wide
+	bool quantized = false;		// Wide only
+	bool ordered = false;		// Binary only, near child first
+	int leaf_size = 1;		// Binary only, above 1 leaves are clustered
+	bool records = false;		// Triangle records instead of indices
+};
+
+struct Ray {
+	glm::vec3 p;
+	glm::vec3 d;
+};
+
+struct Hit {
+	float t = std::numeric_limits <float> ::infinity();
+	int primitive = -1;
+	int instance = -1;
+};
+
+// Cache line size assumed by the cache model and node layouts
+constexpr int CACHE_LINE_SIZE = 64;
+
+// Set associative LRU cache over the BVH buffer, the buffer starting at a
+// line boundary; counts the lines traversals miss in a cache of a given
+// size, to compare node layouts
+struct CacheModel {
+	int sets;
+	int ways;
+	std::vector <uint64_t> tags;		// Line + 1, 0 when empty
+	std::vector <uint64_t> stamps;		// Last use, for LRU
+	uint64_t clock = 0;
+	uint64_t accesses = 0;			// Lines touched
+	uint64_t misses = 0;
+
+	CacheModel(int bytes = 32 * 1024, int ways_ = 8)
+			: sets(std::max(bytes / (CACHE_LINE_SIZE * ways_), 1)), ways(ways_),
+			tags(sets * ways_, 0), stamps(sets * ways_, 0) {}
+
+	void touch_line(uint64_t line) {
+		accesses++;
+		clock++;
+
+		uint64_t *set_tags = &tags[(line % sets) * ways];
+		uint64_t *set_stamps = &stamps[(line % sets) * ways];
+
+		int victim = 0;
+		for (int w = 0; w < ways; w++) {
+			if (set_tags[w] == line + 1) {
+				set_stamps[w] = clock;
+				return;
+			}
+
+			if (set_stamps[w] < set_stamps[victim])
+				victim = w;
+		}
+
+		misses++;
+		set_tags[victim] = line + 1;
+		set_stamps[victim] = clock;
+	}
+
+	// Every line of a range of bytes
+	void touch(uint64_t offset, uint64_t bytes) {
+		uint64_t first = offset / CACHE_LINE_SIZE;
+		uint64_t last = (offset + bytes - 1) / CACHE_LINE_SIZE;
+		for (uint64_t line = first; line <= last; line++)
+			touch_line(line);
+	}
+};
+
+// Work done by a traversal
+struct TraversalStats {
+	uint64_t nodes = 0;		// Node fetches
+	uint64_t boxes = 0;		// Ray-box tests
+	uint64_t primitives = 0;	// Ray-triangle tests
+	uint64_t bytes = 0;		// Bytes fetched from the BVH buffer
+	uint64_t geometry = 0;		// Bytes of indices and vertices fetched
+	CacheModel *cache = nullptr;	// Optional, sees BVH buffer fetches
+
+	// Fetch of count vec4s of the BVH buffer, from offset
+	void fetch(int offset, int count) {
+		bytes += count * sizeof(aligned_vec4);
+		if (cache)
+			cache->touch(offset * sizeof(aligned_vec4), count * sizeof(aligned_vec4));
+	}
+
+	void add(const TraversalStats &other) {
+		nodes += other.nodes;
+		boxes += other.boxes;
+		primitives += other.primitives;
+		bytes += other.bytes;
+		geometry += other.geometry;
+	}
+};
+
+// Ray-triangle intersection, as _intersect_time
+inline float intersect_time(const Ray &r, const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec3 &v3)
+{
+	glm::vec3 e1 = v2 - v1;
+	glm::vec3 e2 = v3 - v1;
+	glm::vec3 s1 = glm::cross(r.d, e2);
+	float divisor = glm::dot(s1, e1);
+	if (divisor == 0.0f)
+		return -1.0f;
+	glm::vec3 s = r.p - v1;
+	float inv_divisor = 1.0f / divisor;
+	float b1 = glm::dot(s, s1) * inv_divisor;
+	if (b1 < 0.0f || b1 > 1.0f)
+		return -1.0f;
+	glm::vec3 s2 = glm::cross(s, e1);
+	float b2 = glm::dot(r.d, s2) * inv_divisor;
+	if (b2 < 0.0f || b1 + b2 > 1.0f)
+		return -1.0f;
+	return glm::dot(e2, s2) * inv_divisor;
+}
+
+// Intersect triangle i of the index buffer, keeping the closest hit
+inline void intersect(const Ray &r, const VBuffer &vertices, const IBuffer &triangles,
+		int i, Hit &hit, TraversalStats &stats)
+{
+	const glm::uvec4 &tri = triangles[i].v;
+
+	float t = intersect_time(r,
+		vertices[tri.x].v,
+		vertices[tri.y].v,
+		vertices[tri.z].v
+	);
+
+	stats.primitives++;
+	stats.geometry += sizeof(aligned_uvec4) + 3 * sizeof(aligned_vec4);
+
+	if (t >= 0.0f && t < hit.t) {
+		hit.t = t;
+		hit.primitive = i;
+	}
+}
+
+// Intersect triangle i through its record, as push_triangle_record makes
+// it: the ray in unit triangle space crosses z = 0 at t
+inline void intersect_record(const Ray &r, const RBuffer &records, int i, Hit &hit, TraversalStats &stats)
+{
+	const aligned_vec4 *record = &records[TRIANGLE_RECORD_SIZE * i];
+
+	stats.primitives++;
+	stats.geometry += TRIANGLE_RECORD_SIZE * sizeof(aligned_vec4);
+
+	glm::vec3 z = record[2].v;
+	float oz = glm::dot(z, r.p) + record[2].v.w;
+	float dz = glm::dot(z, r.d);
+
+	float t = -oz / dz;
+	if (!(t >= 0.0f && t < hit.t))
+		return;
+
+	glm::vec3 x = record[0].v;
+	float u = glm::dot(x, r.p) + record[0].v.w + t * glm::dot(x, r.d);
+	if (u < 0.0f || u > 1.0f)
+		return;
+
+	glm::vec3 y = record[1].v;
+	float v = glm::dot(y, r.p) + record[1].v.w + t * glm::dot(y, r.d);
+	if (v < 0.0f || u + v > 1.0f)
+		return;
+
+	hit.t = t;
+	hit.primitive = i;
+}
+
+// Intersect the inlined triangles of a clustered leaf
+inline void intersect_leaf(const BVHBuffer &bvh, const LeafBuffer &leaves, int node,
+		const Ray &r, Hit &hit, TraversalStats &stats)
+{
+	int first = node_field(bvh, node, 0);
+	int count = node_field(bvh, node, 3);
+
+	for (int i = 0; i < count; i++) {
+		const aligned_vec4 *tri = &leaves[LEAF_TRIANGLE_SIZE * (first + i)];
+		float t = intersect_time(r, tri[0].v, tri[1].v, tri[2].v);
+
+		stats.primitives++;
+		stats.geometry += LEAF_TRIANGLE_SIZE * sizeof(aligned_vec4);
+
+		if (t >= 0.0f && t < hit.t) {
+			hit.t = t;
+			hit.primitive = float_to_bits(tri[0].v.w);
+		}
+	}
+}
+
+// Ray-box slab test; returns the entry time, negative when the ray starts
+// inside, and infinity on a miss
+inline float intersect_box(const Ray &r, const glm::vec3 &inv_d, const glm::vec3 &min, const glm::vec3 &max)
+{
+	glm::vec3 t0 = (min - r.p) * inv_d;
+	glm::vec3 t1 = (max - r.p) * inv_d;
+
+	glm::vec3 tmin = glm::min(t0, t1);
+	glm::vec3 tmax = glm::max(t0, t1);
+
+	float tnear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+	float tfar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+
+	if (tnear > tfar || tfar < 0.0f)
+		return std::numeric_limits <float> ::infinity();
+
+	return tnear;
+}
+
+// Walk the threaded links of a binary BVH, as BVH::serialize writes it,
+// from the given root; children are always visited left first. Leaves
+// are handed to leaf(node), for either leaf format
+template <class Leaf>
+void walk_threaded(const BVHBuffer &bvh, const Ray &ray, Hit &hit, TraversalStats &stats,
+		int root, Leaf &&leaf)
+{
+	glm::vec3 inv_d = 1.0f / ray.d;
+
+	int node = root;
+	while (node != -1) {
+		stats.nodes++;
+
+		int primitive = node_field(bvh, node, 0);
+		if (primitive != -1) {
+			stats.fetch(node, 1);
+			leaf(node);
+			node = node_field(bvh, node, 2);
+			continue;
+		}
+
+		stats.fetch(node, 3);
+		stats.boxes++;
+
+		float t = intersect_box(ray, inv_d, bvh[node + 1].v, bvh[node + 2].v);
+		if (t < hit.t)
+			node = node_field(bvh, node, 1);
+		else
+			node = node_field(bvh, node, 2);
+	}
+}
+
+inline void traverse_threaded(const BVHBuffer &bvh, const VBuffer &vertices, const IBuffer &triangles,
+		const Ray &ray, Hit &hit, TraversalStats &stats, int root = 0)
+{
+	walk_threaded(bvh, ray, hit, stats, root, [&](int node) {
+		intersect(ray, vertices, triangles, node_field(bvh, node, 0), hit, stats);
+	});
+}
+
+inline Hit trace_binary(const BVHBuffer &bvh, const VBuffer &vertices, const IBuffer &triangles,
+		const Ray &ray, TraversalStats &stats)
+{
+	Hit hit;
+	if (!bvh.empty())
+		traverse_threaded(bvh, vertices, triangles, ray, hit, stats);
+
+	return hit;
+}
+
+// Binary BVH visiting the nearer child first, so closer hits cull more of
+// the tree. Both child boxes are tested at the parent; the right child is
+// the miss link of the left one. The far child goes on a short stack with
+// its entry time, and is skipped when popped if a closer hit was found in
+// the meantime. If the stack ever overflows, the threaded traversal runs
+// afterwards with the hit found so far, so nothing is lost
+template <class Leaf>
+void walk_ordered(const BVHBuffer &bvh, const Ray &ray, Hit &hit, TraversalStats &stats, Leaf &&leaf)
+{
+	glm::vec3 inv_d = 1.0f / ray.d;
+
+	struct Entry {
+		int node;
+		float t;
+	};
+
+	Entry stack[BVH_SHORT_STACK_SIZE];
+	int top = 0;
+	bool overflow = false;
+
+	int node = 0;
+
+	stats.boxes++;
+	stats.fetch(1, 2);
+	float t = intersect_box(ray, inv_d, bvh[1].v, bvh[2].v);
+
+	while (true) {
+		if (t < hit.t) {
+			stats.nodes++;
+			stats.fetch(node, 1);
+
+			int primitive = node_field(bvh, node, 0);
+			if (primitive != -1) {
+				leaf(node);
+			} else {
+				int near = node_field(bvh, node, 1);
+				int far = node_field(bvh, near, 2);
+
+				// The near header holds the far link
+				stats.boxes += 2;
+				stats.fetch(near, 3);
+				stats.fetch(far + 1, 2);
+
+				float t_near = intersect_box(ray, inv_d, bvh[near + 1].v, bvh[near + 2].v);
+				float t_far = intersect_box(ray, inv_d, bvh[far + 1].v, bvh[far + 2].v);
+
+				if (t_far < t_near) {
+					std::swap(near, far);
+					std::swap(t_near, t_far);
+				}
+
+				if (t_near < hit.t) {
+					if (t_far < hit.t) {
+						if (top < BVH_SHORT_STACK_SIZE)
+							stack[top++] = Entry {far, t_far};
+						else
+							overflow = true;
+					}
+
+					node = near;
+					t = t_near;
+					continue;
+				}
+			}
+		}
+
+		if (top == 0)
+			break;
+
+		top--;
+		node = stack[top].node;
+		t = stack[top].t;
+	}
+
+	if (overflow)
+		walk_threaded(bvh, ray, hit, stats, 0, leaf);
+}
+
+inline Hit trace_ordered(const BVHBuffer &bvh, const VBuffer &vertices, const IBuffer &triangles,
+		const Ray &ray, TraversalStats &stats)
+{
+	Hit hit;
+	if (bvh.empty())
+		return hit;
+
+	walk_ordered(bvh, ray, hit, stats, [&](int node) {
+		intersect(ray, vertices, triangles, node_field(bvh, node, 0), hit, stats);
+	});
+
+	return hit;
+}
+
+// Binary BVH with clustered leaves, as serialize_leaves writes it
+inline Hit trace_leaves(const BVHBuffer &bvh, const LeafBuffer &leaves, bool ordered,
+		const Ray &ray, TraversalStats &stats)
+{
+	Hit hit;
+	if (bvh.empty())
+		return hit;
+
+	auto leaf = [&](int node) {
+		intersect_leaf(bvh, leaves, node, ray, hit, stats);
+	};
+
+	if (ordered)
+		walk_ordered(bvh, ray, hit, stats, leaf);
+	else
+		walk_threaded(bvh, ray, hit, stats, 0, leaf);
+
+	return hit;
+}
+
+// Wide BVH in child order, keeping only the node and next child of each
+// level, so the stack grows with the depth alone; the fallback of
+// walk_wide when its stack overflows
+template <class Primitive>
+void walk_wide_levels(const BVHBuffer &bvh, int width, bool quantized,
+		const Ray &ray, Hit &hit, TraversalStats &stats, Primitive &&primitive)
+{
+	glm::vec3 inv_d = 1.0f / ray.d;
+
+	struct Level {
+		int node;
+		int next;
+	};
+
+	std::vector <Level> levels;
+	levels.push_back(Level {0, 0});
+
+	stats.nodes++;
+	stats.fetch(0, wide_node_size(width, quantized));
+
+	while (!levels.empty()) {
+		Level &level = levels.back();
+		int node = level.node;
+		int i = level.next++;
+		if (i == width) {
+			levels.pop_back();
+			continue;
+		}
+
+		int link = wide_child_link(bvh, node, i, quantized);
+		if (link == BVH_WIDE_EMPTY)
+			continue;
+
+		BBox box = wide_child_bounds(bvh, node, i, quantized);
+		stats.boxes++;
+
+		float t = intersect_box(ray, inv_d, box.min, box.max);
+		if (t >= hit.t)
+			continue;
+
+		if (wide_is_leaf(link)) {
+			primitive(wide_primitive(link));
+			continue;
+		}
+
+		levels.push_back(Level {link, 0});
+
+		stats.nodes++;
+		stats.fetch(link, wide_node_size(width, quantized));
+	}
+}
+
+// Wide BVH, as serialize_wide writes it; hit children are pushed far to
+// near so the nearest one is visited first. Primitives are handed to
+// primitive(index). Each level can leave up to width - 1 children on the
+// stack, so deep trees can overflow it; the children that did not fit
+// are covered by walking again level by level
+template <class Primitive>
+void walk_wide(const BVHBuffer &bvh, int width, bool quantized,
+		const Ray &ray, Hit &hit, TraversalStats &stats, Primitive &&primitive)
+{
+	glm::vec3 inv_d = 1.0f / ray.d;
+
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	bool overflow = false;
+
+	stack[top++] = 0;
+	while (top > 0) {
+		int node = stack[--top];
+
+		stats.nodes++;
+		stats.fetch(node, wide_node_size(width, quantized));
+
+		int links[8];
+		float times[8];
+		int count = 0;
+
+		for (int i = 0; i < width; i++) {
+			int link = wide_child_link(bvh, node, i, quantized);
+			if (link == BVH_WIDE_EMPTY)
+				continue;
+
+			BBox box = wide_child_bounds(bvh, node, i, quantized);
+			stats.boxes++;
+
+			float t = intersect_box(ray, inv_d, box.min, box.max);
+			if (t >= hit.t)
+				continue;
+
+			if (wide_is_leaf(link)) {
+				primitive(wide_primitive(link));
+				continue;
+			}
+
+			// Insertion sort, farthest first
+			int j = count++;
+			for (; j > 0 && times[j - 1] < t; j--) {
+				links[j] = links[j - 1];
+				times[j] = times[j - 1];
+			}
+
+			links[j] = link;
+			times[j] = t;
+		}
+
+		// Farthest first, so on overflow the nearest ones stay
+		int skip = std::max(count - (BVH_STACK_SIZE - top), 0);
+		if (skip > 0)
+			overflow = true;
+
+		for (int i = skip; i < count; i++)
+			stack[top++] = links[i];
+	}
+
+	if (overflow)
+		walk_wide_levels(bvh, width, quantized, ray, hit, stats, primitive);
+}
+
+inline Hit trace_wide(const BVHBuffer &bvh, int width, bool quantized,
+		const VBuffer &vertices, const IBuffer &triangles,
+		const Ray &ray, TraversalStats &stats)
+{
+	Hit hit;
+	if (bvh.empty())
+		return hit;
+
+	walk_wide(bvh, width, quantized, ray, hit, stats, [&](int i) {
+		intersect(ray, vertices, triangles, i, hit, stats);
+	});
+
+	return hit;
+}
+
+// Any layout with single triangle leaves, through triangle records
+inline Hit trace_records(const BVHBuffer &bvh, const BVHLayout &layout, const RBuffer &records,
+		const Ray &ray, TraversalStats &stats)
+{
+	Hit hit;
+	if (bvh.empty())
+		return hit;
+
+	auto primitive = [&](int i) {
+		intersect_record(ray, records, i, hit, stats);
+	};
+
+	auto leaf = [&](int node) {
+		primitive(node_field(bvh, node, 0));
+	};
+
+	if (layout.width != 2)
+		walk_wide(bvh, layout.width, layout.quantized, ray, hit, stats, primitive);
+	else if (layout.ordered)
+		walk_ordered(bvh, ray, hit, stats, leaf);
+	else
+		walk_threaded(bvh, ray, hit, stats, 0, leaf);
+
+	return hit;
+}
+
+// Two level BVH as InstancedScene writes it: at a TLAS leaf the ray is
+// moved into object space and walks the BLAS of the instance. The
+// direction is not renormalized, so hit times carry over between levels
+inline Hit trace_instanced(const BVHBuffer &bvh, const InstanceBuffer &instances,
+		const VBuffer &vertices, const IBuffer &triangles,
+		const Ray &ray, TraversalStats &stats)
+{
+	Hit hit;
+	if (bvh.empty())
+		return hit;
+
+	glm::vec3 inv_d = 1.0f / ray.d;
+
+	int node = 0;
+	while (node != -1) {
+		stats.nodes++;
+
+		int instance = node_field(bvh, node, 0);
+		if (instance != -1) {
+			stats.fetch(node, 1);
+			stats.bytes += INSTANCE_SIZE * sizeof(aligned_vec4);
+
+			const aligned_vec4 *record = &instances[INSTANCE_SIZE * instance];
+
+			Ray local;
+			for (int r = 0; r < 3; r++) {
+				glm::vec3 row = record[r].v;
+				local.p[r] = glm::dot(row, ray.p) + record[r].v.w;
+				local.d[r] = glm::dot(row, ray.d);
+			}
+
+			int root = float_to_bits(record[3].v.x);
+
+			float t = hit.t;
+			traverse_threaded(bvh, vertices, triangles, local, hit, stats, root);
+
+			if (hit.t < t)
+				hit.instance = instance;
+
+			node = node_field(bvh, node, 2);
+			continue;
+		}
+
+		stats.fetch(node, 3);
+		stats.boxes++;
+
+		float t = intersect_box(ray, inv_d, bvh[node + 1].v, bvh[node + 2].v);
+		if (t < hit.t)
+			node = node_field(bvh, node, 1);
+		else
+			node = node_field(bvh, node, 2);
+	}
+
+	return hit;
+}
+
+// Trace with whichever layout the buffer holds
+inline Hit trace(const BVHBuffer &bvh, const BVHLayout &layout,
+		const VBuffer &vertices, const IBuffer &triangles,
+		const Ray &ray, TraversalStats &stats)
+{
+	if (layout.width != 2)
+		return trace_wide(bvh, layout.width, layout.quantized, vertices, triangles, ray, stats);
+
+	if (layout.ordered)
+		return trace_ordered(bvh, vertices, triangles, ray, stats);
+
+	return trace_binary(bvh, vertices, triangles, ray, stats);
+}
+
+// Same, for buffers that may have clustered leaves, or intersect through
+// triangle records
+inline Hit trace(const BVHBuffer &bvh, const BVHLayout &layout,
+		const VBuffer &vertices, const IBuffer &triangles,
+		const LeafBuffer &leaves, const RBuffer &records,
+		const Ray &ray, TraversalStats &stats)
+{
+	if (layout.width == 2 && layout.leaf_size > 1)
+		return trace_leaves(bvh, leaves, layout.ordered, ray, stats);
+
+	if (layout.records)
+		return trace_records(bvh, layout, records, ray, stats);
+
+	return trace(bvh, layout, vertices, triangles, ray, stats);
+}
+
+#endif
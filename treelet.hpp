@@ -0,0 +1,223 @@
+#ifndef TREELET_H_
+#define TREELET_H_
+
+// Standard headers
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "thread_pool.hpp"
+
+// Treelet restructuring (Karras and Aila 2013), a post-pass over a built
+// BVH: bottom-up, every node forms a treelet by repeatedly opening the
+// largest of its leaves until it has BVH_TREELET_LEAVES of them, then the
+// topology over those leaves with the lowest SAH cost is found by dynamic
+// programming over all leaf subsets and replaces the treelet, reusing its
+// inner nodes. Subtrees are independent, so large ones are optimized as
+// pool tasks; the result does not depend on the schedule. The tree is
+// laid out in pre-order again at the end, so it serializes as before.
+
+// Leaves per treelet; the search is over 3^n partitions
+constexpr int BVH_TREELET_LEAVES = 7;
+
+// Bottom-up passes over the tree
+constexpr int BVH_TREELET_PASSES = 3;
+
+struct TreeletOptimizer {
+	std::vector <BVHNode> &nodes;
+	std::vector <float> cost;	// SAH cost of each subtree, unnormalized
+	std::vector <int> leaves;	// Leaves of each subtree
+
+	TreeletOptimizer(std::vector <BVHNode> &nodes_)
+			: nodes(nodes_), cost(nodes_.size()), leaves(nodes_.size()) {}
+
+	// Find and apply the best topology for the treelet rooted at node
+	void restructure(int node) {
+		constexpr int n = BVH_TREELET_LEAVES;
+		constexpr int subsets = 1 << n;
+
+		// Grow the treelet, opening the leaf with the largest area
+		std::array <int, n> treelet_leaves;
+		std::array <int, n - 1> inner;
+
+		int count = 0;
+		int inner_count = 0;
+
+		inner[inner_count++] = node;
+		treelet_leaves[count++] = nodes[node].left;
+		treelet_leaves[count++] = nodes[node].right;
+
+		while (count < n) {
+			int best = -1;
+			float best_area = -1.0f;
+
+			for (int i = 0; i < count; i++) {
+				const BVHNode &leaf = nodes[treelet_leaves[i]];
+				if (leaf.left == -1)
+					continue;
+
+				float area = leaf.bbox.surface_area();
+				if (area > best_area) {
+					best = i;
+					best_area = area;
+				}
+			}
+
+			if (best == -1)
+				break;
+
+			int opened = treelet_leaves[best];
+			inner[inner_count++] = opened;
+			treelet_leaves[best] = nodes[opened].left;
+			treelet_leaves[count++] = nodes[opened].right;
+		}
+
+		if (count < 3)
+			return;
+
+		int full = (1 << count) - 1;
+
+		// Bounds of every subset
+		std::array <BBox, subsets> boxes;
+		std::array <float, subsets> best_cost;
+		std::array <int, subsets> best_split;
+
+		boxes[0] = BBox::empty();
+		for (int s = 1; s <= full; s++) {
+			int low = s & -s;
+			int i = __builtin_ctz(s);
+
+			boxes[s] = boxes[s & ~low];
+			boxes[s].grow(nodes[treelet_leaves[i]].bbox);
+
+			if (s == low) {
+				best_cost[s] = cost[treelet_leaves[i]];
+				best_split[s] = 0;
+			}
+		}
+
+		// Subsets in increasing size, so their parts are always done;
+		// only partitions holding the lowest leaf, to skip mirrors
+		for (int size = 2; size <= count; size++) {
+			for (int s = 1; s <= full; s++) {
+				if (__builtin_popcount(s) != size)
+					continue;
+
+				int low = s & -s;
+
+				float best = std::numeric_limits <float> ::max();
+				int split = 0;
+
+				for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+					if (!(p & low))
+						continue;
+
+					float c = best_cost[p] + best_cost[s & ~p];
+					if (c < best) {
+						best = c;
+						split = p;
+					}
+				}
+
+				best_cost[s] = BVH_TRAVERSAL_COST * boxes[s].surface_area() + best;
+				best_split[s] = split;
+			}
+		}
+
+		// Keep the current topology unless strictly cheaper
+		if (best_cost[full] >= cost[node])
+			return;
+
+		int next = 0;
+		emit(full, treelet_leaves.data(), inner.data(), next, boxes.data(), best_cost.data(), best_split.data());
+	}
+
+	// Rebuild the treelet for a subset, taking inner nodes in order; the
+	// treelet root comes first, so it keeps its index
+	int emit(int s, const int *treelet_leaves, const int *inner, int &next,
+			const BBox *boxes, const float *best_cost, const int *best_split) {
+		if ((s & (s - 1)) == 0)
+			return treelet_leaves[__builtin_ctz(s)];
+
+		int node = inner[next++];
+		int left = emit(best_split[s], treelet_leaves, inner, next, boxes, best_cost, best_split);
+		int right = emit(s & ~best_split[s], treelet_leaves, inner, next, boxes, best_cost, best_split);
+
+		nodes[node].bbox = boxes[s];
+		nodes[node].left = left;
+		nodes[node].right = right;
+
+		cost[node] = best_cost[s];
+		leaves[node] = leaves[left] + leaves[right];
+		return node;
+	}
+
+	// Bottom-up over a subtree; children finish before their parent, and
+	// treelets never reach outside the subtree they are rooted in
+	void optimize(int node, ThreadPool *pool) {
+		BVHNode &n = nodes[node];
+		if (n.left == -1) {
+			cost[node] = BVH_INTERSECTION_COST * n.bbox.surface_area();
+			leaves[node] = 1;
+			return;
+		}
+
+		if (pool && nodes[node].size >= BVH_PARALLEL_TASK_SIZE) {
+			TaskGroup group(*pool);
+			group.spawn([&]() {
+				optimize(n.left, pool);
+			});
+
+			optimize(n.right, pool);
+			group.wait();
+		} else {
+			optimize(n.left, nullptr);
+			optimize(n.right, nullptr);
+		}
+
+		cost[node] = BVH_TRAVERSAL_COST * n.bbox.surface_area() + cost[n.left] + cost[n.right];
+		leaves[node] = leaves[n.left] + leaves[n.right];
+
+		// Small subtrees near the leaves have little to gain
+		if (leaves[node] >= BVH_TREELET_LEAVES)
+			restructure(node);
+	}
+};
+
+// Lay the nodes out in pre-order from the root again, with subtree sizes
+inline int relayout(const std::vector <BVHNode> &nodes, int node, BVH &bvh)
+{
+	const BVHNode &n = nodes[node];
+	if (n.left == -1)
+		return bvh.push(n.bbox, n.primitive);
+
+	int index = bvh.push(n.bbox);
+	int left = relayout(nodes, n.left, bvh);
+	int right = relayout(nodes, n.right, bvh);
+
+	bvh.link(index, left, right);
+	return index;
+}
+
+// Lower the SAH cost of a built BVH in place
+inline void optimize_treelets(BVH &bvh, int passes = BVH_TREELET_PASSES, ThreadPool *pool = nullptr)
+{
+	if (bvh.nodes.size() < 3)
+		return;
+
+	for (int pass = 0; pass < passes; pass++) {
+		TreeletOptimizer optimizer(bvh.nodes);
+		optimizer.optimize(0, pool);
+
+		BVH laid_out;
+		laid_out.nodes.reserve(bvh.nodes.size());
+		relayout(bvh.nodes, 0, laid_out);
+
+		bvh.nodes.swap(laid_out.nodes);
+	}
+}
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef WIDE_BVH_H_
+#define WIDE_BVH_H_
+
+// Standard headers
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// App headers
+#include "bvh.hpp"
+#include "core.hpp"
+
+// Wide BVH: the binary tree is collapsed into nodes with up to 4 or 8
+// children, so one node fetch tests several boxes at once. Children are
+// stored in groups of four, each group as SoA bounds followed by the child
+// links:
+//
+//	min.x[4], min.y[4], min.z[4], max.x[4], max.y[4], max.z[4], child[4]
+//
+// Child links are bit-cast ints: the buffer offset of an inner node, -1 for
+// an empty slot, or -(primitive + 2) for a leaf. Empty slots are skipped by
+// their link, their bounds are never read.
+//
+// The quantized layout stores child bounds as 8-bit offsets from the node
+// box instead, at half the size. A node starts with a header holding the
+// origin of the grid and the biased exponents of its per-axis power of two
+// cell size; each group of four children then packs one byte per child
+// into each uint:
+//
+//	header:	origin.xyz, exponent.x | exponent.y << 8 | exponent.z << 16
+//	group:	qmin.x, qmin.y, qmin.z, qmax.x
+//		qmax.y, qmax.z, -, -
+//		child[4]
+//
+// Minimums round down and maximums round up, so the decoded boxes always
+// contain the original ones.
+
+// Children per SoA group, and vec4s per group
+constexpr int BVH_WIDE_GROUP = 4;
+constexpr int BVH_WIDE_GROUP_SIZE = 7;
+constexpr int BVH_QUANTIZED_GROUP_SIZE = 3;
+
+constexpr int BVH_WIDE_EMPTY = -1;
+
+// Largest quantized coordinate; one below 255 leaves room for rounding
+constexpr int BVH_QUANTIZED_MAX = 254;
+
+// Number of vec4s in a node of the given width
+inline int wide_node_size(int width, bool quantized = false)
+{
+	if (quantized)
+		return 1 + BVH_QUANTIZED_GROUP_SIZE * (width / BVH_WIDE_GROUP);
+
+	return BVH_WIDE_GROUP_SIZE * (width / BVH_WIDE_GROUP);
+}
+
+// First vec4 of the group holding child i
+inline int wide_group(int node, int i, bool quantized)
+{
+	if (quantized)
+		return node + 1 + BVH_QUANTIZED_GROUP_SIZE * (i / BVH_WIDE_GROUP);
+
+	return node + BVH_WIDE_GROUP_SIZE * (i / BVH_WIDE_GROUP);
+}
+
+inline int wide_leaf(int primitive)
+{
+	return -(primitive + 2);
+}
+
+inline bool wide_is_leaf(int child)
+{
+	return child < BVH_WIDE_EMPTY;
+}
+
+inline int wide_primitive(int child)
+{
+	return -child - 2;
+}
+
+// Bit casts through memcpy, which does not break strict aliasing
+inline float bits_to_float(uint32_t bits)
+{
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline uint32_t float_to_bits(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+// Grid a node quantizes its children on; cells are powers of two, so
+// decoding is exact up to the final addition
+struct BVHQuantization {
+	glm::vec3 origin;
+	glm::vec3 scale;
+	uint32_t exponents = 0;
+
+	BVHQuantization(const BBox &box) : origin(box.min) {
+		glm::vec3 extent = box.max - box.min;
+
+		for (int a = 0; a < 3; a++) {
+			// Smallest power of two that fits the extent in the grid
+			int e;
+			std::frexp(extent[a] / BVH_QUANTIZED_MAX, &e);
+
+			uint32_t biased = std::min(std::max(e + 127, 1), 254);
+			scale[a] = bits_to_float(biased << 23);
+			exponents |= biased << (8 * a);
+		}
+	}
+
+	// Grid stored in a node header
+	BVHQuantization(const glm::vec4 &header) : origin(header) {
+		exponents = float_to_bits(header.w);
+		for (int a = 0; a < 3; a++)
+			scale[a] = bits_to_float(((exponents >> (8 * a)) & 0xff) << 23);
+	}
+
+	glm::vec4 header() const {
+		return glm::vec4(origin, bits_to_float(exponents));
+	}
+
+	// Decode as the shader does
+	float decode(uint32_t q, int axis) const {
+		return origin[axis] + (float) q * scale[axis];
+	}
+
+	uint32_t quantize_min(float x, int axis) const {
+		float q = std::floor((x - origin[axis]) / scale[axis]);
+		uint32_t i = std::min(std::max(q, 0.0f), (float) BVH_QUANTIZED_MAX);
+		while (i > 0 && decode(i, axis) > x)
+			i--;
+
+		return i;
+	}
+
+	uint32_t quantize_max(float x, int axis) const {
+		float q = std::ceil((x - origin[axis]) / scale[axis]);
+		uint32_t i = std::min(std::max(q, 0.0f), (float) BVH_QUANTIZED_MAX);
+		while (i < 255 && decode(i, axis) < x)
+			i++;
+
+		return i;
+	}
+};
+
+// Write child i of the wide node at offset
+inline void set_wide_child(BVHBuffer &buffer, int offset, int i, const BBox &box, int link)
+{
+	int group = wide_group(offset, i, false);
+	int lane = i % BVH_WIDE_GROUP;
+
+	for (int a = 0; a < 3; a++) {
+		buffer[group + a].v[lane] = box.min[a];
+		buffer[group + 3 + a].v[lane] = box.max[a];
+	}
+
+	buffer[group + 6].v[lane] = bits_to_float(link);
+}
+
+// Write child i of the quantized node at offset; the header must be set
+inline void set_quantized_child(BVHBuffer &buffer, int offset, int i, const BBox &box, int link)
+{
+	int group = wide_group(offset, i, true);
+	int lane = i % BVH_WIDE_GROUP;
+
+	BVHQuantization grid(buffer[offset].v);
+
+	// Slots are skipped by link, so empty ones just stay zero
+	uint32_t q[6] = {0, 0, 0, 0, 0, 0};
+	if (link != BVH_WIDE_EMPTY) {
+		for (int a = 0; a < 3; a++) {
+			q[a] = grid.quantize_min(box.min[a], a);
+			q[3 + a] = grid.quantize_max(box.max[a], a);
+		}
+	}
+
+	for (int k = 0; k < 6; k++) {
+		float &word = buffer[group + k / 4].v[k % 4];
+
+		uint32_t bits = float_to_bits(word);
+		bits &= ~(0xffu << (8 * lane));
+		bits |= q[k] << (8 * lane);
+		word = bits_to_float(bits);
+	}
+
+	buffer[group + 2].v[lane] = bits_to_float(link);
+}
+
+// Bounds of child i of a wide node, decoded if quantized
+inline BBox wide_child_bounds(const BVHBuffer &buffer, int node, int i, bool quantized)
+{
+	int group = wide_group(node, i, quantized);
+	int lane = i % BVH_WIDE_GROUP;
+
+	BBox box;
+	if (!quantized) {
+		for (int a = 0; a < 3; a++) {
+			box.min[a] = buffer[group + a].v[lane];
+			box.max[a] = buffer[group + 3 + a].v[lane];
+		}
+
+		return box;
+	}
+
+	BVHQuantization grid(buffer[node].v);
+	for (int a = 0; a < 3; a++) {
+		uint32_t qmin = float_to_bits(buffer[group + a / 4].v[a % 4]);
+		uint32_t qmax = float_to_bits(buffer[group + (3 + a) / 4].v[(3 + a) % 4]);
+
+		box.min[a] = grid.decode((qmin >> (8 * lane)) & 0xff, a);
+		box.max[a] = grid.decode((qmax >> (8 * lane)) & 0xff, a);
+	}
+
+	return box;
+}
+
+// Link of child i of a wide node
+inline int wide_child_link(const BVHBuffer &buffer, int node, int i, bool quantized)
+{
+	int group = wide_group(node, i, quantized);
+	return float_to_bits(buffer[group + (quantized ? 2 : 6)].v[i % BVH_WIDE_GROUP]);
+}
+
+// Collects the binary subtrees that become the children of a wide node:
+// starting from the two children of the root, the inner child with the
+// largest surface area is opened until the node is full
+inline int wide_children(const BVH &bvh, int node, int width, int *children)
+{
+	int count = 0;
+	children[count++] = bvh.nodes[node].left;
+	children[count++] = bvh.nodes[node].right;
+
+	while (count < width) {
+		int best = -1;
+		float best_area = -1.0f;
+
+		for (int i = 0; i < count; i++) {
+			const BVHNode &child = bvh.nodes[children[i]];
+			if (child.left == -1)
+				continue;
+
+			float area = child.bbox.surface_area();
+			if (area > best_area) {
+				best = i;
+				best_area = area;
+			}
+		}
+
+		if (best == -1)
+			break;
+
+		int opened = children[best];
+		children[best] = bvh.nodes[opened].left;
+		children[count++] = bvh.nodes[opened].right;
+	}
+
+	return count;
+}
+
+// Write the header of a quantized node for the given box
+inline void set_quantized_header(BVHBuffer &buffer, int offset, const BBox &box)
+{
+	buffer[offset] = BVHQuantization(box).header();
+}
+
+// Write the wide node for a binary inner node at offset, and its subtree
+// after it in pre-order; returns the offset past the subtree
+inline int collapse_wide(const BVH &bvh, int node, int width, bool quantized,
+		BVHBuffer &buffer, int offset)
+{
+	int children[8];
+	int count = wide_children(bvh, node, width, children);
+
+	int next = offset + wide_node_size(width, quantized);
+	buffer.resize(std::max((int) buffer.size(), next));
+
+	if (quantized)
+		set_quantized_header(buffer, offset, bvh.nodes[node].bbox);
+
+	for (int i = 0; i < width; i++) {
+		BBox box = BBox::empty();
+		int link = BVH_WIDE_EMPTY;
+
+		if (i < count) {
+			const BVHNode &child = bvh.nodes[children[i]];
+			box = child.bbox;
+
+			if (child.left == -1) {
+				link = wide_leaf(child.primitive);
+			} else {
+				link = next;
+				next = collapse_wide(bvh, children[i], width, quantized, buffer, next);
+			}
+		}
+
+		if (quantized)
+			set_quantized_child(buffer, offset, i, box, link);
+		else
+			set_wide_child(buffer, offset, i, box, link);
+	}
+
+	return next;
+}
+
+// Serialize a binary BVH as a wide BVH of 4 or 8 children per node; a
+// single leaf root still gets a wide node, with one child
+inline void serialize_wide(const BVH &bvh, int width, BVHBuffer &buffer, bool quantized = false)
+{
+	int base = buffer.size();
+	if (bvh.nodes.empty())
+		return;
+
+	const BVHNode &root = bvh.nodes[0];
+	if (root.left != -1) {
+		collapse_wide(bvh, 0, width, quantized, buffer, base);
+		return;
+	}
+
+	buffer.resize(base + wide_node_size(width, quantized));
+	if (quantized)
+		set_quantized_header(buffer, base, root.bbox);
+
+	for (int i = 0; i < width; i++) {
+		BBox box = i ? BBox::empty() : root.bbox;
+		int link = i ? BVH_WIDE_EMPTY : wide_leaf(root.primitive);
+
+		if (quantized)
+			set_quantized_child(buffer, base, i, box, link);
+		else
+			set_wide_child(buffer, base, i, box, link);
+	}
+}
+
+#endif